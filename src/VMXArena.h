@@ -0,0 +1,88 @@
+#ifndef __VMXARENA_H__
+#define __VMXARENA_H__
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#ifdef ARDUINO
+#include <Arduino.h>
+#include "VMXTrace.h"
+#include "VMXHeap.h"
+#endif
+
+#define REQUEST_ARENA_SIZE 2048
+
+// Bump allocator for short-lived strings built while handling one HTTP request.
+// All HTTP handlers run on the async_tcp task, so a single static arena is enough;
+// RequestScope resets it when the handler returns. Nothing here touches the heap.
+class BumpArena
+{
+public:
+  char *alloc(size_t size)
+  {
+    size = (size + 3) & ~(size_t)3;
+    if (mUsed + size > sizeof(mBuffer))
+    {
+      mFailures++;
+      return nullptr;
+    }
+    char *p = mBuffer + mUsed;
+    mUsed += size;
+    if (mUsed > mHighWater)
+    {
+      mHighWater = mUsed;
+    }
+    return p;
+  }
+
+  // printf into the arena. Returns "" if the arena is exhausted.
+  const char *printf(const char *format, ...)
+  {
+    va_list args;
+    va_start(args, format);
+    size_t avail = sizeof(mBuffer) - mUsed;
+    int len = vsnprintf(mBuffer + mUsed, avail, format, args);
+    va_end(args);
+    if (len < 0 || (size_t)len >= avail)
+    {
+      mFailures++;
+      return "";
+    }
+    char *p = alloc(len + 1);
+    return p ? p : "";
+  }
+
+  const char *strdup(const char *s)
+  {
+    return printf("%s", s);
+  }
+
+  void reset() { mUsed = 0; }
+  size_t highWater() const { return mHighWater; }
+  uint32_t failures() const { return mFailures; }
+
+private:
+  char mBuffer[REQUEST_ARENA_SIZE];
+  size_t mUsed = 0;
+  size_t mHighWater = 0;
+  uint32_t mFailures = 0;
+};
+
+#ifdef ARDUINO // BumpArena alone builds on the host, see test/test_arena
+
+BumpArena requestArena;
+
+struct RequestScope
+{
+  RequestScope() { requestArena.reset(); }
+  ~RequestScope() { requestArena.reset(); }
+  HeapScope heap{HEAPTAG_HTTP};
+#ifdef VMX_TRACE
+  TraceScope trace{TRACE_HTTP_REQUEST}; // the handler, from here to its return
+#endif
+};
+
+#endif // ARDUINO
+
+#endif // __VMXARENA_H__
@@ -0,0 +1,85 @@
+#ifndef __VMXBOOT_H__
+#define __VMXBOOT_H__
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+
+#define BOOT_PROFILE_MAGIC 0x564D5842 // "VMXB"
+#define BOOT_DEFER_TIMEOUT 30000      // start deferred services after 30 seconds even without MQTT
+
+// Boot phases, in the order they normally complete.
+enum BootPhase
+{
+  BOOT_PHASE_SETUP = 0,  // setup() entered
+  BOOT_PHASE_EEPROM,     // EEPROM read and validated
+  BOOT_PHASE_WIFI,       // STA connected or soft AP started
+  BOOT_PHASE_MQTT,       // first MQTT connect (device controllable)
+  BOOT_PHASE_FILESYSTEM, // LittleFS mounted and log file ready
+  BOOT_PHASE_MDNS,       // mDNS responder started
+  BOOT_PHASE_HTTP,       // web server started
+  BOOT_PHASE_MAX
+};
+
+static const char *const bootPhaseNames[BOOT_PHASE_MAX] = {
+    "setup", "eeprom", "wifi", "mqtt", "filesystem", "mdns", "http"};
+
+// Kept in RTC slow memory so the previous boot's timings survive a software reset.
+struct BootProfile
+{
+  uint32_t magic;
+  uint32_t bootCount;
+  uint32_t phaseUs[BOOT_PHASE_MAX];     // 0 = phase not reached
+  uint32_t prevPhaseUs[BOOT_PHASE_MAX];
+};
+
+RTC_NOINIT_ATTR BootProfile bootProfile;
+
+bool mDeferredInitDone = false;
+
+// Must be called first thing in setup().
+inline void bootProfileBegin()
+{
+  if (bootProfile.magic != BOOT_PROFILE_MAGIC || esp_reset_reason() == ESP_RST_POWERON)
+  {
+    memset(&bootProfile, 0, sizeof(bootProfile));
+    bootProfile.magic = BOOT_PROFILE_MAGIC;
+  }
+  memcpy(bootProfile.prevPhaseUs, bootProfile.phaseUs, sizeof(bootProfile.phaseUs));
+  memset(bootProfile.phaseUs, 0, sizeof(bootProfile.phaseUs));
+  bootProfile.bootCount++;
+  bootProfile.phaseUs[BOOT_PHASE_SETUP] = (uint32_t)esp_timer_get_time();
+}
+
+// Record the first time a phase completes; later calls are ignored.
+inline void bootProfileMark(BootPhase phase)
+{
+  if (phase < BOOT_PHASE_MAX && bootProfile.phaseUs[phase] == 0)
+  {
+    bootProfile.phaseUs[phase] = (uint32_t)esp_timer_get_time();
+  }
+}
+
+inline void bootProfileToJson(JsonDocument &doc)
+{
+  doc["boot_count"] = bootProfile.bootCount;
+  doc["reset_reason"] = (int)esp_reset_reason();
+  doc["deferred_init_done"] = mDeferredInitDone;
+  JsonObject cur = doc.createNestedObject("phases_us");
+  JsonObject prev = doc.createNestedObject("prev_phases_us");
+  for (int i = 0; i < BOOT_PHASE_MAX; i++)
+  {
+    if (bootProfile.phaseUs[i])
+    {
+      cur[bootPhaseNames[i]] = bootProfile.phaseUs[i];
+    }
+    if (bootProfile.prevPhaseUs[i])
+    {
+      prev[bootPhaseNames[i]] = bootProfile.prevPhaseUs[i];
+    }
+  }
+}
+
+#endif // __VMXBOOT_H__
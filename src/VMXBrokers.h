@@ -0,0 +1,341 @@
+#ifndef __VMXBROKERS_H__
+#define __VMXBROKERS_H__
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <fcntl.h>
+#include "lwip/sockets.h"
+
+#define BROKER_MAX_FALLBACKS 3
+#define BROKER_MAX (BROKER_MAX_FALLBACKS + 1)
+#define BROKER_HOST_SIZE 16              // dotted quad + '\0', as EEPROM_CTRLBOX_IP_SIZE
+#define BROKER_LIST_SIZE 64              // "ip,ip,..." as stored in EEPROM
+#define BROKER_RETRY_MS 1000             // after a failed connect to the only broker
+#define BROKER_BACKOFF_MS 5000           // after a failed connect, doubled per further failure
+#define BROKER_MAX_BACKOFF_MS 300000
+#define BROKER_FAILURE_PENALTY_MS 5000   // score of one recent failure, in connect time
+#define BROKER_ORDER_PENALTY_MS 2000     // score of one place further down the list
+#define BROKER_FAILURE_HALFLIFE_MS 60000 // recent failures halve this often
+#define BROKER_FALLBACK_CHECK_MS 60000   // on a fallback: how often the preferred broker is probed
+#define BROKER_PROBE_TIMEOUT_MS 1000
+#define BROKER_PROBE_POLL_MS 100         // how often a running probe is checked
+
+// Comma separated fallback brokers, persisted in EEPROM. The preferred broker is the
+// ControlBox address set through /api/v1/add.
+char mBrokerFallbacks[BROKER_LIST_SIZE] = {};
+
+// Validates a JSON array of broker IP addresses and joins it into out. Returns false on any
+// invalid entry.
+inline bool brokerListFromJson(JsonArrayConst brokers, char *out, size_t len)
+{
+  if (brokers.size() > BROKER_MAX_FALLBACKS)
+  {
+    return false;
+  }
+  out[0] = '\0';
+  for (JsonVariantConst broker : brokers)
+  {
+    const char *host = broker.as<const char *>();
+    IPAddress ip;
+    if (!host || strlen(host) >= BROKER_HOST_SIZE || !ip.fromString(host))
+    {
+      return false;
+    }
+    if (out[0])
+    {
+      strlcat(out, ",", len);
+    }
+    strlcat(out, host, len);
+  }
+  return true;
+}
+
+// Picks the MQTT broker to connect to from the preferred one and its fallbacks. Each broker
+// is scored by its smoothed connect time, its recent failures and its place in the list,
+// lowest first; a broker that failed is skipped for an exponential backoff. A single broker
+// has nowhere else to go and is retried every BROKER_RETRY_MS instead. Network task only.
+class BrokerSelector
+{
+public:
+  // Preferred broker first, then the comma separated fallbacks. Forgets the health data.
+  void configure(const char *preferred, const char *fallbacks)
+  {
+    mCount = 0;
+    mCurrent = -1;
+    if (preferred && preferred[0])
+    {
+      add(preferred, strlen(preferred));
+    }
+    const char *p = fallbacks;
+    while (p && *p && mCount < BROKER_MAX)
+    {
+      const char *comma = strchr(p, ',');
+      size_t len = comma ? (size_t)(comma - p) : strlen(p);
+      if (len && len < BROKER_HOST_SIZE)
+      {
+        add(p, len);
+      }
+      p = comma ? comma + 1 : nullptr;
+    }
+  }
+
+  size_t count() const { return mCount; }
+  const char *host(int i) const { return mBrokers[i].host; }
+
+  // Index of the connected broker, -1 while disconnected.
+  int current() const { return mCurrent; }
+
+  // Broker to try next: the best scored one out of backoff, else the one whose backoff ends
+  // first. -1 when no broker is configured.
+  int pick() const
+  {
+    uint32_t now = millis();
+    int best = -1;
+    uint32_t bestScore = UINT32_MAX;
+    int soonest = -1;
+    int32_t soonestWait = INT32_MAX;
+    for (size_t i = 0; i < mCount; i++)
+    {
+      int32_t wait = (int32_t)(mBrokers[i].retryAt - now);
+      if (mBrokers[i].failures && wait > 0)
+      {
+        if (wait < soonestWait)
+        {
+          soonest = i;
+          soonestWait = wait;
+        }
+        continue;
+      }
+      uint32_t s = score(i, now);
+      if (s < bestScore)
+      {
+        best = i;
+        bestScore = s;
+      }
+    }
+    return best >= 0 ? best : soonest;
+  }
+
+  // True when broker i is out of its backoff.
+  bool ready(int i) const
+  {
+    return !mBrokers[i].failures || (int32_t)(mBrokers[i].retryAt - millis()) <= 0;
+  }
+
+  // ms until pick() has a broker out of backoff: 0 when one is ready, UINT32_MAX when no
+  // broker is configured.
+  uint32_t waitMs() const
+  {
+    int i = pick();
+    if (i < 0)
+    {
+      return UINT32_MAX;
+    }
+    int32_t wait = (int32_t)(mBrokers[i].retryAt - millis());
+    return mBrokers[i].failures && wait > 0 ? wait : 0;
+  }
+
+  void connected(int i, uint32_t connectMs)
+  {
+    Broker &b = mBrokers[i];
+    b.connectMs = b.connects ? (b.connectMs * 3 + connectMs) / 4 : connectMs;
+    b.connects++;
+    mCurrent = i;
+  }
+
+  // Connect to broker i failed: it is skipped for a backoff growing with its failures, or
+  // BROKER_RETRY_MS when it is the only one.
+  void failed(int i)
+  {
+    Broker &b = mBrokers[i];
+    uint32_t now = millis();
+    b.failures = recentFailures(b, now) + 1;
+    b.lastFailure = now;
+    b.totalFailures++;
+    uint32_t backoff = BROKER_BACKOFF_MS << min(b.failures - 1, (uint32_t)6);
+    b.retryAt = now + (mCount == 1 ? BROKER_RETRY_MS : min(backoff, (uint32_t)BROKER_MAX_BACKOFF_MS));
+    if (mCurrent == i)
+    {
+      mCurrent = -1;
+    }
+  }
+
+  // Broker i answered a probe: its failures are forgotten.
+  void reachable(int i)
+  {
+    mBrokers[i].failures = 0;
+    mBrokers[i].retryAt = millis();
+  }
+
+  // We are leaving the current broker on purpose; not held against it.
+  void disconnected() { mCurrent = -1; }
+
+  // The connection to the current broker dropped. Counts against its score, without backoff,
+  // so a flapping broker loses its place while a single drop is retried at once.
+  void dropped()
+  {
+    if (mCurrent < 0)
+    {
+      return;
+    }
+    Broker &b = mBrokers[mCurrent];
+    uint32_t now = millis();
+    b.failures = recentFailures(b, now) + 1;
+    b.lastFailure = now;
+    b.retryAt = now;
+    b.drops++;
+    mCurrent = -1;
+  }
+
+  void toJson(JsonArray arr) const
+  {
+    uint32_t now = millis();
+    for (size_t i = 0; i < mCount; i++)
+    {
+      const Broker &b = mBrokers[i];
+      JsonObject obj = arr.createNestedObject();
+      obj["host"] = b.host;
+      obj["current"] = (int)i == mCurrent;
+      obj["score"] = score(i, now);
+      obj["connect_ms"] = b.connectMs;
+      obj["connects"] = b.connects;
+      obj["failures"] = b.totalFailures;
+      obj["drops"] = b.drops;
+      obj["ready"] = ready(i);
+    }
+  }
+
+private:
+  struct Broker
+  {
+    char host[BROKER_HOST_SIZE];
+    uint32_t connectMs; // smoothed, 0 before the first connect
+    uint32_t connects;
+    uint32_t failures;  // recent, see recentFailures()
+    uint32_t lastFailure;
+    uint32_t retryAt;
+    uint32_t totalFailures;
+    uint32_t drops;
+  };
+
+  void add(const char *host, size_t len)
+  {
+    Broker &b = mBrokers[mCount++];
+    b = {};
+    memcpy(b.host, host, min(len, (size_t)BROKER_HOST_SIZE - 1));
+  }
+
+  static uint32_t recentFailures(const Broker &b, uint32_t now)
+  {
+    uint32_t halvings = (now - b.lastFailure) / BROKER_FAILURE_HALFLIFE_MS;
+    return halvings >= 32 ? 0 : b.failures >> halvings;
+  }
+
+  uint32_t score(size_t i, uint32_t now) const
+  {
+    const Broker &b = mBrokers[i];
+    return b.connectMs + recentFailures(b, now) * BROKER_FAILURE_PENALTY_MS + i * BROKER_ORDER_PENALTY_MS;
+  }
+
+  Broker mBrokers[BROKER_MAX] = {};
+  size_t mCount = 0;
+  int mCurrent = -1;
+};
+
+enum PROBE
+{
+  PROBE_IDLE = 0,
+  PROBE_PENDING,
+  PROBE_UP,
+  PROBE_DOWN,
+  PROBE_MAX
+};
+
+// TCP connect to a broker that does not block the caller: start() begins a non-blocking
+// connect and poll() looks at it without waiting, until it is answered or
+// BROKER_PROBE_TIMEOUT_MS passed.
+class BrokerProbe
+{
+public:
+  void start(const char *host, uint16_t port)
+  {
+    stop();
+    mResult = PROBE_DOWN;
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (!inet_aton(host, &addr.sin_addr))
+    {
+      return;
+    }
+    mFd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (mFd < 0)
+    {
+      return;
+    }
+    fcntl(mFd, F_SETFL, fcntl(mFd, F_GETFL, 0) | O_NONBLOCK);
+    mStartMs = millis();
+    if (connect(mFd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    {
+      finish(PROBE_UP);
+    }
+    else if (errno == EINPROGRESS)
+    {
+      mResult = PROBE_PENDING;
+    }
+    else
+    {
+      finish(PROBE_DOWN);
+    }
+  }
+
+  // PROBE_PENDING while the connect runs, then PROBE_UP or PROBE_DOWN until stop().
+  uint8_t poll()
+  {
+    if (mFd < 0)
+    {
+      return mResult;
+    }
+    fd_set writable;
+    FD_ZERO(&writable);
+    FD_SET(mFd, &writable);
+    struct timeval noWait = {0, 0};
+    int ret = select(mFd + 1, NULL, &writable, NULL, &noWait);
+    if (ret > 0)
+    {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      getsockopt(mFd, SOL_SOCKET, SO_ERROR, &err, &len);
+      finish(err ? PROBE_DOWN : PROBE_UP);
+    }
+    else if (ret < 0 || millis() - mStartMs > BROKER_PROBE_TIMEOUT_MS)
+    {
+      finish(PROBE_DOWN);
+    }
+    return mResult;
+  }
+
+  void stop()
+  {
+    if (mFd >= 0)
+    {
+      close(mFd);
+      mFd = -1;
+    }
+    mResult = PROBE_IDLE;
+  }
+
+private:
+  void finish(uint8_t result)
+  {
+    close(mFd);
+    mFd = -1;
+    mResult = result;
+  }
+
+  int mFd = -1;
+  uint8_t mResult = PROBE_IDLE;
+  uint32_t mStartMs = 0;
+};
+
+#endif // __VMXBROKERS_H__
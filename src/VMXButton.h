@@ -0,0 +1,115 @@
+#ifndef __VMXBUTTON_H__
+#define __VMXBUTTON_H__
+
+#include <Arduino.h>
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+// Short and long presses of a push button, from debounced edges delivered by the GPIO
+// interrupt (see RuleEngine::onEdge). A press arms an esp_timer one-shot for the long press
+// threshold, so a long press is recognised while the button is still held and nothing is
+// polled; releasing before it fires is a short press. A long press only counts if the pin
+// still reads pressed when the timer fires, so a glitch whose release edge was lost cannot
+// turn into one. Both are counted and the owner task is notified; it compares the counters
+// with what it has handled.
+class ButtonWatcher
+{
+public:
+  // pin is active low, as the reset button with its pull-up.
+  bool begin(uint8_t pin, uint32_t longPressMs, TaskHandle_t *notify)
+  {
+    mPin = pin;
+    mLongPressUs = (uint64_t)longPressMs * 1000;
+    mNotify = notify;
+    esp_timer_create_args_t args = {};
+    args.callback = onLongPress;
+    args.arg = this;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "button";
+    return esp_timer_create(&args, &mTimer) == ESP_OK;
+  }
+
+  // Debounced edge, from the GPIO interrupt or the end of its lockout (esp_timer task).
+  void edge(bool pressed)
+  {
+    portENTER_CRITICAL_SAFE(&mMux);
+    if (pressed)
+    {
+      mHeld = true;
+      mLongFired = false;
+      esp_timer_stop(mTimer);
+      esp_timer_start_once(mTimer, mLongPressUs);
+      portEXIT_CRITICAL_SAFE(&mMux);
+      return;
+    }
+    bool shortPress = mHeld && !mLongFired;
+    mHeld = false;
+    esp_timer_stop(mTimer);
+    if (shortPress)
+    {
+      mShortPresses++;
+    }
+    portEXIT_CRITICAL_SAFE(&mMux);
+    if (shortPress)
+    {
+      notify();
+    }
+  }
+
+  uint32_t shortPresses() const { return mShortPresses; }
+  uint32_t longPresses() const { return mLongPresses; }
+
+private:
+  static void onLongPress(void *arg)
+  {
+    ButtonWatcher *self = (ButtonWatcher *)arg;
+    bool pressed = digitalRead(self->mPin) == LOW;
+    portENTER_CRITICAL(&self->mMux);
+    bool fire = self->mHeld && !self->mLongFired && pressed;
+    if (fire)
+    {
+      self->mLongFired = true;
+      self->mLongPresses++;
+    }
+    else if (!pressed)
+    {
+      self->mHeld = false; // released without an edge reaching us
+    }
+    portEXIT_CRITICAL(&self->mMux);
+    if (fire)
+    {
+      self->notify();
+    }
+  }
+
+  void notify()
+  {
+    if (!mNotify || !*mNotify)
+    {
+      return;
+    }
+    if (xPortInIsrContext())
+    {
+      BaseType_t woken = pdFALSE;
+      vTaskNotifyGiveFromISR(*mNotify, &woken);
+      portYIELD_FROM_ISR(woken);
+    }
+    else
+    {
+      xTaskNotifyGive(*mNotify);
+    }
+  }
+
+  portMUX_TYPE mMux = portMUX_INITIALIZER_UNLOCKED;
+  esp_timer_handle_t mTimer = nullptr;
+  uint8_t mPin = 0;
+  uint64_t mLongPressUs = 0;
+  TaskHandle_t *mNotify = nullptr;
+  bool mHeld = false;
+  bool mLongFired = false;
+  volatile uint32_t mShortPresses = 0;
+  volatile uint32_t mLongPresses = 0;
+};
+
+#endif // __VMXBUTTON_H__
@@ -0,0 +1,143 @@
+#ifndef __VMXCLOCK_H__
+#define __VMXCLOCK_H__
+
+#include <Arduino.h>
+#include <sys/time.h>
+#include "esp_timer.h"
+#include "esp_sntp.h"
+#include "freertos/FreeRTOS.h"
+
+#define NTP_SERVER1 "pool.ntp.org"
+#define NTP_SERVER2 "time.nist.gov"
+#define DATETIME_STRING_SIZE 20 // "YYYY-MM-DD HH:MM:SS" + '\0'
+
+// Epoch time = esp_timer_get_time() + mEpochOffsetUs, captured by the SNTP sync callback.
+// The monotonic timer never blocks and is unaffected by later settimeofday() calls.
+// The offset is written on the lwIP task and read from every task, both cores and the
+// rules interrupt; a 64-bit access is two loads on Xtensa, so it is only touched under
+// mClockMux (see clockOffsetUs()).
+int64_t mEpochOffsetUs = 0;
+volatile bool mClockSynced = false;
+portMUX_TYPE mClockMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Date of the last formatted timestamp, packed so readers on any task see it
+// in one 32-bit load: [31:25] year-2000, [24:21] month, [20:16] day, [15:0] days since 1970.
+volatile uint32_t mCachedDate = 0;
+
+static void onTimeSync(struct timeval *tv)
+{
+  int64_t offsetUs = (int64_t)tv->tv_sec * 1000000LL + tv->tv_usec - esp_timer_get_time();
+  portENTER_CRITICAL_SAFE(&mClockMux);
+  mEpochOffsetUs = offsetUs;
+  mClockSynced = true;
+  portEXIT_CRITICAL_SAFE(&mClockMux);
+}
+
+// mEpochOffsetUs in one piece; safe from tasks and interrupts.
+inline int64_t clockOffsetUs()
+{
+  portENTER_CRITICAL_SAFE(&mClockMux);
+  int64_t offsetUs = mEpochOffsetUs;
+  portEXIT_CRITICAL_SAFE(&mClockMux);
+  return offsetUs;
+}
+
+// Non-blocking replacement for the old "wait until time(nullptr) looks valid" loop.
+inline void clockBegin()
+{
+  sntp_set_time_sync_notification_cb(onTimeSync);
+  configTime(0, 0, NTP_SERVER1, NTP_SERVER2); // UTC
+}
+
+// Seconds since 1970-01-01 UTC, 0 until the first SNTP sync.
+inline uint32_t clockEpoch()
+{
+  if (!mClockSynced)
+  {
+    return 0;
+  }
+  return (uint32_t)((esp_timer_get_time() + clockOffsetUs()) / 1000000LL);
+}
+
+// Milliseconds to the next whole second of the epoch clock (of uptime before the first sync).
+inline uint32_t clockMsToNextSecond()
+{
+  int64_t us = esp_timer_get_time() + (mClockSynced ? clockOffsetUs() : 0);
+  return 1000 - (uint32_t)((us / 1000) % 1000);
+}
+
+// esp_timer time of an epoch timestamp in milliseconds, or 0 before the first SNTP sync.
+inline int64_t clockTimerUsFromEpochMs(uint64_t epochMs)
+{
+  if (!mClockSynced)
+  {
+    return 0;
+  }
+  return (int64_t)epochMs * 1000LL - clockOffsetUs();
+}
+
+// Civil date from days since 1970-01-01 (H. Hinnant's days_from_civil inverse).
+static uint32_t clockPackDate(uint32_t days)
+{
+  uint32_t z = days + 719468;
+  uint32_t era = z / 146097;
+  uint32_t doe = z - era * 146097;
+  uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  uint32_t mp = (5 * doy + 2) / 153;
+  uint32_t d = doy - (153 * mp + 2) / 5 + 1;
+  uint32_t m = mp < 10 ? mp + 3 : mp - 9;
+  uint32_t y = yoe + era * 400 + (m <= 2);
+  return ((y - 2000) << 25) | (m << 21) | (d << 16) | (days & 0xFFFF);
+}
+
+static inline void put2(char *p, uint32_t v)
+{
+  p[0] = '0' + v / 10;
+  p[1] = '0' + v % 10;
+}
+
+// Format: "YYYY-MM-DD HH:MM:SS". The date part is recomputed only when the day rolls over.
+inline void clockFormat(char *buffer, size_t len)
+{
+  if (len < DATETIME_STRING_SIZE)
+  {
+    if (len)
+    {
+      buffer[0] = '\0';
+    }
+    return;
+  }
+  if (!mClockSynced)
+  {
+    memcpy(buffer, "0000-00-00 00:00:00", DATETIME_STRING_SIZE);
+    return;
+  }
+
+  uint32_t epoch = clockEpoch();
+  uint32_t days = epoch / 86400;
+  uint32_t secs = epoch % 86400;
+  uint32_t date = mCachedDate;
+  if ((date & 0xFFFF) != (days & 0xFFFF) || date == 0)
+  {
+    date = clockPackDate(days);
+    mCachedDate = date;
+  }
+
+  uint32_t year = 2000 + (date >> 25);
+  put2(buffer, year / 100);
+  put2(buffer + 2, year % 100);
+  buffer[4] = '-';
+  put2(buffer + 5, (date >> 21) & 0x0F);
+  buffer[7] = '-';
+  put2(buffer + 8, (date >> 16) & 0x1F);
+  buffer[10] = ' ';
+  put2(buffer + 11, secs / 3600);
+  buffer[13] = ':';
+  put2(buffer + 14, (secs / 60) % 60);
+  buffer[16] = ':';
+  put2(buffer + 17, secs % 60);
+  buffer[19] = '\0';
+}
+
+#endif // __VMXCLOCK_H__
@@ -0,0 +1,123 @@
+#ifndef __VMXCODEC_H__
+#define __VMXCODEC_H__
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+/*
+ * Compact MessagePack encoding of the command protocol, used on every command topic
+ * with MSGPACK_TOPIC_SUFFIX appended; replies go to relay2CtrlBoxTopic + suffix.
+ * A map with one-letter keys, the string enums sent as integers:
+ *
+ *   "a" action    0 = control
+ *   "c" command   0 = update, 1 = updateByAccessControl, 2 = remove, 3 = setGroups
+ *   "d" deviceId  string
+ *   "s" sender    string
+ *   "v" state     0 / 1
+ *   "g" group     string (group command replies)
+ *   "G" groups    array of strings (setGroups)
+ *   "t" at        epoch ms (group commands)
+ *   "k" ack       0 = none, 1 = each (group commands)
+ *   "u" duration  ms (updateByAccessControl)
+ *   "q" sequence  array of ms (updateByAccessControl)
+ *   "r" result    0 = success, -1 = failure, -2 = device id invalid, -3 = parameter invalid,
+ *                 1 = completed (remove)
+ *
+ * {"action":"control","command":"update","deviceId":"3C61052A1B2C","state":1,"sender":"a1b2c3"}
+ * is 93 bytes as JSON and 34 bytes as above.
+ */
+#define MSGPACK_TOPIC_SUFFIX "/mp"
+
+static const char *const codecActionNames[] = {"control"};
+static const char *const codecCommandNames[] = {"update", "updateByAccessControl", "remove", "setGroups"};
+
+template <size_t N>
+int codecCode(const char *const (&names)[N], const char *name)
+{
+  if (!name)
+  {
+    return -1;
+  }
+  for (size_t i = 0; i < N; i++)
+  {
+    if (strcmp(names[i], name) == 0)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+template <size_t N>
+const char *codecName(const char *const (&names)[N], JsonVariantConst code)
+{
+  if (!code.is<int>())
+  {
+    return nullptr;
+  }
+  int i = code.as<int>();
+  return (i >= 0 && (size_t)i < N) ? names[i] : nullptr;
+}
+
+// Strips MSGPACK_TOPIC_SUFFIX from topic in place; true if it was there.
+inline bool codecStripTopicSuffix(char *topic)
+{
+  size_t len = strlen(topic);
+  size_t n = sizeof(MSGPACK_TOPIC_SUFFIX) - 1;
+  if (len <= n || strcmp(topic + len - n, MSGPACK_TOPIC_SUFFIX) != 0)
+  {
+    return false;
+  }
+  topic[len - n] = '\0';
+  return true;
+}
+
+// Adds the JSON protocol keys for a decoded compact command, so the command handlers read
+// both encodings the same way. Names are static strings, stored by pointer.
+inline void codecExpandCommand(JsonDocument &doc)
+{
+  const char *action = codecName(codecActionNames, doc["a"]);
+  const char *command = codecName(codecCommandNames, doc["c"]);
+  if (action)
+  {
+    doc["action"] = action;
+  }
+  if (command)
+  {
+    doc["command"] = command;
+  }
+  if (!doc["d"].isNull())
+  {
+    doc["deviceId"] = doc["d"];
+  }
+  if (!doc["s"].isNull())
+  {
+    doc["sender"] = doc["s"];
+  }
+  if (!doc["v"].isNull())
+  {
+    doc["state"] = doc["v"];
+  }
+  if (!doc["G"].isNull())
+  {
+    doc["groups"] = doc["G"];
+  }
+  if (!doc["t"].isNull())
+  {
+    doc["at"] = doc["t"];
+  }
+  if (!doc["u"].isNull())
+  {
+    doc["duration"] = doc["u"];
+  }
+  if (!doc["q"].isNull())
+  {
+    doc["sequence"] = doc["q"];
+  }
+  if (doc["k"] == 1)
+  {
+    doc["ack"] = "each";
+  }
+}
+
+#endif // __VMXCODEC_H__
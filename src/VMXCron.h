@@ -0,0 +1,224 @@
+#ifndef __VMXCRON_H__
+#define __VMXCRON_H__
+
+#include <Arduino.h>
+#include "VMXClock.h"
+
+#define CRON_SEARCH_DAYS 2922 // 8 years, enough for "29 2" to come around
+
+// Compiled "minute hour day-of-month month day-of-week" expression, one bit per value.
+// Fields take *, n, a-b, */s, a-b/s and comma separated lists; day-of-week 0 and 7 are Sunday.
+struct CronSpec
+{
+  uint64_t minutes;  // bits 0..59
+  uint32_t hours;    // bits 0..23
+  uint32_t days;     // bits 1..31
+  uint16_t months;   // bits 1..12
+  uint8_t weekdays;  // bits 0..6
+  bool daysAny;      // day-of-month was "*"
+  bool weekdaysAny;  // day-of-week was "*"
+};
+
+// Parses one field into bits [lo, hi]. Advances *p past the field.
+static bool cronParseField(const char **p, int lo, int hi, uint64_t *bits, bool *any)
+{
+  const char *s = *p;
+  *bits = 0;
+  *any = false;
+  for (;;)
+  {
+    int from, to, step = 1;
+    if (*s == '*')
+    {
+      from = lo;
+      to = hi;
+      *any = true;
+      s++;
+    }
+    else if (isdigit((unsigned char)*s))
+    {
+      from = strtol(s, (char **)&s, 10);
+      to = from;
+      if (*s == '-')
+      {
+        s++;
+        if (!isdigit((unsigned char)*s))
+        {
+          return false;
+        }
+        to = strtol(s, (char **)&s, 10);
+      }
+    }
+    else
+    {
+      return false;
+    }
+    if (*s == '/')
+    {
+      s++;
+      if (!isdigit((unsigned char)*s))
+      {
+        return false;
+      }
+      step = strtol(s, (char **)&s, 10);
+      if (from == to)
+      {
+        to = hi; // "5/15" means 5, 20, 35, 50
+      }
+    }
+    if (from < lo || to > hi || from > to || step < 1)
+    {
+      return false;
+    }
+    for (int v = from; v <= to; v += step)
+    {
+      *bits |= 1ULL << v;
+    }
+    if (*s != ',')
+    {
+      break;
+    }
+    s++;
+  }
+  if (*s && *s != ' ')
+  {
+    return false;
+  }
+  while (*s == ' ')
+  {
+    s++;
+  }
+  *p = s;
+  return true;
+}
+
+inline bool cronParse(const char *expr, CronSpec &spec)
+{
+  uint64_t bits;
+  bool any;
+  const char *p = expr;
+  while (*p == ' ')
+  {
+    p++;
+  }
+  if (!cronParseField(&p, 0, 59, &bits, &any))
+  {
+    return false;
+  }
+  spec.minutes = bits;
+  if (!cronParseField(&p, 0, 23, &bits, &any))
+  {
+    return false;
+  }
+  spec.hours = bits;
+  if (!cronParseField(&p, 1, 31, &bits, &any))
+  {
+    return false;
+  }
+  spec.days = bits;
+  spec.daysAny = any;
+  if (!cronParseField(&p, 1, 12, &bits, &any))
+  {
+    return false;
+  }
+  spec.months = bits;
+  if (!cronParseField(&p, 0, 7, &bits, &any))
+  {
+    return false;
+  }
+  spec.weekdays = (bits | (bits >> 7)) & 0x7F;
+  spec.weekdaysAny = any;
+  return *p == '\0';
+}
+
+// Day (days since 1970-01-01) matches month, day-of-month and day-of-week. As in cron,
+// a day matches either day field when both are restricted.
+static bool cronDayMatches(const CronSpec &spec, uint32_t day)
+{
+  uint32_t date = clockPackDate(day);
+  if (!(spec.months & (1U << ((date >> 21) & 0x0F))))
+  {
+    return false;
+  }
+  bool dom = spec.days & (1UL << ((date >> 16) & 0x1F));
+  bool dow = spec.weekdays & (1U << ((day + 4) % 7)); // 1970-01-01 was a Thursday
+  if (!spec.daysAny && !spec.weekdaysAny)
+  {
+    return dom || dow;
+  }
+  return dom && dow;
+}
+
+// First minute at or after minute-of-day from with a matching hour and minute, or -1.
+static int cronFirstMinute(const CronSpec &spec, int from)
+{
+  for (int h = from / 60; h < 24; h++)
+  {
+    if (!(spec.hours & (1UL << h)))
+    {
+      continue;
+    }
+    int m = (h == from / 60) ? from % 60 : 0;
+    uint64_t bits = spec.minutes >> m << m;
+    if (bits)
+    {
+      return h * 60 + __builtin_ctzll(bits);
+    }
+  }
+  return -1;
+}
+
+// Last minute at or before minute-of-day from with a matching hour and minute, or -1.
+static int cronLastMinute(const CronSpec &spec, int from)
+{
+  for (int h = from / 60; h >= 0; h--)
+  {
+    if (!(spec.hours & (1UL << h)))
+    {
+      continue;
+    }
+    int m = (h == from / 60) ? from % 60 : 59;
+    uint64_t bits = spec.minutes & ((2ULL << m) - 1);
+    if (bits)
+    {
+      return h * 60 + 63 - __builtin_clzll(bits);
+    }
+  }
+  return -1;
+}
+
+// Next match strictly after epoch, in a zone offsetMin minutes from UTC. 0 if none.
+inline uint32_t cronNext(const CronSpec &spec, uint32_t epoch, int32_t offsetMin)
+{
+  int64_t minute = ((int64_t)epoch + offsetMin * 60) / 60 + 1;
+  uint32_t day = minute / 1440;
+  int from = minute % 1440;
+  for (int i = 0; i < CRON_SEARCH_DAYS; i++, day++, from = 0)
+  {
+    int m;
+    if (cronDayMatches(spec, day) && (m = cronFirstMinute(spec, from)) >= 0)
+    {
+      return (uint32_t)(((int64_t)day * 1440 + m) * 60 - offsetMin * 60);
+    }
+  }
+  return 0;
+}
+
+// Latest match at or before epoch, looking back at most maxDays. 0 if none.
+inline uint32_t cronPrev(const CronSpec &spec, uint32_t epoch, int32_t offsetMin, int maxDays)
+{
+  int64_t minute = ((int64_t)epoch + offsetMin * 60) / 60;
+  uint32_t day = minute / 1440;
+  int from = minute % 1440;
+  for (int i = 0; i <= maxDays && day > 0; i++, day--, from = 1439)
+  {
+    int m;
+    if (cronDayMatches(spec, day) && (m = cronLastMinute(spec, from)) >= 0)
+    {
+      return (uint32_t)(((int64_t)day * 1440 + m) * 60 - offsetMin * 60);
+    }
+  }
+  return 0;
+}
+
+#endif // __VMXCRON_H__
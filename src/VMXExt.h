@@ -12,6 +12,7 @@
 #include "LittleFS.h"
 #include <time.h>
 #include "StreamString.h"
+#include "VMXClock.h"
 
 const int FIRMWARE_VERSION = 1;
 
@@ -108,6 +109,7 @@ struct tm ntpTime;
 Ticker restartTimer;
 
 bool mHTTPRunning = false;
+bool mFilesystemMounted = false;
 bool mMQTTRunning = false;
 bool mWifiConnected = false;
 
@@ -120,11 +122,6 @@ int mWifiMode = AP_MODE;
 int mWifiRetriesCount = 0;
 int mUpdateResult = UPDATE_OK;
 
-unsigned long mLastNoConnTime = 0;
-unsigned long mLastReConnTime = 0;
-unsigned long mLastConnTime = 0;
-unsigned long mLastWSCleanupTime = 0;
-
 String mUpdateErrorMsg = "";
 
 // Function prototypes
@@ -143,27 +140,34 @@ void notifyToClient(const char* message, size_t len);
 void handleWebSocketMessage(void *arg, uint8_t *data, size_t len);
 void onEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len);
 
+// Mounts FILESYSTEM, formatting it if it cannot be mounted. Only the first successful
+// call mounts; later ones return at once. Everything that reads or writes a file before
+// the deferred services started (see startDeferredServices) calls this first.
+inline bool filesystemMount() {
+  if (!mFilesystemMounted) {
+    mFilesystemMounted = FILESYSTEM.begin(true);
+  }
+  return mFilesystemMounted;
+}
+
 // Function to get date time string
 // Format: "YYYY-MM-DD HH:MM:SS"
+// Never blocks: reads the cached SNTP epoch, see VMXClock.h
 inline void getDateTimeString(char* buffer, size_t len) {
-  struct tm timeinfo;
-  if(!getLocalTime(&timeinfo)){
-    snprintf(buffer, len, "0000-00-00 00:00:00");
-    return;
-  }
-  snprintf(buffer, len, "%04d-%02d-%02d %02d:%02d:%02d", timeinfo.tm_year + 1900, timeinfo.tm_mon + 1, timeinfo.tm_mday, timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec);
+  clockFormat(buffer, len);
 }
 
-inline String formatBytes(size_t bytes) {
+inline const char* formatBytes(size_t bytes, char* buffer, size_t len) {
   if (bytes < 1024) {
-    return String(bytes) + " B";
+    snprintf(buffer, len, "%u B", (unsigned)bytes);
   } else if (bytes < 1048576) {
-    return String(bytes / 1024.0, 2) + " KB";
+    snprintf(buffer, len, "%.2f KB", bytes / 1024.0);
   } else if (bytes < 1073741824) {
-    return String(bytes / 1048576.0, 2) + " MB";
+    snprintf(buffer, len, "%.2f MB", bytes / 1048576.0);
   } else {
-    return String(bytes / 1073741824.0, 2) + " GB";
+    snprintf(buffer, len, "%.2f GB", bytes / 1073741824.0);
   }
+  return buffer;
 }
 
 #endif // __VMXEXT_H__
\ No newline at end of file
@@ -0,0 +1,137 @@
+#ifndef __VMXGROUP_H__
+#define __VMXGROUP_H__
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define GROUP_MAX_COUNT 4
+#define GROUP_NAME_SIZE 16              // 15 characters + '\0'
+#define GROUP_LIST_SIZE 64              // "name,name,..." as stored in EEPROM
+#define GROUP_TOPIC_PREFIX "VMXSys/CtrlBox2Device/group/"
+#define GROUP_MAX_SCHEDULE_AHEAD 60000  // ms; later "at" timestamps are rejected
+
+// Reply policy of a group command. One scene message would otherwise produce one ack per member.
+enum GROUPACK
+{
+  GROUPACK_NONE = 0, // default: no reply, the ControlBox reads back state when it needs to
+  GROUPACK_EACH,     // every member replies on relay2CtrlBoxTopic with a "group" field
+  GROUPACK_MAX
+};
+
+static const char *const groupAckNames[GROUPACK_MAX] = {"none", "each"};
+
+// Comma separated group names this relay belongs to, persisted in EEPROM. Owned by the
+// network task, which publishes a copy for groupListToJson() on the HTTP task.
+char mGroups[GROUP_LIST_SIZE] = {};
+portMUX_TYPE mGroupsMux = portMUX_INITIALIZER_UNLOCKED;
+char mGroupsShown[GROUP_LIST_SIZE] = {};
+
+inline void groupsPublish()
+{
+  portENTER_CRITICAL(&mGroupsMux);
+  memcpy(mGroupsShown, mGroups, sizeof(mGroupsShown));
+  portEXIT_CRITICAL(&mGroupsMux);
+}
+
+inline bool groupNameValid(const char *name)
+{
+  size_t len = strlen(name);
+  if (!len || len >= GROUP_NAME_SIZE)
+  {
+    return false;
+  }
+  for (size_t i = 0; i < len; i++)
+  {
+    char c = name[i];
+    if (!isalnum((unsigned char)c) && c != '_' && c != '-')
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Validates a JSON array of group names and joins it into out. Returns false on any invalid entry.
+inline bool groupListFromJson(JsonArrayConst groups, char *out, size_t len)
+{
+  if (groups.isNull() || groups.size() > GROUP_MAX_COUNT)
+  {
+    return false;
+  }
+  out[0] = '\0';
+  for (JsonVariantConst group : groups)
+  {
+    const char *name = group.as<const char *>();
+    if (!name || !groupNameValid(name))
+    {
+      return false;
+    }
+    if (out[0])
+    {
+      strlcat(out, ",", len);
+    }
+    strlcat(out, name, len);
+  }
+  return true;
+}
+
+inline void groupListToJson(JsonArray arr)
+{
+  char groups[GROUP_LIST_SIZE];
+  portENTER_CRITICAL(&mGroupsMux);
+  memcpy(groups, mGroupsShown, sizeof(groups));
+  portEXIT_CRITICAL(&mGroupsMux);
+  groups[sizeof(groups) - 1] = '\0';
+
+  const char *p = groups;
+  while (*p)
+  {
+    const char *end = strchr(p, ',');
+    size_t n = end ? (size_t)(end - p) : strlen(p);
+    char name[GROUP_NAME_SIZE];
+    strlcpy(name, p, min(n + 1, sizeof(name)));
+    arr.add(name); // copied into the document
+    p += n + (end ? 1 : 0);
+  }
+}
+
+// Calls fn(topic) for the topic of every configured group.
+template <typename Fn>
+void forEachGroupTopic(Fn fn)
+{
+  char topic[sizeof(GROUP_TOPIC_PREFIX) + GROUP_NAME_SIZE];
+  const char *p = mGroups;
+  while (*p)
+  {
+    const char *end = strchr(p, ',');
+    size_t n = end ? (size_t)(end - p) : strlen(p);
+    snprintf(topic, sizeof(topic), GROUP_TOPIC_PREFIX "%.*s", (int)n, p);
+    fn(topic);
+    p += n + (end ? 1 : 0);
+  }
+}
+
+// Group name of a group command topic this relay is a member of, or nullptr.
+inline const char *groupFromTopic(const char *topic)
+{
+  if (strncmp(topic, GROUP_TOPIC_PREFIX, sizeof(GROUP_TOPIC_PREFIX) - 1) != 0)
+  {
+    return nullptr;
+  }
+  const char *name = topic + sizeof(GROUP_TOPIC_PREFIX) - 1;
+  size_t n = strlen(name);
+  const char *p = mGroups;
+  while (*p)
+  {
+    const char *end = strchr(p, ',');
+    size_t len = end ? (size_t)(end - p) : strlen(p);
+    if (len == n && strncmp(p, name, n) == 0)
+    {
+      return name;
+    }
+    p += len + (end ? 1 : 0);
+  }
+  return nullptr;
+}
+
+#endif // __VMXGROUP_H__
@@ -0,0 +1,302 @@
+#ifndef __VMXHEAP_H__
+#define __VMXHEAP_H__
+
+/*
+ * Heap accounting per subsystem, and a watchdog that restarts the relay gracefully before
+ * heap fragmentation makes allocations fail.
+ *
+ * malloc/calloc/realloc/free are wrapped at link time (-Wl,--wrap=... in platformio.ini).
+ * Each call is charged to the tag of the running task, set by HEAP_SCOPE() at the entry
+ * points of logging, HTTP, WebSocket, MQTT, JSON and OTA; everything else is "other".
+ * A block freed under another tag than the one that allocated it is charged to the freeing
+ * tag, so "live" per tag is approximate. Nor does "live" add up to the heap in use: memory
+ * that ESP-IDF takes with heap_caps_malloc() (WiFi, lwIP, esp_timer) is not charged, but is
+ * when it comes back through free(), so "other" and the sum can read low or negative. The
+ * watchdog and the "free" figures come from heap_caps_* and are exact. Counters are 32 bit
+ * and wrap; the differences stay right.
+ *
+ * The watchdog (VMXHeapWatchdog.h) samples free heap and the largest free block every
+ * HEAP_WATCHDOG_INTERVAL_MS. Stored as JSON in HEAP_CONFIG_PATH:
+ *
+ * {"enabled": true, "min_block": 16384, "max_fragmentation": 80, "checks": 5,
+ *  "critical_block": 6144, "max_defer_ms": 3600000}
+ */
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "VMXExt.h"
+#include "VMXHeapWatchdog.h"
+#include "VMXJsonPool.h"
+
+#define HEAP_CONFIG_PATH "/heap.json"
+#define HEAP_MAX_FILE_SIZE JSON_POOL_SMALL_SIZE
+#define HEAP_MAX_TASKS 16
+#define HEAP_WATCHDOG_INTERVAL_MS 60000
+
+enum HEAPTAG
+{
+  HEAPTAG_OTHER = 0,
+  HEAPTAG_LOG,
+  HEAPTAG_HTTP,
+  HEAPTAG_WS,
+  HEAPTAG_MQTT,
+  HEAPTAG_JSON,
+  HEAPTAG_OTA,
+  HEAPTAG_MAX
+};
+
+static const char *const heapTagNames[HEAPTAG_MAX] = {
+    "other", "log", "http", "websocket", "mqtt", "json", "ota"};
+
+struct HeapTagStats
+{
+  uint32_t allocs;
+  uint32_t frees;
+  uint32_t allocBytes;
+  uint32_t freeBytes;
+};
+
+HeapTagStats mHeapTags[HEAPTAG_MAX] = {};
+
+// Current tag of each task that entered a HEAP_SCOPE(). A task writes only its own slot;
+// a slot is claimed once with a CAS on the handle.
+struct HeapTaskTag
+{
+  TaskHandle_t task;
+  volatile uint8_t tag;
+};
+
+HeapTaskTag mHeapTaskTags[HEAP_MAX_TASKS] = {};
+
+inline HeapTaskTag *heapTaskSlot(TaskHandle_t task, bool claim)
+{
+  for (int i = 0; i < HEAP_MAX_TASKS; i++)
+  {
+    TaskHandle_t owner = mHeapTaskTags[i].task;
+    if (owner == task)
+    {
+      return &mHeapTaskTags[i];
+    }
+    if (!owner)
+    {
+      if (!claim)
+      {
+        return nullptr;
+      }
+      TaskHandle_t expected = nullptr;
+      if (__atomic_compare_exchange_n(&mHeapTaskTags[i].task, &expected, task, false, __ATOMIC_SEQ_CST,
+                                      __ATOMIC_SEQ_CST))
+      {
+        return &mHeapTaskTags[i];
+      }
+      if (expected == task)
+      {
+        return &mHeapTaskTags[i];
+      }
+    }
+  }
+  return nullptr;
+}
+
+inline uint8_t heapCurrentTag()
+{
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  if (!task)
+  {
+    return HEAPTAG_OTHER; // before the scheduler runs
+  }
+  HeapTaskTag *slot = heapTaskSlot(task, false);
+  return slot ? slot->tag : HEAPTAG_OTHER;
+}
+
+inline void heapCharge(bool alloc, size_t size)
+{
+  HeapTagStats &stats = mHeapTags[heapCurrentTag()];
+  if (alloc)
+  {
+    __atomic_fetch_add(&stats.allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.allocBytes, (uint32_t)size, __ATOMIC_RELAXED);
+  }
+  else
+  {
+    __atomic_fetch_add(&stats.frees, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.freeBytes, (uint32_t)size, __ATOMIC_RELAXED);
+  }
+}
+
+extern "C"
+{
+  void *__real_malloc(size_t size);
+  void *__real_calloc(size_t n, size_t size);
+  void *__real_realloc(void *ptr, size_t size);
+  void __real_free(void *ptr);
+
+  void *__wrap_malloc(size_t size)
+  {
+    void *p = __real_malloc(size);
+    if (p)
+    {
+      heapCharge(true, heap_caps_get_allocated_size(p));
+    }
+    return p;
+  }
+
+  void *__wrap_calloc(size_t n, size_t size)
+  {
+    void *p = __real_calloc(n, size);
+    if (p)
+    {
+      heapCharge(true, heap_caps_get_allocated_size(p));
+    }
+    return p;
+  }
+
+  void *__wrap_realloc(void *ptr, size_t size)
+  {
+    size_t before = ptr ? heap_caps_get_allocated_size(ptr) : 0;
+    void *p = __real_realloc(ptr, size);
+    if (p || !size)
+    {
+      if (ptr)
+      {
+        heapCharge(false, before);
+      }
+      if (p)
+      {
+        heapCharge(true, heap_caps_get_allocated_size(p));
+      }
+    }
+    return p;
+  }
+
+  void __wrap_free(void *ptr)
+  {
+    if (ptr)
+    {
+      heapCharge(false, heap_caps_get_allocated_size(ptr));
+    }
+    __real_free(ptr);
+  }
+}
+
+// Charges the running task's allocations to tag until the end of the scope.
+class HeapScope
+{
+public:
+  explicit HeapScope(uint8_t tag)
+  {
+    mSlot = heapTaskSlot(xTaskGetCurrentTaskHandle(), true);
+    if (mSlot)
+    {
+      mPrevious = mSlot->tag;
+      mSlot->tag = tag;
+    }
+  }
+
+  ~HeapScope()
+  {
+    if (mSlot)
+    {
+      mSlot->tag = mPrevious;
+    }
+  }
+
+private:
+  HeapTaskTag *mSlot;
+  uint8_t mPrevious = HEAPTAG_OTHER;
+};
+
+#define HEAP_CONCAT2(a, b) a##b
+#define HEAP_CONCAT(a, b) HEAP_CONCAT2(a, b)
+#define HEAP_SCOPE(tag) HeapScope HEAP_CONCAT(heapScope, __LINE__)(tag)
+
+// Missing fields keep their defaults. False if a field is out of range.
+inline bool heapWatchdogConfigFromJson(const JsonDocument &doc, HeapWatchdogConfig &config)
+{
+  config = heapWatchdogDefaults;
+  config.enabled = doc["enabled"] | config.enabled;
+  config.minBlock = doc["min_block"] | config.minBlock;
+  uint32_t maxFragmentation = doc["max_fragmentation"] | (uint32_t)config.maxFragmentation;
+  uint32_t checks = doc["checks"] | (uint32_t)config.checks;
+  config.criticalBlock = doc["critical_block"] | config.criticalBlock;
+  config.maxDeferMs = doc["max_defer_ms"] | config.maxDeferMs;
+  if (maxFragmentation > 100 || !checks || checks > 60 || config.criticalBlock > config.minBlock)
+  {
+    return false;
+  }
+  config.maxFragmentation = maxFragmentation;
+  config.checks = checks;
+  return true;
+}
+
+inline void heapWatchdogToJson(const HeapWatchdog &watchdog, JsonObject obj)
+{
+  const HeapWatchdogConfig &config = watchdog.config();
+  obj["enabled"] = config.enabled;
+  obj["min_block"] = config.minBlock;
+  obj["max_fragmentation"] = config.maxFragmentation;
+  obj["checks"] = config.checks;
+  obj["critical_block"] = config.criticalBlock;
+  obj["max_defer_ms"] = config.maxDeferMs;
+  obj["state"] = heapWatchdogStateNames[watchdog.state()];
+  obj["bad_checks"] = watchdog.badChecks();
+}
+
+HeapWatchdog mHeapWatchdog;
+
+// Samples the heap into mHeapWatchdog, see HeapWatchdog::check().
+inline HEAPWD heapWatchdogCheck(bool quiet)
+{
+  return mHeapWatchdog.check(quiet, heap_caps_get_free_size(MALLOC_CAP_8BIT),
+                             heap_caps_get_largest_free_block(MALLOC_CAP_8BIT), millis());
+}
+
+// Reads HEAP_CONFIG_PATH into the watchdog; no file means the defaults.
+inline bool heapWatchdogLoad()
+{
+  SmallJsonDoc pooled;
+  if (!pooled)
+  {
+    ESP_LOGI("HEAP", "JSON pool exhausted, watchdog config not reloaded");
+    return false;
+  }
+  HeapWatchdogConfig config = heapWatchdogDefaults;
+  bool ok = true;
+  if (FILESYSTEM.exists(HEAP_CONFIG_PATH))
+  {
+    File file = FILESYSTEM.open(HEAP_CONFIG_PATH, FILE_READ);
+    ok = file && !deserializeJson(*pooled, file) && heapWatchdogConfigFromJson(*pooled, config);
+    if (!ok)
+    {
+      ESP_LOGI("HEAP", "Unreadable watchdog config in %s ignored", HEAP_CONFIG_PATH);
+      config = heapWatchdogDefaults;
+    }
+  }
+  mHeapWatchdog.configure(config);
+  return ok;
+}
+
+// Heap now, the minimum ever, and what each tag allocated and freed.
+inline void heapToJson(JsonDocument &doc)
+{
+  doc["free"] = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  doc["largest_block"] = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  doc["min_free"] = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+  doc["uptime_ms"] = millis();
+  JsonObject tags = doc.createNestedObject("tags");
+  for (int i = 0; i < HEAPTAG_MAX; i++)
+  {
+    const HeapTagStats &stats = mHeapTags[i];
+    JsonObject tag = tags.createNestedObject(heapTagNames[i]);
+    tag["allocs"] = stats.allocs;
+    tag["frees"] = stats.frees;
+    tag["alloc_bytes"] = stats.allocBytes;
+    tag["live"] = (int32_t)(stats.allocBytes - stats.freeBytes);
+  }
+  heapWatchdogToJson(mHeapWatchdog, doc.createNestedObject("watchdog"));
+}
+
+#endif // __VMXHEAP_H__
@@ -0,0 +1,113 @@
+#ifndef __VMXHEAPWATCHDOG_H__
+#define __VMXHEAPWATCHDOG_H__
+
+/*
+ * Heap watchdog decision, without the heap probes: check() is handed the free heap, the
+ * largest free block and the time, so it also builds on the host (test/test_heap_watchdog).
+ * VMXHeap.h samples the ESP heap, loads the configuration and reports it.
+ *
+ * After the configured number of bad samples in a row it waits for the relay to be off and
+ * idle, at most maxDeferMs, and then asks for a restart. Below criticalBlock it does not wait.
+ */
+
+#include <stdint.h>
+
+#ifndef HEAP_WATCHDOG_MIN_BLOCK
+#define HEAP_WATCHDOG_MIN_BLOCK 16384 // a TLS handshake or an OTA chunk needs about this much
+#endif
+#ifndef HEAP_WATCHDOG_MAX_FRAGMENTATION
+#define HEAP_WATCHDOG_MAX_FRAGMENTATION 80 // % of free heap not in the largest block
+#endif
+#ifndef HEAP_WATCHDOG_CHECKS
+#define HEAP_WATCHDOG_CHECKS 5
+#endif
+#ifndef HEAP_WATCHDOG_CRITICAL_BLOCK
+#define HEAP_WATCHDOG_CRITICAL_BLOCK 6144
+#endif
+#ifndef HEAP_WATCHDOG_MAX_DEFER_MS
+#define HEAP_WATCHDOG_MAX_DEFER_MS 3600000
+#endif
+
+struct HeapWatchdogConfig
+{
+  bool enabled;
+  uint32_t minBlock;
+  uint8_t maxFragmentation;
+  uint8_t checks;
+  uint32_t criticalBlock;
+  uint32_t maxDeferMs;
+};
+
+static const HeapWatchdogConfig heapWatchdogDefaults = {
+    true, HEAP_WATCHDOG_MIN_BLOCK, HEAP_WATCHDOG_MAX_FRAGMENTATION, HEAP_WATCHDOG_CHECKS,
+    HEAP_WATCHDOG_CRITICAL_BLOCK, HEAP_WATCHDOG_MAX_DEFER_MS};
+
+enum HEAPWD
+{
+  HEAPWD_OK = 0,   // heap healthy
+  HEAPWD_DEGRADED, // bad samples, not yet enough or waiting for a quiet moment
+  HEAPWD_RESTART,  // restart now
+  HEAPWD_MAX
+};
+
+static const char *const heapWatchdogStateNames[HEAPWD_MAX] = {"ok", "degraded", "restart"};
+
+// Network task only.
+class HeapWatchdog
+{
+public:
+  void configure(const HeapWatchdogConfig &config)
+  {
+    mConfig = config;
+    mBadChecks = 0;
+    mDeferring = false;
+  }
+
+  // One sample of the heap at nowMs (millis()). quiet: a restart now would not interrupt
+  // anything (relay off and idle).
+  HEAPWD check(bool quiet, uint32_t freeBytes, uint32_t largest, uint32_t nowMs)
+  {
+    mFree = freeBytes;
+    mLargest = largest;
+    mFragmentation = mFree ? 100 - (uint8_t)((uint64_t)mLargest * 100 / mFree) : 0;
+    bool bad = mLargest < mConfig.minBlock || mFragmentation > mConfig.maxFragmentation;
+    if (!mConfig.enabled || !bad)
+    {
+      mBadChecks = 0;
+      mDeferring = false;
+      return mState = HEAPWD_OK;
+    }
+    if (++mBadChecks < mConfig.checks)
+    {
+      return mState = HEAPWD_DEGRADED;
+    }
+    if (!mDeferring)
+    {
+      mDeferring = true;
+      mDegradedSinceMs = nowMs;
+    }
+    if (quiet || mLargest < mConfig.criticalBlock || nowMs - mDegradedSinceMs >= mConfig.maxDeferMs)
+    {
+      return mState = HEAPWD_RESTART;
+    }
+    return mState = HEAPWD_DEGRADED;
+  }
+
+  const HeapWatchdogConfig &config() const { return mConfig; }
+  HEAPWD state() const { return mState; }
+  uint32_t badChecks() const { return mBadChecks; }
+  uint32_t largest() const { return mLargest; }
+  uint8_t fragmentation() const { return mFragmentation; }
+
+private:
+  HeapWatchdogConfig mConfig = heapWatchdogDefaults;
+  HEAPWD mState = HEAPWD_OK;
+  uint32_t mBadChecks = 0;
+  bool mDeferring = false; // enough bad samples, waiting for a quiet moment since mDegradedSinceMs
+  uint32_t mDegradedSinceMs = 0;
+  uint32_t mFree = 0;
+  uint32_t mLargest = 0;
+  uint8_t mFragmentation = 0;
+};
+
+#endif // __VMXHEAPWATCHDOG_H__
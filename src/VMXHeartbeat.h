@@ -0,0 +1,49 @@
+#ifndef __VMXHEARTBEAT_H__
+#define __VMXHEARTBEAT_H__
+
+#include <Arduino.h>
+
+#define HEARTBEAT_MIN_MS 15000  // after a change
+#define HEARTBEAT_MAX_MS 300000 // idle
+
+// Interval of the heartbeat message: HEARTBEAT_MIN_MS after something changed, then
+// doubled by every quiet heartbeat up to HEARTBEAT_MAX_MS. A busy relay reports its health
+// often, an idle one costs the broker one small message every five minutes.
+class HeartbeatPacer
+{
+public:
+  void reset()
+  {
+    mIntervalMs = HEARTBEAT_MIN_MS;
+    mChanged = false;
+  }
+
+  // Something worth reporting changed. True when the interval was longer than
+  // HEARTBEAT_MIN_MS, i.e. the next heartbeat should be moved closer.
+  bool changed()
+  {
+    bool sooner = mIntervalMs > HEARTBEAT_MIN_MS;
+    mIntervalMs = HEARTBEAT_MIN_MS;
+    mChanged = true;
+    return sooner;
+  }
+
+  // A heartbeat was sent. Returns the ms until the next one.
+  uint32_t sent()
+  {
+    if (!mChanged)
+    {
+      mIntervalMs = min(mIntervalMs * 2, (uint32_t)HEARTBEAT_MAX_MS);
+    }
+    mChanged = false;
+    return mIntervalMs;
+  }
+
+  uint32_t interval() const { return mIntervalMs; }
+
+private:
+  uint32_t mIntervalMs = HEARTBEAT_MIN_MS;
+  bool mChanged = false;
+};
+
+#endif // __VMXHEARTBEAT_H__
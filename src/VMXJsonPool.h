@@ -0,0 +1,140 @@
+#ifndef __VMXJSONPOOL_H__
+#define __VMXJSONPOOL_H__
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <atomic>
+
+#define JSON_POOL_SMALL_SIZE 512   // MQTT commands/replies, setup, status
+#define JSON_POOL_SMALL_COUNT 6
+#define JSON_POOL_LARGE_SIZE 3072  // scan results, file lists, profile
+#define JSON_POOL_LARGE_COUNT 2
+
+// Fixed set of preallocated JSON documents shared by the loop task and the
+// async_tcp task. Slots are claimed with a CAS on a bitmask so checkout/checkin
+// never block and never touch the heap; checkout returns nullptr when all
+// documents are in use.
+template <size_t DocSize, int Count>
+class JsonDocPool
+{
+  static_assert(Count <= 32, "JsonDocPool uses a 32-bit slot mask");
+
+public:
+  StaticJsonDocument<DocSize> *checkout()
+  {
+    uint32_t used = mUsedMask.load();
+    for (;;)
+    {
+      int slot = 0;
+      while (slot < Count && (used & (1UL << slot)))
+      {
+        slot++;
+      }
+      if (slot == Count)
+      {
+        mExhausted++;
+        return nullptr;
+      }
+      if (mUsedMask.compare_exchange_weak(used, used | (1UL << slot)))
+      {
+        int inUse = ++mInUse;
+        if (inUse > mInUseHighWater)
+        {
+          mInUseHighWater = inUse;
+        }
+        mCheckouts++;
+        return &mDocs[slot];
+      }
+    }
+  }
+
+  void checkin(JsonDocument *doc)
+  {
+    int slot = (StaticJsonDocument<DocSize> *)doc - mDocs;
+    if (slot < 0 || slot >= Count)
+    {
+      return;
+    }
+    size_t usage = mDocs[slot].memoryUsage();
+    if (usage > mMemoryHighWater)
+    {
+      mMemoryHighWater = usage;
+    }
+    if (mDocs[slot].overflowed())
+    {
+      mOverflows++;
+    }
+    mDocs[slot].clear();
+    --mInUse;
+    mUsedMask.fetch_and(~(1UL << slot));
+  }
+
+  void toJson(JsonObject obj) const
+  {
+    obj["doc_size"] = DocSize;
+    obj["count"] = Count;
+    obj["in_use"] = mInUse.load();
+    obj["in_use_high_water"] = mInUseHighWater;
+    obj["memory_high_water"] = mMemoryHighWater;
+    obj["checkouts"] = mCheckouts;
+    obj["exhausted"] = mExhausted;
+    obj["overflows"] = mOverflows;
+  }
+
+private:
+  StaticJsonDocument<DocSize> mDocs[Count];
+  std::atomic<uint32_t> mUsedMask{0};
+  std::atomic<int> mInUse{0};
+  // Statistics only; a lost update under contention is harmless.
+  int mInUseHighWater = 0;
+  size_t mMemoryHighWater = 0;
+  uint32_t mCheckouts = 0;
+  uint32_t mExhausted = 0;
+  uint32_t mOverflows = 0;
+};
+
+JsonDocPool<JSON_POOL_SMALL_SIZE, JSON_POOL_SMALL_COUNT> jsonPoolSmall;
+JsonDocPool<JSON_POOL_LARGE_SIZE, JSON_POOL_LARGE_COUNT> jsonPoolLarge;
+
+// Checks a document out of a pool for the lifetime of the scope.
+template <class Pool>
+class PooledJsonDoc
+{
+public:
+  explicit PooledJsonDoc(Pool &pool) : mPool(pool), mDoc(pool.checkout()) {}
+  ~PooledJsonDoc()
+  {
+    if (mDoc)
+    {
+      mPool.checkin(mDoc);
+    }
+  }
+  PooledJsonDoc(const PooledJsonDoc &) = delete;
+  PooledJsonDoc &operator=(const PooledJsonDoc &) = delete;
+
+  explicit operator bool() const { return mDoc != nullptr; }
+  JsonDocument &operator*() { return *mDoc; }
+  JsonDocument *operator->() { return mDoc; }
+
+private:
+  Pool &mPool;
+  JsonDocument *mDoc;
+};
+
+struct SmallJsonDoc : PooledJsonDoc<decltype(jsonPoolSmall)>
+{
+  SmallJsonDoc() : PooledJsonDoc(jsonPoolSmall) {}
+};
+
+struct LargeJsonDoc : PooledJsonDoc<decltype(jsonPoolLarge)>
+{
+  LargeJsonDoc() : PooledJsonDoc(jsonPoolLarge) {}
+};
+
+inline void jsonPoolToJson(JsonDocument &doc)
+{
+  jsonPoolSmall.toJson(doc.createNestedObject("json_pool_small"));
+  jsonPoolLarge.toJson(doc.createNestedObject("json_pool_large"));
+}
+
+#endif // __VMXJSONPOOL_H__
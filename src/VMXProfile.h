@@ -0,0 +1,191 @@
+#ifndef __VMXPROFILE_H__
+#define __VMXPROFILE_H__
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define PROFILE_MAX_TASKS 24
+#define PROFILE_SLOW_LOOPS 8        // slowest recent loop() iterations kept
+#define PROFILE_SLOW_LOOP_US 20000  // only iterations over 20 ms are candidates
+#define PROFILE_HISTOGRAM_BUCKETS 14 // [0,1) [1,2) [2,4) ... [4096,inf) ms
+
+// Work done by one network loop iteration, recorded as a bitmask of branches.
+enum LoopBranch
+{
+  LOOP_BRANCH_WS_CLEANUP = 0,
+  LOOP_BRANCH_SCAN,
+  LOOP_BRANCH_WIFI_RECONNECT,
+  LOOP_BRANCH_MQTT_CONNECT,
+  LOOP_BRANCH_MQTT_LOOP,
+  LOOP_BRANCH_AUTO_OFF,
+  LOOP_BRANCH_DEFERRED_INIT,
+  LOOP_BRANCH_SCHEDULE,
+  LOOP_BRANCH_RULE,
+  LOOP_BRANCH_MAX
+};
+
+static const char *const loopBranchNames[LOOP_BRANCH_MAX] = {
+    "ws_cleanup", "scan", "wifi_reconnect", "mqtt_connect", "mqtt_loop", "auto_off", "deferred_init", "schedule", "rule"};
+
+struct SlowLoop
+{
+  uint32_t durationUs;
+  uint32_t endMs;
+  uint32_t branches;
+};
+
+struct LoopProfile
+{
+  uint32_t histogram[PROFILE_HISTOGRAM_BUCKETS];
+  SlowLoop slowest[PROFILE_SLOW_LOOPS]; // ring of the most recent slow iterations
+  int slowHead;
+  uint32_t iterations;
+  uint32_t maxUs;
+  int64_t startUs;
+  uint32_t branches;
+};
+
+LoopProfile loopProfile = {};
+portMUX_TYPE loopProfileMux = portMUX_INITIALIZER_UNLOCKED;
+
+inline void loopProfileBranch(LoopBranch branch)
+{
+  loopProfile.branches |= 1UL << branch;
+}
+
+// Times one network loop iteration from construction to destruction.
+struct LoopProfileScope
+{
+  LoopProfileScope()
+  {
+    loopProfile.startUs = esp_timer_get_time();
+    loopProfile.branches = 0;
+  }
+
+  ~LoopProfileScope()
+  {
+    uint32_t us = (uint32_t)(esp_timer_get_time() - loopProfile.startUs);
+    uint32_t ms = us / 1000;
+    int bucket = 0;
+    while (ms && bucket < PROFILE_HISTOGRAM_BUCKETS - 1)
+    {
+      ms >>= 1;
+      bucket++;
+    }
+
+    portENTER_CRITICAL(&loopProfileMux);
+    loopProfile.histogram[bucket]++;
+    loopProfile.iterations++;
+    if (us > loopProfile.maxUs)
+    {
+      loopProfile.maxUs = us;
+    }
+    if (us >= PROFILE_SLOW_LOOP_US)
+    {
+      SlowLoop &slot = loopProfile.slowest[loopProfile.slowHead];
+      slot.durationUs = us;
+      slot.endMs = millis();
+      slot.branches = loopProfile.branches;
+      loopProfile.slowHead = (loopProfile.slowHead + 1) % PROFILE_SLOW_LOOPS;
+    }
+    portEXIT_CRITICAL(&loopProfileMux);
+  }
+};
+
+inline void loopProfileToJson(JsonObject obj)
+{
+  LoopProfile snapshot;
+  portENTER_CRITICAL(&loopProfileMux);
+  snapshot = loopProfile;
+  portEXIT_CRITICAL(&loopProfileMux);
+
+  obj["iterations"] = snapshot.iterations;
+  obj["max_us"] = snapshot.maxUs;
+  JsonArray histogram = obj.createNestedArray("histogram_ms_log2");
+  for (int i = 0; i < PROFILE_HISTOGRAM_BUCKETS; i++)
+  {
+    histogram.add(snapshot.histogram[i]);
+  }
+  JsonArray slow = obj.createNestedArray("slowest");
+  for (int i = 0; i < PROFILE_SLOW_LOOPS; i++)
+  {
+    // newest first
+    const SlowLoop &entry = snapshot.slowest[(snapshot.slowHead + PROFILE_SLOW_LOOPS - 1 - i) % PROFILE_SLOW_LOOPS];
+    if (!entry.durationUs)
+    {
+      break;
+    }
+    JsonArray item = slow.createNestedArray();
+    item.add(entry.durationUs);
+    item.add(entry.endMs);
+    for (int b = 0; b < LOOP_BRANCH_MAX; b++)
+    {
+      if (entry.branches & (1UL << b))
+      {
+        item.add(loopBranchNames[b]);
+      }
+    }
+  }
+}
+
+// Per task: [CPU share since the previous call, minimum free stack ever seen].
+// The stack high-water mark only needs the trace facility, which the Arduino core enables.
+// The CPU share also needs CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS, which the prebuilt
+// Arduino-ESP32 2.x sdkconfig leaves off; without a custom sdkconfig it is null.
+// Called only from the async_tcp task, so the static snapshots are not shared.
+inline void taskProfileToJson(JsonObject obj)
+{
+#if (configUSE_TRACE_FACILITY == 1)
+  static TaskStatus_t tasks[PROFILE_MAX_TASKS];
+#if (configGENERATE_RUN_TIME_STATS == 1)
+  static struct
+  {
+    TaskHandle_t handle;
+    uint32_t counter;
+  } previous[PROFILE_MAX_TASKS];
+  static uint32_t previousTotal = 0;
+#endif
+
+  uint32_t total = 0;
+  UBaseType_t count = uxTaskGetSystemState(tasks, PROFILE_MAX_TASKS, &total);
+#if (configGENERATE_RUN_TIME_STATS == 1)
+  uint32_t elapsed = total - previousTotal;
+#endif
+  for (UBaseType_t i = 0; i < count; i++)
+  {
+    JsonArray item = obj.createNestedArray(tasks[i].pcTaskName);
+#if (configGENERATE_RUN_TIME_STATS == 1)
+    uint32_t last = 0;
+    for (int j = 0; j < PROFILE_MAX_TASKS; j++)
+    {
+      if (previous[j].handle == tasks[i].xHandle)
+      {
+        last = previous[j].counter;
+        break;
+      }
+    }
+    // Run time is accumulated per core, so the percentages of all tasks add up to 100 * cores.
+    item.add(elapsed ? (float)(tasks[i].ulRunTimeCounter - last) * 100.0f / elapsed : 0.0f);
+#else
+    item.add(nullptr);
+#endif
+    item.add(tasks[i].usStackHighWaterMark);
+  }
+#if (configGENERATE_RUN_TIME_STATS == 1)
+  memset(previous, 0, sizeof(previous));
+  for (UBaseType_t i = 0; i < count; i++)
+  {
+    previous[i].handle = tasks[i].xHandle;
+    previous[i].counter = tasks[i].ulRunTimeCounter;
+  }
+  previousTotal = total;
+#endif
+#else
+  obj["error"] = "FreeRTOS trace facility disabled";
+#endif
+}
+
+#endif // __VMXPROFILE_H__
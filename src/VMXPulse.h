@@ -0,0 +1,275 @@
+#ifndef __VMXPULSE_H__
+#define __VMXPULSE_H__
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+#define PULSE_MAX_STEPS 8
+#define PULSE_MAX_STEP_MS 3600000 // one hour per step
+
+// Timing of an updateByAccessControl command: step 0 at the commanded state, then
+// alternating, then off. {1, {10000}} is the classic 10 s auto-off; {3, {500, 300, 500}}
+// is pulse-pause-pulse.
+struct PulsePlan
+{
+  uint8_t steps;
+  uint32_t stepMs[PULSE_MAX_STEPS];
+};
+
+// Optional "duration" (ms) or "sequence" ([ms, ms, ...]) of a command. Leaves plan empty
+// when neither is given; false when they are invalid.
+inline bool pulsePlanFromJson(JsonVariantConst doc, PulsePlan &plan)
+{
+  plan.steps = 0;
+  JsonVariantConst duration = doc["duration"];
+  JsonArrayConst sequence = doc["sequence"];
+  if (!sequence.isNull())
+  {
+    if (!sequence.size() || sequence.size() > PULSE_MAX_STEPS)
+    {
+      return false;
+    }
+    for (JsonVariantConst ms : sequence)
+    {
+      if (!ms.is<uint32_t>() || !ms.as<uint32_t>() || ms.as<uint32_t>() > PULSE_MAX_STEP_MS)
+      {
+        return false;
+      }
+      plan.stepMs[plan.steps++] = ms;
+    }
+  }
+  else if (!duration.isNull())
+  {
+    if (!duration.is<uint32_t>() || !duration.as<uint32_t>() || duration.as<uint32_t>() > PULSE_MAX_STEP_MS)
+    {
+      return false;
+    }
+    plan.stepMs[plan.steps++] = duration;
+  }
+  return true;
+}
+
+// Drives the relay output through a PulsePlan from an esp_timer, so every edge lands within
+// the esp_timer task's dispatch latency (tens of microseconds) of its planned time, however
+// busy the other tasks are. Deadlines are kept on an absolute timeline, so lateness does not
+// add up over a sequence. The output level and *status are only changed under mMux, by
+// set()/start() and by the timer callbacks; set() and start() may be called from an ISR.
+// startAt() does the same at a given time from a second esp_timer, so members of a group
+// switch together without a task spinning for it.
+class PulseSequencer
+{
+public:
+  // Called on the esp_timer task after each timed edge; keep it short.
+  typedef void (*EdgeFn)();
+
+  bool begin(uint8_t pin, volatile int *status, EdgeFn onEdge)
+  {
+    mPin = pin;
+    mStatus = status;
+    mOnEdge = onEdge;
+    esp_timer_create_args_t args = {};
+    args.callback = onTimer;
+    args.arg = this;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "pulse";
+    if (esp_timer_create(&args, &mTimer) != ESP_OK)
+    {
+      return false;
+    }
+    args.callback = onStartTimer;
+    args.name = "pulse_start";
+    return esp_timer_create(&args, &mStartTimer) == ESP_OK;
+  }
+
+  // Switches now and cancels a running sequence.
+  void set(uint8_t state)
+  {
+    portENTER_CRITICAL_SAFE(&mMux);
+    setLocked(state);
+    portEXIT_CRITICAL_SAFE(&mMux);
+  }
+
+  // Switches to first now and runs plan from here.
+  void start(uint8_t first, const PulsePlan &plan)
+  {
+    portENTER_CRITICAL_SAFE(&mMux);
+    startLocked(first, plan);
+    portEXIT_CRITICAL_SAFE(&mMux);
+  }
+
+  // As start() at dueUs (esp_timer time), or as set() with an empty plan. Replaces a start
+  // still pending; set() and start() leave it pending, cancelStart() drops it.
+  void startAt(int64_t dueUs, uint8_t first, const PulsePlan &plan)
+  {
+    portENTER_CRITICAL_SAFE(&mMux);
+    esp_timer_stop(mStartTimer);
+    mStartPlan = plan;
+    mStartState = first;
+    mStartDueUs = dueUs;
+    mStartPending = true;
+    int64_t now = esp_timer_get_time();
+    esp_timer_start_once(mStartTimer, dueUs > now ? dueUs - now : 0);
+    portEXIT_CRITICAL_SAFE(&mMux);
+  }
+
+  void cancelStart()
+  {
+    portENTER_CRITICAL_SAFE(&mMux);
+    mStartPending = false;
+    esp_timer_stop(mStartTimer);
+    portEXIT_CRITICAL_SAFE(&mMux);
+  }
+
+  bool running() const { return mRunning; }
+  uint32_t edges() const { return mEdges; }
+
+  // Starts made by startAt() so far, and the state the last one switched to.
+  uint32_t starts() const { return mStarts; }
+  uint8_t startState() const { return mStartState; }
+
+  void toJson(JsonObject obj) const
+  {
+    obj["running"] = mRunning;
+    obj["edges"] = mEdges;
+    obj["last_late_us"] = mLastLateUs;
+    obj["max_late_us"] = mMaxLateUs;
+    obj["start_pending"] = mStartPending;
+    obj["starts"] = mStarts;
+    obj["start_max_late_us"] = mStartMaxLateUs;
+  }
+
+private:
+  // set() and start() with mMux held.
+  void setLocked(uint8_t state)
+  {
+    mRunning = false;
+    esp_timer_stop(mTimer);
+    write(state);
+  }
+
+  void startLocked(uint8_t first, const PulsePlan &plan)
+  {
+    esp_timer_stop(mTimer);
+    mPlan = plan;
+    mFirst = first;
+    mStep = 0;
+    mDueUs = esp_timer_get_time() + (int64_t)plan.stepMs[0] * 1000;
+    mRunning = true;
+    write(first);
+    esp_timer_start_once(mTimer, (uint64_t)plan.stepMs[0] * 1000);
+  }
+
+  void write(uint8_t state)
+  {
+    digitalWrite(mPin, state ? HIGH : LOW);
+    *mStatus = state;
+  }
+
+  static void onTimer(void *arg)
+  {
+    PulseSequencer *self = (PulseSequencer *)arg;
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&self->mMux);
+    if (!self->mRunning)
+    {
+      portEXIT_CRITICAL(&self->mMux);
+      return;
+    }
+    if (now < self->mDueUs)
+    {
+      // Expiry of a sequence that start() replaced after dispatch: the new timer is armed
+      // already and this start_once fails; otherwise it re-arms for the right time.
+      esp_timer_start_once(self->mTimer, self->mDueUs - now);
+      portEXIT_CRITICAL(&self->mMux);
+      return;
+    }
+    uint32_t late = (uint32_t)(now - self->mDueUs);
+    self->mStep++;
+    bool more = self->mStep < self->mPlan.steps;
+    self->write(more ? ((self->mStep & 1) ? !self->mFirst : self->mFirst) : 0);
+    if (more)
+    {
+      self->mDueUs += (int64_t)self->mPlan.stepMs[self->mStep] * 1000;
+      esp_timer_start_once(self->mTimer, self->mDueUs > now ? self->mDueUs - now : 0);
+    }
+    else
+    {
+      self->mRunning = false;
+    }
+    self->mEdges++;
+    self->mLastLateUs = late;
+    if (late > self->mMaxLateUs)
+    {
+      self->mMaxLateUs = late;
+    }
+    portEXIT_CRITICAL(&self->mMux);
+    if (self->mOnEdge)
+    {
+      self->mOnEdge();
+    }
+  }
+
+  static void onStartTimer(void *arg)
+  {
+    PulseSequencer *self = (PulseSequencer *)arg;
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&self->mMux);
+    if (!self->mStartPending)
+    {
+      portEXIT_CRITICAL(&self->mMux);
+      return;
+    }
+    if (now < self->mStartDueUs)
+    {
+      // Expiry of a start that startAt() replaced after dispatch, as in onTimer().
+      esp_timer_start_once(self->mStartTimer, self->mStartDueUs - now);
+      portEXIT_CRITICAL(&self->mMux);
+      return;
+    }
+    self->mStartPending = false;
+    if (self->mStartPlan.steps)
+    {
+      self->startLocked(self->mStartState, self->mStartPlan);
+    }
+    else
+    {
+      self->setLocked(self->mStartState);
+    }
+    uint32_t late = (uint32_t)(now - self->mStartDueUs);
+    if (late > self->mStartMaxLateUs)
+    {
+      self->mStartMaxLateUs = late;
+    }
+    self->mStarts++;
+    portEXIT_CRITICAL(&self->mMux);
+    if (self->mOnEdge)
+    {
+      self->mOnEdge();
+    }
+  }
+
+  portMUX_TYPE mMux = portMUX_INITIALIZER_UNLOCKED;
+  esp_timer_handle_t mTimer = nullptr;
+  esp_timer_handle_t mStartTimer = nullptr;
+  uint8_t mPin = 0;
+  volatile int *mStatus = nullptr;
+  EdgeFn mOnEdge = nullptr;
+  PulsePlan mPlan = {};
+  uint8_t mFirst = 0;
+  uint8_t mStep = 0;
+  int64_t mDueUs = 0;
+  volatile bool mRunning = false;
+  volatile uint32_t mEdges = 0;
+  uint32_t mLastLateUs = 0;
+  uint32_t mMaxLateUs = 0;
+  PulsePlan mStartPlan = {};
+  uint8_t mStartState = 0;
+  int64_t mStartDueUs = 0;
+  volatile bool mStartPending = false;
+  volatile uint32_t mStarts = 0;
+  uint32_t mStartMaxLateUs = 0;
+};
+
+#endif // __VMXPULSE_H__
@@ -0,0 +1,129 @@
+#ifndef __VMXQUEUE_H__
+#define __VMXQUEUE_H__
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bounded lock-free queue for exactly one producer task and one consumer task.
+// Capacity must be a power of two; one slot is never used so head == tail means empty.
+template <typename T, size_t Capacity>
+class SpscQueue
+{
+  static_assert((Capacity & (Capacity - 1)) == 0, "SpscQueue capacity must be a power of two");
+
+public:
+  // Producer side. Returns false when the queue is full.
+  bool push(const T &item)
+  {
+    size_t head = mHead.load(std::memory_order_relaxed);
+    size_t next = (head + 1) & (Capacity - 1);
+    if (next == mTail.load(std::memory_order_acquire))
+    {
+      return false;
+    }
+    mItems[head] = item;
+    mHead.store(next, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Returns false when the queue is empty.
+  bool pop(T &item)
+  {
+    size_t tail = mTail.load(std::memory_order_relaxed);
+    if (tail == mHead.load(std::memory_order_acquire))
+    {
+      return false;
+    }
+    item = mItems[tail];
+    mTail.store((tail + 1) & (Capacity - 1), std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const
+  {
+    return mTail.load(std::memory_order_acquire) == mHead.load(std::memory_order_acquire);
+  }
+
+private:
+  T mItems[Capacity];
+  std::atomic<size_t> mHead{0};
+  std::atomic<size_t> mTail{0};
+};
+
+// Bounded lock-free queue for any number of producer tasks and one consumer task
+// (D. Vyukov's bounded queue: each cell carries a sequence number telling whose turn it is).
+// Capacity must be a power of two.
+template <typename T, size_t Capacity>
+class MpscQueue
+{
+  static_assert((Capacity & (Capacity - 1)) == 0, "MpscQueue capacity must be a power of two");
+
+public:
+  MpscQueue()
+  {
+    for (size_t i = 0; i < Capacity; i++)
+    {
+      mCells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Any task. Returns false when the queue is full; never blocks.
+  bool push(const T &item)
+  {
+    Cell *cell;
+    size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+    for (;;)
+    {
+      cell = &mCells[pos & (Capacity - 1)];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0)
+      {
+        if (mEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        {
+          break;
+        }
+      }
+      else if (diff < 0)
+      {
+        return false;
+      }
+      else
+      {
+        pos = mEnqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+    cell->data = item;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer task only. Returns false when empty or the next item is still being written.
+  bool pop(T &item)
+  {
+    Cell *cell = &mCells[mDequeuePos & (Capacity - 1)];
+    size_t seq = cell->sequence.load(std::memory_order_acquire);
+    if ((intptr_t)seq - (intptr_t)(mDequeuePos + 1) < 0)
+    {
+      return false;
+    }
+    item = cell->data;
+    cell->sequence.store(mDequeuePos + Capacity, std::memory_order_release);
+    mDequeuePos++;
+    return true;
+  }
+
+private:
+  struct Cell
+  {
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  Cell mCells[Capacity];
+  std::atomic<size_t> mEnqueuePos{0};
+  size_t mDequeuePos = 0;
+};
+
+#endif // __VMXQUEUE_H__
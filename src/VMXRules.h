@@ -0,0 +1,511 @@
+#ifndef __VMXRULES_H__
+#define __VMXRULES_H__
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "VMXClock.h"
+#include "VMXCron.h"
+#include "VMXExt.h"
+#include "VMXJsonPool.h"
+#include "VMXPulse.h"
+
+#define RULES_PATH "/rules.json"
+#define RULES_MAX 16
+#define RULES_MAX_FILE_SIZE 2048
+#define RULES_DEBOUNCE_US 20000 // edges closer than this to the previous one are contact bounce
+#define RULES_MAX_COOLDOWN_MS 86400000UL
+#define RULES_DEFAULT_PULSE_MS 10000
+
+/*
+ * Local rules: input edges switch the relay straight from the GPIO interrupt, without the
+ * ControlBox round trip. Stored as JSON in RULES_PATH:
+ *
+ *   {"tz": 60, "rules": [
+ *     {"on": "input_active", "do": "pulse", "duration": 3000, "cooldown": 5000},
+ *     {"on": "button_press", "do": "toggle", "from": "08:00", "to": "18:00", "weekdays": "1-5"},
+ *     {"on": "input_inactive", "do": "off", "relay": 1, "button": 0}]}
+ *
+ * "on" is button_press / button_release (reset button) or input_active / input_inactive (aux
+ * input; active = pulled to GND). "do" is on, off, toggle or pulse; a pulse takes "duration" or
+ * "sequence" like updateByAccessControl and defaults to one 10 s step. Optional conditions:
+ * "relay" (0/1) and "button" / "input" (1 = active) the current levels, "from"/"to" a local
+ * time window (may wrap midnight), "weekdays" a cron day-of-week field, and "cooldown" the ms
+ * after a rule fires during which it is ignored. Time conditions never match before SNTP sync.
+ * tz is the local offset from UTC in minutes. Every matching rule fires, in order.
+ */
+
+enum RULEINPUT
+{
+  RULEINPUT_BUTTON = 0,
+  RULEINPUT_AUX,
+  RULEINPUT_MAX
+};
+
+// Trigger code = input * 2 + active.
+static const char *const ruleTriggerNames[] = {"button_release", "button_press", "input_inactive", "input_active"};
+
+enum RULEACTION
+{
+  RULEACTION_ON = 0,
+  RULEACTION_OFF,
+  RULEACTION_TOGGLE,
+  RULEACTION_PULSE,
+  RULEACTION_MAX
+};
+
+static const char *const ruleActionNames[] = {"on", "off", "toggle", "pulse"};
+
+struct Rule
+{
+  uint8_t trigger;
+  uint8_t action;
+  int8_t relay;                 // required relay state, -1 = any
+  int8_t levels[RULEINPUT_MAX]; // required input levels (1 = active), -1 = any
+  uint8_t weekdays;             // bit 0 = Sunday
+  uint16_t from, to;            // local minute of day window [from, to), from == to = all day
+  bool timed;                   // from/to or weekdays given
+  uint32_t cooldownMs;
+  PulsePlan pulse;
+};
+
+struct RuleTable
+{
+  Rule rules[RULES_MAX];
+  uint8_t count;
+  int16_t offsetMin;
+};
+
+template <size_t N>
+static int ruleNameCode(const char *const (&names)[N], const char *name)
+{
+  for (size_t i = 0; name && i < N; i++)
+  {
+    if (strcmp(names[i], name) == 0)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// "HH:MM" -> minute of day, -1 if malformed.
+static int ruleParseTime(const char *s)
+{
+  if (!s || !isdigit((unsigned char)s[0]) || !isdigit((unsigned char)s[1]) || s[2] != ':' ||
+      !isdigit((unsigned char)s[3]) || !isdigit((unsigned char)s[4]) || s[5])
+  {
+    return -1;
+  }
+  int h = (s[0] - '0') * 10 + s[1] - '0';
+  int m = (s[3] - '0') * 10 + s[4] - '0';
+  return (h < 24 && m < 60) ? h * 60 + m : -1;
+}
+
+// 0/1 condition, -1 when absent; false when present but not 0 or 1.
+static bool ruleParseLevel(JsonVariantConst v, int8_t &level)
+{
+  level = -1;
+  if (v.isNull())
+  {
+    return true;
+  }
+  if (!v.is<int>() || (v.as<int>() != 0 && v.as<int>() != 1))
+  {
+    return false;
+  }
+  level = v.as<int>();
+  return true;
+}
+
+inline bool ruleFromJson(JsonObjectConst obj, Rule &rule)
+{
+  rule = {};
+  int trigger = ruleNameCode(ruleTriggerNames, obj["on"]);
+  int action = ruleNameCode(ruleActionNames, obj["do"]);
+  if (trigger < 0 || action < 0)
+  {
+    return false;
+  }
+  rule.trigger = trigger;
+  rule.action = action;
+  if (!ruleParseLevel(obj["relay"], rule.relay) ||
+      !ruleParseLevel(obj["button"], rule.levels[RULEINPUT_BUTTON]) ||
+      !ruleParseLevel(obj["input"], rule.levels[RULEINPUT_AUX]))
+  {
+    return false;
+  }
+
+  rule.weekdays = 0x7F;
+  const char *from = obj["from"];
+  const char *to = obj["to"];
+  const char *weekdays = obj["weekdays"];
+  if (from || to)
+  {
+    int f = ruleParseTime(from);
+    int t = ruleParseTime(to);
+    if (f < 0 || t < 0)
+    {
+      return false;
+    }
+    rule.from = f;
+    rule.to = t;
+    rule.timed = true;
+  }
+  if (weekdays)
+  {
+    uint64_t bits;
+    bool any;
+    const char *p = weekdays;
+    if (!cronParseField(&p, 0, 7, &bits, &any) || *p)
+    {
+      return false;
+    }
+    rule.weekdays = (bits | (bits >> 7)) & 0x7F;
+    rule.timed = true;
+  }
+
+  JsonVariantConst cooldown = obj["cooldown"];
+  if (!cooldown.isNull())
+  {
+    if (!cooldown.is<uint32_t>() || cooldown.as<uint32_t>() > RULES_MAX_COOLDOWN_MS)
+    {
+      return false;
+    }
+    rule.cooldownMs = cooldown.as<uint32_t>();
+  }
+
+  if (rule.action == RULEACTION_PULSE)
+  {
+    if (!pulsePlanFromJson(obj, rule.pulse))
+    {
+      return false;
+    }
+    if (!rule.pulse.steps)
+    {
+      rule.pulse = {1, {RULES_DEFAULT_PULSE_MS}};
+    }
+  }
+  return true;
+}
+
+// Compiles a rules document. out may be nullptr to validate only.
+inline bool rulesFromJson(const JsonDocument &doc, RuleTable *out)
+{
+  JsonArrayConst rules = doc["rules"];
+  int tz = doc["tz"] | 0;
+  if (rules.isNull() || rules.size() > RULES_MAX || tz < -720 || tz > 840)
+  {
+    return false;
+  }
+  Rule rule;
+  uint8_t count = 0;
+  for (JsonObjectConst obj : rules)
+  {
+    if (!ruleFromJson(obj, rule))
+    {
+      return false;
+    }
+    if (out)
+    {
+      out->rules[count] = rule;
+    }
+    count++;
+  }
+  if (out)
+  {
+    out->count = count;
+    out->offsetMin = tz;
+  }
+  return true;
+}
+
+// Evaluates the compiled table in the GPIO interrupt and switches the relay through the
+// PulseSequencer from there. After an edge, changes within RULES_DEBOUNCE_US are bounce; a
+// level that still differs when that lockout ends is taken then, from a one-shot esp_timer,
+// so a real change inside the lockout is not lost. The interrupt is attached without ESP_INTR_FLAG_IRAM (the
+// Arduino default), so it is masked during flash writes and may call flash-resident code.
+// The table is double buffered: the network task compiles into the inactive copy and
+// commit() swaps it in under mMux, which the ISR holds while it evaluates.
+class RuleEngine
+{
+public:
+  typedef void (*EdgeFn)(bool active);
+
+  // fn(active) runs after every debounced edge of input, after the rules: in the interrupt,
+  // or on the esp_timer task for an edge taken at the end of a lockout.
+  void onEdge(uint8_t input, EdgeFn fn) { mEdgeFns[input] = fn; }
+
+  void begin(uint8_t buttonPin, uint8_t auxPin, PulseSequencer *relay, volatile int *relayStatus,
+             TaskHandle_t *notify)
+  {
+    mRelay = relay;
+    mRelayStatus = relayStatus;
+    mNotify = notify;
+    uint8_t pins[RULEINPUT_MAX] = {buttonPin, auxPin};
+    for (int i = 0; i < RULEINPUT_MAX; i++)
+    {
+      Input &in = mInputs[i];
+      in.engine = this;
+      in.pin = pins[i];
+      in.index = i;
+      pinMode(in.pin, INPUT_PULLUP);
+      in.active = !digitalRead(in.pin);
+      esp_timer_create_args_t args = {};
+      args.callback = onInput;
+      args.arg = &in;
+      args.dispatch_method = ESP_TIMER_TASK;
+      args.name = "rule_lockout";
+      esp_timer_create(&args, &in.lockoutTimer);
+      attachInterruptArg(in.pin, onInput, &in, CHANGE);
+    }
+  }
+
+  // Inactive table for the network task to compile into.
+  RuleTable *staging() { return &mTables[!mActive]; }
+
+  // Makes the staging table live and clears the cooldowns and counters.
+  void commit()
+  {
+    portENTER_CRITICAL(&mMux);
+    mActive = !mActive;
+    memset(mLastFiredUs, 0, sizeof(mLastFiredUs));
+    memset(mRuleFired, 0, sizeof(mRuleFired));
+    portEXIT_CRITICAL(&mMux);
+  }
+
+  uint8_t count() const { return mTables[mActive].count; }
+
+  // Copies the fire count of each live rule into fired, consistent with the table commit()
+  // swaps in. Returns the number of rules.
+  uint8_t ruleFired(uint32_t fired[RULES_MAX]) const
+  {
+    portENTER_CRITICAL(&mMux);
+    uint8_t count = mTables[mActive].count;
+    memcpy(fired, mRuleFired, count * sizeof(fired[0]));
+    portEXIT_CRITICAL(&mMux);
+    return count;
+  }
+  // Rules fired since boot; the actuation task reports the relay when it moves.
+  uint32_t fired() const { return mFired; }
+
+  void toJson(JsonObject obj) const
+  {
+    obj["rules"] = count();
+    obj["fired"] = mFired;
+    obj["edges"] = mEdges;
+    obj["last_latency_us"] = mLastLatencyUs;
+    obj["max_latency_us"] = mMaxLatencyUs;
+  }
+
+private:
+  struct Input
+  {
+    RuleEngine *engine;
+    uint8_t pin;
+    uint8_t index;
+    bool active;
+    int64_t lastEdgeUs;
+    esp_timer_handle_t lockoutTimer; // samples the pin again when the lockout ends
+  };
+
+  // GPIO interrupt, and the lockout timer on the esp_timer task.
+  static void onInput(void *arg)
+  {
+    Input *in = (Input *)arg;
+    RuleEngine *self = in->engine;
+    int64_t now = esp_timer_get_time();
+    bool active = !digitalRead(in->pin);
+    portENTER_CRITICAL_SAFE(&self->mMux);
+    if (active == in->active)
+    {
+      portEXIT_CRITICAL_SAFE(&self->mMux);
+      return;
+    }
+    // The first edge acts at once; the bounce after it falls inside the lockout, and where
+    // the level ends up is read again when the lockout is over.
+    int64_t sinceEdge = now - in->lastEdgeUs;
+    if (sinceEdge < RULES_DEBOUNCE_US)
+    {
+      esp_timer_stop(in->lockoutTimer);
+      esp_timer_start_once(in->lockoutTimer, RULES_DEBOUNCE_US - sinceEdge);
+      portEXIT_CRITICAL_SAFE(&self->mMux);
+      return;
+    }
+    in->active = active;
+    in->lastEdgeUs = now;
+    self->mEdges++;
+    bool fired = self->evaluate(in->index * 2 + active, now);
+    portEXIT_CRITICAL_SAFE(&self->mMux);
+    if (self->mEdgeFns[in->index])
+    {
+      self->mEdgeFns[in->index](active);
+    }
+    if (!fired || !self->mNotify || !*self->mNotify)
+    {
+      return;
+    }
+    if (xPortInIsrContext())
+    {
+      BaseType_t woken = pdFALSE;
+      vTaskNotifyGiveFromISR(*self->mNotify, &woken);
+      portYIELD_FROM_ISR(woken);
+    }
+    else
+    {
+      xTaskNotifyGive(*self->mNotify);
+    }
+  }
+
+  // Local minute of day and weekday (bit index, 0 = Sunday); false before SNTP sync.
+  static bool localTime(int16_t offsetMin, int &minute, int &weekday)
+  {
+    uint32_t epoch = clockEpoch();
+    if (!epoch)
+    {
+      return false;
+    }
+    int64_t local = (int64_t)epoch / 60 + offsetMin;
+    minute = local % 1440;
+    weekday = (local / 1440 + 4) % 7; // 1970-01-01 was a Thursday
+    return true;
+  }
+
+  bool matches(const Rule &rule, int minute, int weekday, bool haveTime) const
+  {
+    if (rule.relay >= 0 && rule.relay != (*mRelayStatus ? 1 : 0))
+    {
+      return false;
+    }
+    for (int i = 0; i < RULEINPUT_MAX; i++)
+    {
+      if (rule.levels[i] >= 0 && rule.levels[i] != mInputs[i].active)
+      {
+        return false;
+      }
+    }
+    if (!rule.timed)
+    {
+      return true;
+    }
+    if (!haveTime || !(rule.weekdays & (1 << weekday)))
+    {
+      return false;
+    }
+    if (rule.from < rule.to)
+    {
+      return minute >= rule.from && minute < rule.to;
+    }
+    return rule.from == rule.to || minute >= rule.from || minute < rule.to;
+  }
+
+  bool evaluate(uint8_t trigger, int64_t now)
+  {
+    const RuleTable &table = mTables[mActive];
+    int minute = 0, weekday = 0;
+    bool haveTime = false, timeRead = false, fired = false;
+    for (uint8_t i = 0; i < table.count; i++)
+    {
+      const Rule &rule = table.rules[i];
+      if (rule.trigger != trigger || (mLastFiredUs[i] && now - mLastFiredUs[i] < rule.cooldownMs * 1000LL))
+      {
+        continue;
+      }
+      if (rule.timed && !timeRead)
+      {
+        haveTime = localTime(table.offsetMin, minute, weekday);
+        timeRead = true;
+      }
+      if (!matches(rule, minute, weekday, haveTime))
+      {
+        continue;
+      }
+      switch (rule.action)
+      {
+      case RULEACTION_ON:
+        mRelay->set(1);
+        break;
+      case RULEACTION_OFF:
+        mRelay->set(0);
+        break;
+      case RULEACTION_TOGGLE:
+        mRelay->set(*mRelayStatus ? 0 : 1);
+        break;
+      case RULEACTION_PULSE:
+        mRelay->start(1, rule.pulse);
+        break;
+      }
+      mLastFiredUs[i] = now;
+      mRuleFired[i]++;
+      mFired++;
+      fired = true;
+    }
+    if (fired)
+    {
+      mLastLatencyUs = (uint32_t)(esp_timer_get_time() - now);
+      if (mLastLatencyUs > mMaxLatencyUs)
+      {
+        mMaxLatencyUs = mLastLatencyUs;
+      }
+    }
+    return fired;
+  }
+
+  mutable portMUX_TYPE mMux = portMUX_INITIALIZER_UNLOCKED;
+  RuleTable mTables[2] = {};
+  uint8_t mActive = 0;
+  Input mInputs[RULEINPUT_MAX] = {};
+  EdgeFn mEdgeFns[RULEINPUT_MAX] = {};
+  int64_t mLastFiredUs[RULES_MAX] = {};
+  uint32_t mRuleFired[RULES_MAX] = {};
+  PulseSequencer *mRelay = nullptr;
+  volatile int *mRelayStatus = nullptr;
+  TaskHandle_t *mNotify = nullptr;
+  volatile uint32_t mFired = 0;
+  uint32_t mEdges = 0;
+  uint32_t mLastLatencyUs = 0;
+  uint32_t mMaxLatencyUs = 0;
+};
+
+RuleEngine mRules;
+
+// Reads RULES_PATH and makes it the live rule table; no file means no rules.
+inline bool rulesLoad()
+{
+  LargeJsonDoc pooled;
+  if (!pooled)
+  {
+    ESP_LOGI("RULES", "JSON pool exhausted, rules not reloaded");
+    return false;
+  }
+  RuleTable *table = mRules.staging();
+  table->count = 0;
+  bool ok = false;
+  if (FILESYSTEM.exists(RULES_PATH))
+  {
+    File file = FILESYSTEM.open(RULES_PATH, FILE_READ);
+    ok = file && !deserializeJson(*pooled, file) && rulesFromJson(*pooled, table);
+    if (!ok)
+    {
+      ESP_LOGI("RULES", "Unreadable rules in %s ignored", RULES_PATH);
+      table->count = 0;
+    }
+  }
+  mRules.commit();
+  ESP_LOGI("RULES", "Loaded %u rules", mRules.count());
+  return ok;
+}
+
+// Adds the per-rule fire counts to a stored rules document.
+inline void rulesToJson(JsonDocument &doc)
+{
+  uint32_t fired[RULES_MAX];
+  uint8_t count = mRules.ruleFired(fired);
+  doc["clock_synced"] = (bool)mClockSynced;
+  JsonArray rules = doc["rules"];
+  for (size_t i = 0; i < rules.size() && i < count; i++)
+  {
+    rules[i]["fired"] = fired[i];
+  }
+}
+
+#endif // __VMXRULES_H__
@@ -0,0 +1,134 @@
+#ifndef __VMXSCAN_H__
+#define __VMXSCAN_H__
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <WiFi.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#ifndef SCAN_CACHE_TTL
+#define SCAN_CACHE_TTL 30000 // ms between radio scans; set with -DSCAN_CACHE_TTL=...
+#endif
+#define SCAN_MAX_RESULTS 24
+
+// One network per SSID, keeping the strongest BSS seen for it.
+struct ScanEntry
+{
+  char ssid[33];
+  int8_t rssi;
+  uint8_t channel;
+  uint8_t encryption; // wifi_auth_mode_t
+};
+
+struct ScanCache
+{
+  ScanEntry entries[SCAN_MAX_RESULTS];
+  int count;
+  bool valid;             // at least one scan has completed
+  bool scanning;          // async scan in progress
+  bool requested;         // a client asked for results since the last scan
+  unsigned long lastScanTime;
+  SemaphoreHandle_t lock; // entries are read from async_tcp and written from loop()
+};
+
+ScanCache scanCache = {};
+
+inline void scanCacheBegin()
+{
+  scanCache.lock = xSemaphoreCreateMutex();
+}
+
+static void scanCacheCollect(int found)
+{
+  xSemaphoreTake(scanCache.lock, portMAX_DELAY);
+  scanCache.count = 0;
+  for (int i = 0; i < found; i++)
+  {
+    String ssid = WiFi.SSID(i);
+    if (!ssid.length())
+    {
+      continue; // hidden network
+    }
+    int8_t rssi = (int8_t)WiFi.RSSI(i);
+    int j = 0;
+    while (j < scanCache.count && strcmp(scanCache.entries[j].ssid, ssid.c_str()) != 0)
+    {
+      j++;
+    }
+    if (j == scanCache.count)
+    {
+      if (scanCache.count == SCAN_MAX_RESULTS)
+      {
+        continue;
+      }
+      strlcpy(scanCache.entries[j].ssid, ssid.c_str(), sizeof(scanCache.entries[j].ssid));
+      scanCache.count++;
+    }
+    else if (rssi <= scanCache.entries[j].rssi)
+    {
+      continue;
+    }
+    scanCache.entries[j].rssi = rssi;
+    scanCache.entries[j].channel = (uint8_t)WiFi.channel(i);
+    scanCache.entries[j].encryption = (uint8_t)WiFi.encryptionType(i);
+  }
+  scanCache.valid = true;
+  xSemaphoreGive(scanCache.lock);
+}
+
+// Called from loop(): finishes a pending scan and starts a new one when a client
+// asked for results and the cached ones are older than the TTL.
+inline void processScanCache()
+{
+  if (scanCache.scanning)
+  {
+    int res = WiFi.scanComplete();
+    if (res == WIFI_SCAN_RUNNING)
+    {
+      return;
+    }
+    if (res >= 0)
+    {
+      scanCacheCollect(res);
+      ESP_LOGI(TAG, "Scan completed: %d networks, %d unique SSIDs", res, scanCache.count);
+    }
+    WiFi.scanDelete(); // clean up RAM
+    scanCache.scanning = false;
+    scanCache.lastScanTime = millis();
+    return;
+  }
+
+  if (scanCache.requested && (!scanCache.valid || (millis() - scanCache.lastScanTime > SCAN_CACHE_TTL)))
+  {
+    scanCache.requested = false;
+    if (WiFi.scanNetworks(true) == WIFI_SCAN_RUNNING)
+    {
+      scanCache.scanning = true;
+    }
+  }
+}
+
+// Called from the HTTP handler. Never touches the radio, only the cache.
+inline bool scanCacheToJson(JsonDocument &doc)
+{
+  scanCache.requested = true;
+  if (!scanCache.valid)
+  {
+    return false;
+  }
+  JsonArray array = doc.to<JsonArray>();
+  xSemaphoreTake(scanCache.lock, portMAX_DELAY);
+  for (int i = 0; i < scanCache.count; i++)
+  {
+    JsonObject obj = array.createNestedObject();
+    obj["ssid"] = scanCache.entries[i].ssid;
+    obj["rssi"] = scanCache.entries[i].rssi;
+    obj["channel"] = scanCache.entries[i].channel;
+    obj["secure"] = scanCache.entries[i].encryption != WIFI_AUTH_OPEN;
+  }
+  xSemaphoreGive(scanCache.lock);
+  return true;
+}
+
+#endif // __VMXSCAN_H__
@@ -0,0 +1,277 @@
+#ifndef __VMXSCHEDULE_H__
+#define __VMXSCHEDULE_H__
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "VMXClock.h"
+#include "VMXCron.h"
+#include "VMXExt.h"
+#include "VMXJsonPool.h"
+#include "VMXTimerWheel.h"
+
+#define SCHEDULE_PATH "/schedule.json"
+#define SCHEDULE_MAX_ENTRIES 16
+#define SCHEDULE_MAX_FILE_SIZE 2048
+#define SCHEDULE_RESTORE_DAYS 7   // how far back "restore" looks for the last transition
+#define SCHEDULE_MAX_CLOCK_STEP 120 // s; a larger clock step re-arms the wheel from the new time
+
+/*
+ * Relay schedule, run on the device from the SNTP clock so it keeps working while the
+ * ControlBox or broker is unreachable. Stored as JSON in SCHEDULE_PATH:
+ *
+ *   {"tz": 60, "restore": true, "entries": [
+ *     {"cron": "0 8 * * 1-5", "state": 1},
+ *     {"cron": "0 18 * * 1-5", "state": 0},
+ *     {"at": 1767225600, "state": 1, "command": "updateByAccessControl"}]}
+ *
+ * tz is the local offset from UTC in minutes (no DST); cron fields are in local time and
+ * "at" is epoch seconds. "command" updateByAccessControl pulses like the MQTT command.
+ * With restore, (re)arming applies the latest transition of the last SCHEDULE_RESTORE_DAYS,
+ * so a relay that rebooted during opening hours comes back open.
+ */
+
+enum SCHEDTYPE
+{
+  SCHEDTYPE_ONCE = 0,
+  SCHEDTYPE_CRON,
+  SCHEDTYPE_MAX
+};
+
+struct ScheduleEntry
+{
+  CronSpec cron;
+  uint32_t at; // SCHEDTYPE_ONCE
+  uint8_t type;
+  uint8_t state;
+  bool autoOff;
+};
+
+struct Schedule
+{
+  ScheduleEntry entries[SCHEDULE_MAX_ENTRIES];
+  uint8_t count;
+  int16_t offsetMin;
+  bool restore;
+};
+
+// Owned by the network task.
+Schedule mSchedule = {};
+TimerWheel<SCHEDULE_MAX_ENTRIES> scheduleWheel;
+bool mScheduleArmed = false;
+uint32_t mScheduleFired = 0;
+
+// Copy of the next fire times for scheduleToJson() on the HTTP task; the schedule and the
+// wheel belong to the network task, which publishes the copy under mScheduleMux.
+portMUX_TYPE mScheduleMux = portMUX_INITIALIZER_UNLOCKED;
+uint32_t mScheduleNext[SCHEDULE_MAX_ENTRIES] = {}; // 0 = not armed
+uint8_t mScheduleNextCount = 0;
+uint32_t mScheduleNextFired = 0;
+
+inline void schedulePublish()
+{
+  portENTER_CRITICAL(&mScheduleMux);
+  mScheduleNextCount = mSchedule.count;
+  for (int i = 0; i < mSchedule.count; i++)
+  {
+    mScheduleNext[i] = (mScheduleArmed && scheduleWheel.pending(i)) ? scheduleWheel.due(i) : 0;
+  }
+  mScheduleNextFired = mScheduleFired;
+  portEXIT_CRITICAL(&mScheduleMux);
+}
+
+inline bool scheduleEntryFromJson(JsonObjectConst obj, ScheduleEntry &entry)
+{
+  entry = {};
+  const char *cron = obj["cron"];
+  if (cron)
+  {
+    entry.type = SCHEDTYPE_CRON;
+    if (!cronParse(cron, entry.cron))
+    {
+      return false;
+    }
+  }
+  else if (obj["at"].is<uint32_t>())
+  {
+    entry.type = SCHEDTYPE_ONCE;
+    entry.at = obj["at"];
+  }
+  else
+  {
+    return false;
+  }
+  JsonVariantConst state = obj["state"];
+  if (!state.is<int>() || (state.as<int>() != 0 && state.as<int>() != 1))
+  {
+    return false;
+  }
+  entry.state = state.as<int>();
+  const char *command = obj["command"] | "update";
+  if (strcmp(command, "updateByAccessControl") == 0)
+  {
+    entry.autoOff = true;
+  }
+  else if (strcmp(command, "update") != 0)
+  {
+    return false;
+  }
+  return true;
+}
+
+// Compiles a schedule document. out may be nullptr to validate only.
+inline bool scheduleFromJson(const JsonDocument &doc, Schedule *out)
+{
+  JsonArrayConst entries = doc["entries"];
+  int tz = doc["tz"] | 0;
+  if (entries.isNull() || entries.size() > SCHEDULE_MAX_ENTRIES || tz < -720 || tz > 840)
+  {
+    return false;
+  }
+  ScheduleEntry entry;
+  uint8_t count = 0;
+  for (JsonObjectConst obj : entries)
+  {
+    if (!scheduleEntryFromJson(obj, entry))
+    {
+      return false;
+    }
+    if (out)
+    {
+      out->entries[count] = entry;
+    }
+    count++;
+  }
+  if (out)
+  {
+    out->count = count;
+    out->offsetMin = tz;
+    out->restore = doc["restore"] | false;
+  }
+  return true;
+}
+
+// Reads SCHEDULE_PATH into mSchedule; the wheel is re-armed on the next scheduleRun().
+inline bool scheduleLoad()
+{
+  LargeJsonDoc pooled;
+  if (!pooled)
+  {
+    ESP_LOGI("SCHED", "JSON pool exhausted, schedule not reloaded");
+    return false;
+  }
+  mSchedule.count = 0;
+  mScheduleArmed = false;
+  bool ok = false;
+  if (FILESYSTEM.exists(SCHEDULE_PATH))
+  {
+    File file = FILESYSTEM.open(SCHEDULE_PATH, FILE_READ);
+    ok = file && !deserializeJson(*pooled, file) && scheduleFromJson(*pooled, &mSchedule);
+    if (!ok)
+    {
+      ESP_LOGI("SCHED", "Unreadable schedule in %s ignored", SCHEDULE_PATH);
+      mSchedule.count = 0;
+    }
+    else
+    {
+      ESP_LOGI("SCHED", "Loaded %u schedule entries", mSchedule.count);
+    }
+  }
+  schedulePublish();
+  return ok;
+}
+
+// Next time entry fires strictly after epoch, 0 if never.
+inline uint32_t scheduleNextFire(const ScheduleEntry &entry, uint32_t epoch)
+{
+  if (entry.type == SCHEDTYPE_CRON)
+  {
+    return cronNext(entry.cron, epoch, mSchedule.offsetMin);
+  }
+  return entry.at > epoch ? entry.at : 0;
+}
+
+// Latest time entry fired at or before epoch within SCHEDULE_RESTORE_DAYS, 0 if none.
+inline uint32_t schedulePrevFire(const ScheduleEntry &entry, uint32_t epoch)
+{
+  if (entry.type == SCHEDTYPE_CRON)
+  {
+    return cronPrev(entry.cron, epoch, mSchedule.offsetMin, SCHEDULE_RESTORE_DAYS);
+  }
+  return (entry.at <= epoch && epoch - entry.at <= SCHEDULE_RESTORE_DAYS * 86400UL) ? entry.at : 0;
+}
+
+// Drives the schedule from the network task; apply(entry) switches the relay.
+// Does nothing until the clock is synced.
+template <typename Fn>
+void scheduleRun(uint32_t now, Fn apply)
+{
+  if (!now)
+  {
+    return;
+  }
+  int32_t step = (int32_t)(now - scheduleWheel.now());
+  if (!mScheduleArmed || step > SCHEDULE_MAX_CLOCK_STEP || step < -SCHEDULE_MAX_CLOCK_STEP)
+  {
+    scheduleWheel.reset(now);
+    int latest = -1;
+    uint32_t latestAt = 0;
+    for (int i = 0; i < mSchedule.count; i++)
+    {
+      const ScheduleEntry &entry = mSchedule.entries[i];
+      uint32_t next = scheduleNextFire(entry, now);
+      if (next)
+      {
+        scheduleWheel.insert(i, next);
+      }
+      // A past pulse is over by now; only plain switches are restored.
+      uint32_t prev = (mSchedule.restore && !entry.autoOff) ? schedulePrevFire(entry, now) : 0;
+      if (prev > latestAt)
+      {
+        latest = i;
+        latestAt = prev;
+      }
+    }
+    mScheduleArmed = true;
+    if (latest >= 0)
+    {
+      apply(mSchedule.entries[latest]);
+    }
+    schedulePublish();
+    return;
+  }
+  scheduleWheel.advance(now, [&](uint16_t id)
+                        {
+    const ScheduleEntry &entry = mSchedule.entries[id];
+    mScheduleFired++;
+    apply(entry);
+    uint32_t next = scheduleNextFire(entry, scheduleWheel.now());
+    if (next)
+    {
+      scheduleWheel.insert(id, next);
+    } });
+  schedulePublish();
+}
+
+// Adds the next fire time of every entry to a stored schedule document.
+inline void scheduleToJson(JsonDocument &doc)
+{
+  uint32_t next[SCHEDULE_MAX_ENTRIES];
+  portENTER_CRITICAL(&mScheduleMux);
+  uint8_t count = mScheduleNextCount;
+  memcpy(next, mScheduleNext, sizeof(next));
+  uint32_t fired = mScheduleNextFired;
+  portEXIT_CRITICAL(&mScheduleMux);
+
+  doc["clock_synced"] = (bool)mClockSynced;
+  doc["fired"] = fired;
+  JsonArray entries = doc["entries"];
+  for (size_t i = 0; i < entries.size() && i < count; i++)
+  {
+    if (next[i])
+    {
+      entries[i]["next"] = next[i];
+    }
+  }
+}
+
+#endif // __VMXSCHEDULE_H__
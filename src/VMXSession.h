@@ -0,0 +1,83 @@
+#ifndef __VMXSESSION_H__
+#define __VMXSESSION_H__
+
+#include <Arduino.h>
+#include <Client.h>
+
+// PubSubClient keeps the CONNACK to itself, so the session present flag is read
+// off the wire here: this Client forwards everything to the real transport and
+// remembers byte 2 of the first packet received after each connect().
+class MqttSessionTap : public Client
+{
+public:
+  explicit MqttSessionTap(Client &transport) : mTransport(&transport) {}
+
+  // Switch between plain TCP and TLS; only while disconnected.
+  void setTransport(Client &transport) { mTransport = &transport; }
+
+  // Valid after PubSubClient::connect() returned true.
+  bool sessionPresent() const { return mRxCount >= 4 && (mConnAckFlags & 0x01); }
+
+  int connect(IPAddress ip, uint16_t port) override
+  {
+    restart();
+    return mTransport->connect(ip, port);
+  }
+  int connect(const char *host, uint16_t port) override
+  {
+    restart();
+    return mTransport->connect(host, port);
+  }
+  size_t write(uint8_t b) override { return mTransport->write(b); }
+  size_t write(const uint8_t *buf, size_t size) override { return mTransport->write(buf, size); }
+  int available() override { return mTransport->available(); }
+  int read() override
+  {
+    int b = mTransport->read();
+    if (b >= 0)
+    {
+      tap((uint8_t)b);
+    }
+    return b;
+  }
+  int read(uint8_t *buf, size_t size) override
+  {
+    int n = mTransport->read(buf, size);
+    for (int i = 0; i < n && mRxCount < 4; i++)
+    {
+      tap(buf[i]);
+    }
+    return n;
+  }
+  int peek() override { return mTransport->peek(); }
+  void flush() override { mTransport->flush(); }
+  void stop() override { mTransport->stop(); }
+  uint8_t connected() override { return mTransport->connected(); }
+  operator bool() override { return (bool)*mTransport; }
+
+private:
+  void restart()
+  {
+    mRxCount = 0;
+    mConnAckFlags = 0;
+  }
+
+  // CONNACK: 0x20, remaining length 2, acknowledge flags, return code
+  void tap(uint8_t b)
+  {
+    if (mRxCount == 2)
+    {
+      mConnAckFlags = b;
+    }
+    if (mRxCount < 4)
+    {
+      mRxCount++;
+    }
+  }
+
+  Client *mTransport;
+  uint8_t mRxCount = 0;
+  uint8_t mConnAckFlags = 0;
+};
+
+#endif // __VMXSESSION_H__
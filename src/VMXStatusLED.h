@@ -0,0 +1,59 @@
+#ifndef __VMXSTATUSLED_H__
+#define __VMXSTATUSLED_H__
+
+#include <Arduino.h>
+#include "driver/ledc.h"
+
+#define STATUS_LED_LEDC_MODE LEDC_LOW_SPEED_MODE
+#define STATUS_LED_LEDC_TIMER LEDC_TIMER_3
+#define STATUS_LED_LEDC_CHANNEL LEDC_CHANNEL_7
+#define STATUS_LED_LEDC_BITS 20
+#define STATUS_LED_MAX_PERIOD_MS 13000 // clock divider limit (18 bit, 10.8 fixed point) at 20 bits
+
+// Status LED blinking generated by the LEDC peripheral: one PWM period is one blink, so a
+// pattern is set once and then runs without the CPU, whatever the tasks are doing. The
+// periods (seconds) are below the 1 Hz the LEDC driver's freq_hz can express, so the timer
+// divider is programmed directly from the 80 MHz APB clock.
+class StatusLED
+{
+public:
+  bool begin(uint8_t pin)
+  {
+    ledc_timer_config_t timer = {};
+    timer.speed_mode = STATUS_LED_LEDC_MODE;
+    timer.duty_resolution = (ledc_timer_bit_t)STATUS_LED_LEDC_BITS;
+    timer.timer_num = STATUS_LED_LEDC_TIMER;
+    timer.freq_hz = 1;
+    timer.clk_cfg = LEDC_USE_APB_CLK;
+    ledc_channel_config_t channel = {};
+    channel.gpio_num = pin;
+    channel.speed_mode = STATUS_LED_LEDC_MODE;
+    channel.channel = STATUS_LED_LEDC_CHANNEL;
+    channel.intr_type = LEDC_INTR_DISABLE;
+    channel.timer_sel = STATUS_LED_LEDC_TIMER;
+    channel.duty = 0;
+    channel.hpoint = 0;
+    return ledc_timer_config(&timer) == ESP_OK && ledc_channel_config(&channel) == ESP_OK;
+  }
+
+  // On for onMs, off for offMs, repeated, starting with on now. offMs 0 is steady on and
+  // onMs 0 steady off.
+  void show(uint32_t onMs, uint32_t offMs)
+  {
+    if (!onMs || !offMs)
+    {
+      ledc_stop(STATUS_LED_LEDC_MODE, STATUS_LED_LEDC_CHANNEL, onMs ? 1 : 0);
+      return;
+    }
+    uint32_t periodMs = min(onMs + offMs, (uint32_t)STATUS_LED_MAX_PERIOD_MS);
+    // divider = period * APB / 2^bits, with 8 fractional bits
+    uint32_t divider = (uint64_t)periodMs * (APB_CLK_FREQ / 1000) * 256 >> STATUS_LED_LEDC_BITS;
+    uint32_t duty = ((uint64_t)min(onMs, periodMs) << STATUS_LED_LEDC_BITS) / periodMs;
+    ledc_timer_set(STATUS_LED_LEDC_MODE, STATUS_LED_LEDC_TIMER, divider, STATUS_LED_LEDC_BITS, LEDC_APB_CLK);
+    ledc_timer_rst(STATUS_LED_LEDC_MODE, STATUS_LED_LEDC_TIMER);
+    ledc_set_duty(STATUS_LED_LEDC_MODE, STATUS_LED_LEDC_CHANNEL, duty);
+    ledc_update_duty(STATUS_LED_LEDC_MODE, STATUS_LED_LEDC_CHANNEL);
+  }
+};
+
+#endif // __VMXSTATUSLED_H__
@@ -0,0 +1,200 @@
+#ifndef __VMXTIMERWHEEL_H__
+#define __VMXTIMERWHEEL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMERWHEEL_SLOT_BITS 6
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_SLOT_BITS)
+#define TIMERWHEEL_LEVELS 4
+#define TIMERWHEEL_NONE 0xFFFF
+
+// Hierarchical timer wheel over a fixed set of timer ids 0..Capacity-1: four levels of
+// 64 slots each, so level n covers 64^(n+1) ticks and insert/remove are O(1). Timers on
+// an upper level move down ("cascade") when the lower level wraps; a per-level
+// occupancy bitmap lets advance() jump over empty slots. Ticks are in whatever unit
+// the owner chooses and compared wrap-safe; due times further out than the wheel spans
+// are parked in the last slot and re-filed on every cascade until they come in range.
+// Not thread-safe: insert, remove and advance belong to one task.
+template <size_t Capacity>
+class TimerWheel
+{
+  static_assert(Capacity < TIMERWHEEL_NONE, "TimerWheel capacity too large");
+
+public:
+  explicit TimerWheel(uint32_t now = 0) { reset(now); }
+
+  // Drops every timer and restarts the wheel at tick now.
+  void reset(uint32_t now)
+  {
+    for (size_t i = 0; i < Capacity; i++)
+    {
+      mNodes[i].slot = TIMERWHEEL_NONE;
+    }
+    for (int l = 0; l < TIMERWHEEL_LEVELS; l++)
+    {
+      mOccupied[l] = 0;
+      for (int s = 0; s < TIMERWHEEL_SLOTS; s++)
+      {
+        mHeads[l][s] = TIMERWHEEL_NONE;
+      }
+    }
+    mNow = now;
+  }
+
+  // Last tick processed by advance().
+  uint32_t now() const { return mNow; }
+
+  bool pending(uint16_t id) const { return mNodes[id].slot != TIMERWHEEL_NONE; }
+  uint32_t due(uint16_t id) const { return mNodes[id].due; }
+
+  // (Re)arms timer id. A due tick that already passed fires on the next tick.
+  void insert(uint16_t id, uint32_t due)
+  {
+    remove(id);
+    if ((int32_t)(due - mNow) <= 0)
+    {
+      due = mNow + 1;
+    }
+    mNodes[id].due = due;
+    place(id);
+  }
+
+  void remove(uint16_t id)
+  {
+    Node &node = mNodes[id];
+    if (node.slot == TIMERWHEEL_NONE)
+    {
+      return;
+    }
+    uint8_t level = node.slot >> TIMERWHEEL_SLOT_BITS;
+    uint8_t slot = node.slot & (TIMERWHEEL_SLOTS - 1);
+    if (node.prev != TIMERWHEEL_NONE)
+    {
+      mNodes[node.prev].next = node.next;
+    }
+    else
+    {
+      mHeads[level][slot] = node.next;
+      if (node.next == TIMERWHEEL_NONE)
+      {
+        mOccupied[level] &= ~(1ULL << slot);
+      }
+    }
+    if (node.next != TIMERWHEEL_NONE)
+    {
+      mNodes[node.next].prev = node.prev;
+    }
+    node.slot = TIMERWHEEL_NONE;
+  }
+
+  // Processes ticks up to and including now, calling fn(id) for every timer that
+  // became due. fn may insert or remove timers, including the one that fired.
+  template <typename Fn>
+  void advance(uint32_t now, Fn fn)
+  {
+    while ((int32_t)(now - mNow) > 0)
+    {
+      uint32_t tick = nextInterestingTick();
+      if ((int32_t)(tick - now) > 0)
+      {
+        mNow = now;
+        return;
+      }
+      mNow = tick;
+      if ((tick & (TIMERWHEEL_SLOTS - 1)) == 0)
+      {
+        cascade(tick);
+      }
+      // One at a time, so fn can remove a timer due on the same tick. Timers re-armed by
+      // fn land in later slots.
+      uint8_t slot = tick & (TIMERWHEEL_SLOTS - 1);
+      uint16_t id;
+      while ((id = mHeads[0][slot]) != TIMERWHEEL_NONE)
+      {
+        remove(id);
+        fn(id);
+      }
+    }
+  }
+
+private:
+  struct Node
+  {
+    uint32_t due;
+    uint16_t next;
+    uint16_t prev;
+    uint16_t slot; // level << TIMERWHEEL_SLOT_BITS | slot, TIMERWHEEL_NONE when idle
+  };
+
+  // Files a node by its distance from mNow. Callers make sure due > mNow, except
+  // cascade(), which may file a timer due exactly at mNow into the current slot.
+  void place(uint16_t id)
+  {
+    Node &node = mNodes[id];
+    uint32_t delta = node.due - mNow;
+    uint32_t due = node.due;
+    int level = 0;
+    while (level < TIMERWHEEL_LEVELS - 1 && delta >= (1UL << (TIMERWHEEL_SLOT_BITS * (level + 1))))
+    {
+      level++;
+    }
+    uint32_t span = (uint32_t)(TIMERWHEEL_SLOTS - 1) << (TIMERWHEEL_SLOT_BITS * level);
+    if (delta > span)
+    {
+      due = mNow + span; // beyond the wheel: park in the furthest slot
+    }
+    uint8_t slot = (due >> (TIMERWHEEL_SLOT_BITS * level)) & (TIMERWHEEL_SLOTS - 1);
+    node.slot = (level << TIMERWHEEL_SLOT_BITS) | slot;
+    node.prev = TIMERWHEEL_NONE;
+    node.next = mHeads[level][slot];
+    if (node.next != TIMERWHEEL_NONE)
+    {
+      mNodes[node.next].prev = id;
+    }
+    mHeads[level][slot] = id;
+    mOccupied[level] |= 1ULL << slot;
+  }
+
+  // Upper levels first, so a timer can drop several levels in one go.
+  void cascade(uint32_t tick)
+  {
+    for (int level = TIMERWHEEL_LEVELS - 1; level > 0; level--)
+    {
+      uint32_t mask = (1UL << (TIMERWHEEL_SLOT_BITS * level)) - 1;
+      if (tick & mask)
+      {
+        continue;
+      }
+      uint8_t slot = (tick >> (TIMERWHEEL_SLOT_BITS * level)) & (TIMERWHEEL_SLOTS - 1);
+      uint16_t id = mHeads[level][slot];
+      mHeads[level][slot] = TIMERWHEEL_NONE;
+      mOccupied[level] &= ~(1ULL << slot);
+      while (id != TIMERWHEEL_NONE)
+      {
+        uint16_t next = mNodes[id].next;
+        place(id);
+        id = next;
+      }
+    }
+  }
+
+  // The next tick after mNow with a level 0 timer in it, or the next slot wrap.
+  uint32_t nextInterestingTick() const
+  {
+    uint32_t pos = mNow & (TIMERWHEEL_SLOTS - 1);
+    uint64_t later = (pos == TIMERWHEEL_SLOTS - 1) ? 0 : mOccupied[0] & (~0ULL << (pos + 1));
+    if (later)
+    {
+      return (mNow & ~(uint32_t)(TIMERWHEEL_SLOTS - 1)) + __builtin_ctzll(later);
+    }
+    return (mNow | (TIMERWHEEL_SLOTS - 1)) + 1;
+  }
+
+  Node mNodes[Capacity];
+  uint16_t mHeads[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+  uint64_t mOccupied[TIMERWHEEL_LEVELS];
+  uint32_t mNow;
+};
+
+#endif // __VMXTIMERWHEEL_H__
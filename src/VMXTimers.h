@@ -0,0 +1,113 @@
+#ifndef __VMXTIMERS_H__
+#define __VMXTIMERS_H__
+
+#include <Arduino.h>
+#include "VMXTimerWheel.h"
+
+#define TIMERS_FOREVER UINT32_MAX
+
+typedef void (*TimerFn)();
+
+// One-shot and periodic millisecond timers with callbacks, on a TimerWheel ticking in
+// millis(). Each task owns its own service and calls run() before it sleeps for the time
+// run() returns, so nothing is compared on every pass. Periodic timers keep their phase:
+// the next due time is the previous one plus the period, unless the task fell a whole
+// period behind. Not thread-safe; start()/stop() belong to the owning task.
+template <size_t Capacity>
+class TimerService
+{
+public:
+  void begin() { mWheel.reset(millis()); }
+
+  // Registers a callback, stopped. Returns the timer id, TIMERWHEEL_NONE when full.
+  uint16_t add(TimerFn fn)
+  {
+    if (mCount >= Capacity)
+    {
+      return TIMERWHEEL_NONE;
+    }
+    mTimers[mCount] = {fn, 0};
+    return mCount++;
+  }
+
+  // (Re)starts id to fire delayMs from now, then every periodMs if that is not 0.
+  void start(uint16_t id, uint32_t delayMs, uint32_t periodMs = 0)
+  {
+    mTimers[id].periodMs = periodMs;
+    mWheel.insert(id, millis() + delayMs);
+  }
+
+  void stop(uint16_t id) { mWheel.remove(id); }
+  bool active(uint16_t id) const { return mWheel.pending(id); }
+
+  // ms until id fires, TIMERS_FOREVER if it is stopped.
+  uint32_t remaining(uint16_t id) const
+  {
+    if (!mWheel.pending(id))
+    {
+      return TIMERS_FOREVER;
+    }
+    return (uint32_t)max((int32_t)(mWheel.due(id) - millis()), (int32_t)0);
+  }
+
+  // Calls every due callback. Returns the ms until the next deadline, TIMERS_FOREVER if
+  // no timer runs.
+  uint32_t run()
+  {
+    mWheel.advance(millis(), [this](uint16_t id)
+                   {
+      const Timer &timer = mTimers[id];
+      if (timer.periodMs)
+      {
+        uint32_t next = mWheel.now() + timer.periodMs;
+        if ((int32_t)(next - millis()) <= 0)
+        {
+          next = millis() + timer.periodMs;
+        }
+        mWheel.insert(id, next);
+      }
+      mFired++;
+      timer.fn(); });
+    return wait();
+  }
+
+  // ms until the next deadline, TIMERS_FOREVER if no timer runs.
+  uint32_t wait() const
+  {
+    uint32_t now = millis();
+    uint32_t next = TIMERS_FOREVER;
+    for (uint16_t id = 0; id < mCount; id++)
+    {
+      if (mWheel.pending(id))
+      {
+        int32_t left = (int32_t)(mWheel.due(id) - now);
+        next = min(next, (uint32_t)max(left, (int32_t)0));
+      }
+    }
+    return next;
+  }
+
+  uint32_t fired() const { return mFired; }
+
+private:
+  struct Timer
+  {
+    TimerFn fn;
+    uint32_t periodMs;
+  };
+
+  TimerWheel<Capacity> mWheel;
+  Timer mTimers[Capacity] = {};
+  uint16_t mCount = 0;
+  uint32_t mFired = 0;
+};
+
+#define TIMERS_MAX_WAIT_MS 3600000 // pdMS_TO_TICKS() overflows a little above 71 minutes
+
+// TimerService::run() result as a FreeRTOS block time.
+inline TickType_t timerWaitTicks(uint32_t waitMs)
+{
+  return waitMs == TIMERS_FOREVER ? portMAX_DELAY : pdMS_TO_TICKS(min(waitMs, (uint32_t)TIMERS_MAX_WAIT_MS));
+}
+
+#endif // __VMXTIMERS_H__
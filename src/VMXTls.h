@@ -0,0 +1,601 @@
+#ifndef __VMXTLS_H__
+#define __VMXTLS_H__
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <Client.h>
+#include <WiFiClient.h>
+#include "VMXExt.h"
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/version.h"
+#include "mbedtls/x509_crt.h"
+
+// Whether the broker resumed the session is only visible in the handshake state, which
+// mbedtls 3 made private. platformio.ini pins espressif32 6.x (Arduino 2.x, mbedtls 2.28).
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+#error "TlsClient needs mbedtls 2.x, see the platform in platformio.ini"
+#endif
+#include "mbedtls/ssl_internal.h" // handshake->resume
+
+#define TLS_CA_PATH "/mqtt_ca.pem"     // ControlBox broker CA, uploaded with POST /api/v1/tls
+#define TLS_CA_MAX_SIZE 4096
+#define TLS_HANDSHAKE_TIMEOUT_MS 15000
+#define TLS_WRITE_TIMEOUT_MS 5000      // broker stopped reading (zero window): give up the connection
+#define TLS_SESSION_MAGIC 0x564D5853   // "VMXS"
+#define TLS_SESSION_RTC_SIZE 2048      // serialized session incl. ticket and peer certificate
+#define TLS_SESSION_CACHE_SIZE 4       // one per broker (BROKER_MAX)
+
+// Last negotiated session, serialized into RTC slow memory so a software reset
+// (OTA, watchdog, reboot command) can still resume instead of a full handshake.
+struct TlsSessionRtc
+{
+  uint32_t magic;
+  char host[16];
+  uint16_t port;
+  uint16_t len;
+  uint8_t data[TLS_SESSION_RTC_SIZE];
+};
+
+RTC_NOINIT_ATTR TlsSessionRtc tlsSessionRtc;
+
+struct TlsStats
+{
+  uint32_t fullHandshakes;
+  uint32_t resumedHandshakes;
+  uint32_t failures;
+  uint32_t lastHandshakeUs;
+  uint32_t lastHeapPeak; // bytes of heap taken at the worst point of the last connect
+  bool lastResumed;
+  bool caLoaded;
+  bool insecure;         // no CA, connected without verifying the broker (setInsecure())
+  int lastError;         // mbedtls error code, 0 = none
+};
+
+// TLS client for PubSubClient on top of WiFiClient, using mbedtls directly because
+// WiFiClientSecure cannot hand a cached session to the handshake. The session of the
+// last successful handshake with each broker is offered on the next connect to it
+// (session ID or ticket, whichever the broker issued), so reconnects and failovers skip
+// the certificate exchange and the ECDHE key agreement.
+//
+// The broker certificate is verified against the CA at TLS_CA_PATH and the host name
+// connected to. The ControlBox is addressed by IP, and mbedtls 2.x does not match IP
+// address SANs: the certificate needs the IP as its CN or as a DNS name SAN. Without a CA,
+// connect() fails unless setInsecure(true) allowed an unverified connection.
+class TlsClient : public Client
+{
+public:
+  TlsClient()
+  {
+    mbedtls_ssl_init(&mSsl);
+    for (CachedSession &cached : mSessions)
+    {
+      mbedtls_ssl_session_init(&cached.session);
+    }
+  }
+
+  const TlsStats &stats() const { return mStats; }
+
+  // Allows connecting without a CA, then without verifying the broker at all.
+  void setInsecure(bool insecure)
+  {
+    if (insecure != mInsecure)
+    {
+      mInsecure = insecure;
+      mConfigured = false;
+    }
+  }
+
+  // The CA file changed: it is read again on the next connect, and sessions established
+  // under the old one are not offered.
+  void reload()
+  {
+    mConfigured = false;
+    forgetSessions();
+  }
+
+  // Drops the cached session of one broker.
+  void forgetSession(const char *host, uint16_t port)
+  {
+    int i = findSession(host, port);
+    if (i >= 0)
+    {
+      freeSession(mSessions[i]);
+    }
+    if (tlsSessionRtc.port == port && strncmp(tlsSessionRtc.host, host, sizeof(tlsSessionRtc.host)) == 0)
+    {
+      tlsSessionRtc.magic = 0;
+    }
+  }
+
+  void forgetSessions()
+  {
+    for (CachedSession &cached : mSessions)
+    {
+      freeSession(cached);
+    }
+    tlsSessionRtc.magic = 0;
+  }
+
+  int connect(IPAddress ip, uint16_t port) override
+  {
+    char host[16];
+    snprintf(host, sizeof(host), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+    return connect(host, port);
+  }
+
+  int connect(const char *host, uint16_t port) override
+  {
+    stop();
+    if (!begin())
+    {
+      return 0;
+    }
+    loadRtcSession(host, port);
+
+    size_t freeBefore = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    size_t globalMinBefore = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    mMinFree = freeBefore;
+    int64_t start = esp_timer_get_time();
+
+    if (!mTcp.connect(host, port))
+    {
+      return 0;
+    }
+    int ret = mbedtls_ssl_setup(&mSsl, &mConf);
+    if (ret == 0)
+    {
+      ret = mbedtls_ssl_set_hostname(&mSsl, host);
+    }
+    if (ret == 0)
+    {
+      mbedtls_ssl_set_bio(&mSsl, this, bioSend, bioRecv, NULL);
+      int cached = findSession(host, port);
+      if (cached >= 0)
+      {
+        mSessions[cached].usedMs = millis();
+        mbedtls_ssl_set_session(&mSsl, &mSessions[cached].session);
+      }
+      ret = handshake();
+    }
+
+    uint32_t us = (uint32_t)(esp_timer_get_time() - start);
+    size_t globalMin = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    // The all-time minimum is exact when the handshake set a new one; otherwise use the I/O samples.
+    size_t minFree = (globalMin < globalMinBefore) ? globalMin : mMinFree;
+    mStats.lastHeapPeak = freeBefore > minFree ? freeBefore - minFree : 0;
+    mStats.lastHandshakeUs = us;
+    mStats.lastError = ret;
+    if (ret != 0)
+    {
+      ESP_LOGI("TLS", "Handshake with %s:%u failed: -0x%04X", host, port, -ret);
+      mStats.failures++;
+      forgetSession(host, port); // a rejected or corrupt session must not be offered again
+      stop();
+      return 0;
+    }
+
+    saveSession(host, port);
+    mHandshakeDone = true;
+    if (mStats.lastResumed)
+    {
+      mStats.resumedHandshakes++;
+    }
+    else
+    {
+      mStats.fullHandshakes++;
+    }
+    ESP_LOGI("TLS", "%s handshake with %s:%u in %u ms, heap peak %u bytes", mStats.lastResumed ? "Resumed" : "Full",
+             host, port, us / 1000, mStats.lastHeapPeak);
+    return 1;
+  }
+
+  size_t write(uint8_t b) override { return write(&b, 1); }
+
+  size_t write(const uint8_t *buf, size_t size) override
+  {
+    if (!mHandshakeDone)
+    {
+      return 0;
+    }
+    unsigned long start = millis();
+    size_t sent = 0;
+    while (sent < size)
+    {
+      int ret = mbedtls_ssl_write(&mSsl, buf + sent, size - sent);
+      if (ret > 0)
+      {
+        sent += ret;
+        start = millis();
+      }
+      else if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+      {
+        break;
+      }
+      else if (millis() - start > TLS_WRITE_TIMEOUT_MS)
+      {
+        ESP_LOGW("TLS", "Write stalled for %u ms, closing", TLS_WRITE_TIMEOUT_MS);
+        // A record may be half written, so no close_notify after it.
+        mHandshakeDone = false;
+        stop();
+        break;
+      }
+      else
+      {
+        vTaskDelay(1);
+      }
+    }
+    return sent;
+  }
+
+  int available() override
+  {
+    if (!mHandshakeDone)
+    {
+      return 0;
+    }
+    int avail = mbedtls_ssl_get_bytes_avail(&mSsl);
+    if (!avail && mTcp.available())
+    {
+      // Decrypt the next record without consuming application data.
+      mbedtls_ssl_read(&mSsl, NULL, 0);
+      avail = mbedtls_ssl_get_bytes_avail(&mSsl);
+    }
+    return avail + (mPeek >= 0 ? 1 : 0);
+  }
+
+  int read() override
+  {
+    uint8_t b;
+    return read(&b, 1) == 1 ? b : -1;
+  }
+
+  int read(uint8_t *buf, size_t size) override
+  {
+    if (!mHandshakeDone || !size)
+    {
+      return -1;
+    }
+    int n = 0;
+    if (mPeek >= 0)
+    {
+      buf[n++] = (uint8_t)mPeek;
+      mPeek = -1;
+    }
+    if ((size_t)n < size && mbedtls_ssl_get_bytes_avail(&mSsl))
+    {
+      int ret = mbedtls_ssl_read(&mSsl, buf + n, size - n);
+      if (ret > 0)
+      {
+        n += ret;
+      }
+    }
+    return n ? n : -1;
+  }
+
+  int peek() override
+  {
+    if (mPeek < 0)
+    {
+      uint8_t b;
+      if (available() && mbedtls_ssl_read(&mSsl, &b, 1) == 1)
+      {
+        mPeek = b;
+      }
+    }
+    return mPeek;
+  }
+
+  void flush() override { mTcp.flush(); }
+
+  // The context and its record buffers are freed between connections.
+  void stop() override
+  {
+    if (mHandshakeDone)
+    {
+      mbedtls_ssl_close_notify(&mSsl);
+    }
+    mHandshakeDone = false;
+    mPeek = -1;
+    mTcp.stop();
+    mbedtls_ssl_free(&mSsl);
+    mbedtls_ssl_init(&mSsl);
+  }
+
+  uint8_t connected() override { return mHandshakeDone && (mTcp.connected() || available()); }
+  int fd() const { return mTcp.fd(); }
+  operator bool() override { return connected(); }
+
+  void toJson(JsonObject obj) const
+  {
+    obj["ca_loaded"] = mStats.caLoaded;
+    obj["insecure"] = mStats.insecure;
+    obj["full_handshakes"] = mStats.fullHandshakes;
+    obj["resumed_handshakes"] = mStats.resumedHandshakes;
+    obj["failures"] = mStats.failures;
+    obj["last_handshake_ms"] = mStats.lastHandshakeUs / 1000.0f;
+    obj["last_resumed"] = mStats.lastResumed;
+    obj["last_heap_peak"] = mStats.lastHeapPeak;
+    obj["last_error"] = mStats.lastError;
+    uint8_t cached = 0;
+    for (const CachedSession &session : mSessions)
+    {
+      cached += session.valid;
+    }
+    obj["sessions_cached"] = cached;
+  }
+
+private:
+  struct CachedSession
+  {
+    char host[16];
+    uint16_t port;
+    bool valid;
+    uint32_t usedMs;
+    mbedtls_ssl_session session;
+  };
+
+  // RNG once; configuration and CA again after setInsecure() or reload(), and on every
+  // connect while there is neither a CA nor the insecure opt-in.
+  bool begin()
+  {
+    if (!mInitialized)
+    {
+      mbedtls_ssl_config_init(&mConf);
+      mbedtls_ctr_drbg_init(&mDrbg);
+      mbedtls_entropy_init(&mEntropy);
+      mbedtls_x509_crt_init(&mCa);
+      if (mbedtls_ctr_drbg_seed(&mDrbg, mbedtls_entropy_func, &mEntropy, NULL, 0) != 0)
+      {
+        return false;
+      }
+      mInitialized = true;
+    }
+    if (mConfigured)
+    {
+      return true;
+    }
+    mbedtls_ssl_config_free(&mConf);
+    mbedtls_ssl_config_init(&mConf);
+    if (mbedtls_ssl_config_defaults(&mConf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                    MBEDTLS_SSL_PRESET_DEFAULT) != 0)
+    {
+      return false;
+    }
+    mbedtls_ssl_conf_rng(&mConf, mbedtls_ctr_drbg_random, &mDrbg);
+    mbedtls_ssl_conf_session_tickets(&mConf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+
+    mStats.caLoaded = loadCa();
+    mStats.insecure = !mStats.caLoaded && mInsecure;
+    if (mStats.caLoaded)
+    {
+      mbedtls_ssl_conf_ca_chain(&mConf, &mCa, NULL);
+      mbedtls_ssl_conf_authmode(&mConf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    }
+    else if (mInsecure)
+    {
+      ESP_LOGW("TLS", "No CA at %s, insecure TLS allowed: the broker certificate is NOT verified", TLS_CA_PATH);
+      mbedtls_ssl_conf_authmode(&mConf, MBEDTLS_SSL_VERIFY_NONE);
+    }
+    else
+    {
+      ESP_LOGE("TLS", "No CA at %s, not connecting; upload one or set tls_insecure", TLS_CA_PATH);
+      return false;
+    }
+    mConfigured = true;
+    return true;
+  }
+
+  bool loadCa()
+  {
+    mbedtls_x509_crt_free(&mCa);
+    mbedtls_x509_crt_init(&mCa);
+    if (!filesystemMount() || !FILESYSTEM.exists(TLS_CA_PATH))
+    {
+      return false;
+    }
+    File file = FILESYSTEM.open(TLS_CA_PATH, FILE_READ);
+    if (!file || file.size() >= TLS_CA_MAX_SIZE)
+    {
+      return false;
+    }
+    size_t len = file.size();
+    uint8_t *pem = (uint8_t *)malloc(len + 1);
+    if (!pem)
+    {
+      return false;
+    }
+    file.read(pem, len);
+    file.close();
+    pem[len] = '\0';
+    int ret = mbedtls_x509_crt_parse(&mCa, pem, len + 1);
+    free(pem);
+    return ret == 0;
+  }
+
+  // Stepped by hand so whether the server accepted the offered session can be read
+  // before mbedtls frees the handshake state.
+  int handshake()
+  {
+    unsigned long start = millis();
+    mStats.lastResumed = false;
+    while (mSsl.state != MBEDTLS_SSL_HANDSHAKE_OVER)
+    {
+      int ret = mbedtls_ssl_handshake_step(&mSsl);
+      if (mSsl.handshake)
+      {
+        mStats.lastResumed = mSsl.handshake->resume;
+      }
+      if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+      {
+        if (millis() - start > TLS_HANDSHAKE_TIMEOUT_MS)
+        {
+          return MBEDTLS_ERR_SSL_TIMEOUT;
+        }
+        vTaskDelay(1);
+      }
+      else if (ret != 0)
+      {
+        return ret;
+      }
+    }
+    if (mbedtls_ssl_get_verify_result(&mSsl) != 0 && mStats.caLoaded)
+    {
+      return MBEDTLS_ERR_X509_CERT_VERIFY_FAILED;
+    }
+    return 0;
+  }
+
+  int findSession(const char *host, uint16_t port) const
+  {
+    for (int i = 0; i < TLS_SESSION_CACHE_SIZE; i++)
+    {
+      if (mSessions[i].valid && mSessions[i].port == port && strcmp(mSessions[i].host, host) == 0)
+      {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  // Slot for a new session of host: its own, a free one, or the least recently used.
+  CachedSession &sessionSlot(const char *host, uint16_t port)
+  {
+    int i = findSession(host, port);
+    if (i >= 0)
+    {
+      return mSessions[i];
+    }
+    CachedSession *slot = &mSessions[0];
+    for (CachedSession &cached : mSessions)
+    {
+      if (!cached.valid)
+      {
+        return cached;
+      }
+      if ((int32_t)(cached.usedMs - slot->usedMs) < 0)
+      {
+        slot = &cached;
+      }
+    }
+    return *slot;
+  }
+
+  static void freeSession(CachedSession &cached)
+  {
+    mbedtls_ssl_session_free(&cached.session);
+    mbedtls_ssl_session_init(&cached.session);
+    cached.valid = false;
+  }
+
+  // Keeps the session (and any new ticket) for the next connect to host, in RAM and, for
+  // the last broker connected to, in RTC memory.
+  void saveSession(const char *host, uint16_t port)
+  {
+    mbedtls_ssl_session fresh;
+    mbedtls_ssl_session_init(&fresh);
+    if (mbedtls_ssl_get_session(&mSsl, &fresh) != 0)
+    {
+      mbedtls_ssl_session_free(&fresh);
+      return;
+    }
+    CachedSession &cached = sessionSlot(host, port);
+    mbedtls_ssl_session_free(&cached.session);
+    cached.session = fresh; // ownership of the ticket and peer certificate moves over
+    cached.valid = true;
+    cached.usedMs = millis();
+    strlcpy(cached.host, host, sizeof(cached.host));
+    cached.port = port;
+
+    size_t len = 0;
+    tlsSessionRtc.magic = 0;
+    if (mbedtls_ssl_session_save(&cached.session, tlsSessionRtc.data, sizeof(tlsSessionRtc.data), &len) == 0)
+    {
+      strlcpy(tlsSessionRtc.host, host, sizeof(tlsSessionRtc.host));
+      tlsSessionRtc.port = port;
+      tlsSessionRtc.len = len;
+      tlsSessionRtc.magic = TLS_SESSION_MAGIC;
+    }
+  }
+
+  // After a software reset the RAM cache is empty; take the session from RTC memory.
+  void loadRtcSession(const char *host, uint16_t port)
+  {
+    if (findSession(host, port) >= 0 || tlsSessionRtc.magic != TLS_SESSION_MAGIC ||
+        esp_reset_reason() == ESP_RST_POWERON || tlsSessionRtc.len > sizeof(tlsSessionRtc.data) ||
+        tlsSessionRtc.port != port || strncmp(tlsSessionRtc.host, host, sizeof(tlsSessionRtc.host)) != 0)
+    {
+      return;
+    }
+    CachedSession &cached = sessionSlot(host, port);
+    freeSession(cached);
+    if (mbedtls_ssl_session_load(&cached.session, tlsSessionRtc.data, tlsSessionRtc.len) == 0)
+    {
+      cached.valid = true;
+      cached.usedMs = millis();
+      strlcpy(cached.host, host, sizeof(cached.host));
+      cached.port = port;
+    }
+    else
+    {
+      freeSession(cached);
+      tlsSessionRtc.magic = 0;
+    }
+  }
+
+  static int bioSend(void *ctx, const unsigned char *buf, size_t len)
+  {
+    TlsClient *self = (TlsClient *)ctx;
+    self->sampleHeap();
+    if (!self->mTcp.connected())
+    {
+      return MBEDTLS_ERR_NET_CONN_RESET;
+    }
+    size_t n = self->mTcp.write(buf, len);
+    return n ? (int)n : MBEDTLS_ERR_SSL_WANT_WRITE;
+  }
+
+  static int bioRecv(void *ctx, unsigned char *buf, size_t len)
+  {
+    TlsClient *self = (TlsClient *)ctx;
+    self->sampleHeap();
+    if (!self->mTcp.available())
+    {
+      return self->mTcp.connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_CONN_RESET;
+    }
+    int n = self->mTcp.read(buf, len);
+    return n > 0 ? n : MBEDTLS_ERR_SSL_WANT_READ;
+  }
+
+  void sampleHeap()
+  {
+    size_t freeNow = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    if (freeNow < mMinFree)
+    {
+      mMinFree = freeNow;
+    }
+  }
+
+  WiFiClient mTcp;
+  mbedtls_ssl_context mSsl;
+  mbedtls_ssl_config mConf;
+  mbedtls_ctr_drbg_context mDrbg;
+  mbedtls_entropy_context mEntropy;
+  mbedtls_x509_crt mCa;
+  CachedSession mSessions[TLS_SESSION_CACHE_SIZE] = {};
+  bool mInitialized = false;
+  bool mConfigured = false;
+  bool mInsecure = false;
+  bool mHandshakeDone = false;
+  int mPeek = -1;
+  size_t mMinFree = 0;
+  TlsStats mStats = {};
+};
+
+#endif // __VMXTLS_H__
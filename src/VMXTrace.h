@@ -0,0 +1,228 @@
+#ifndef __VMXTRACE_H__
+#define __VMXTRACE_H__
+
+/*
+ * Begin/end event tracer for latency that crosses subsystems (an MQTT callback waiting on
+ * a log write waiting on LittleFS). Compiled in with -DVMX_TRACE (env nodemcu-32s-trace in
+ * platformio.ini); otherwise the TRACE_* macros are empty.
+ *
+ * Each event is 8 bytes in a RAM ring: the CPU cycle count of the recording core (extended
+ * to 48 bits by counting wraps), the event id, begin/end, the core and a task index. Task
+ * names are kept once per task. GET /api/v1/trace returns the ring in the binary layout of
+ * Tracer::dump(); tools/vmxtrace.py turns it into Chrome trace JSON for Perfetto.
+ *
+ * The cycle counter wraps every ~18 s at 240 MHz. A core that records nothing for longer
+ * than that misses a wrap, and its older events land 18 s late on the timeline.
+ */
+
+#include <Arduino.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define TRACE_EVENTS 1024 // power of two, 8 bytes each
+#define TRACE_MAX_TASKS 32
+#define TRACE_TASK_NAME_SIZE 16
+#define TRACE_MAGIC "VMXT"
+#define TRACE_VERSION 1
+
+enum TraceId
+{
+  TRACE_MQTT_CALLBACK = 0,
+  TRACE_MQTT_CONNECT,
+  TRACE_LOG_WRITE,
+  TRACE_HTTP_REQUEST,
+  TRACE_EEPROM_COMMIT,
+  TRACE_MAX
+};
+
+static const char *const traceIdNames[TRACE_MAX] = {
+    "mqtt_callback", "mqtt_connect", "log_write", "http_request", "eeprom_commit"};
+
+#ifdef VMX_TRACE
+
+#include "esp_ipc.h"
+#include "esp_timer.h"
+#include "xtensa/hal.h"
+
+#define TRACE_END_FLAG 0x80
+#define TRACE_CORE_FLAG 0x40
+#define TRACE_TASK_MASK 0x3F
+
+struct TraceEvent
+{
+  uint32_t cycles;
+  uint16_t cyclesHigh;
+  uint8_t id;
+  uint8_t info; // TRACE_END_FLAG | TRACE_CORE_FLAG (core 1) | task index
+};
+
+// Cycle count of one core next to esp_timer time, to put both cores on one timeline.
+struct TraceAnchor
+{
+  uint64_t cycles;
+  int64_t us;
+};
+
+class Tracer
+{
+public:
+  void record(uint8_t id, bool end)
+  {
+    portENTER_CRITICAL_SAFE(&mMux);
+    if (mPaused)
+    {
+      mDropped++;
+      portEXIT_CRITICAL_SAFE(&mMux);
+      return;
+    }
+    // Read inside the critical section, so events of one core are stored in cycle order.
+    uint64_t cycles = now(xPortGetCoreID());
+    TraceEvent &evt = mEvents[mHead++ & (TRACE_EVENTS - 1)];
+    evt.cycles = (uint32_t)cycles;
+    evt.cyclesHigh = (uint16_t)(cycles >> 32);
+    evt.id = id;
+    evt.info = (end ? TRACE_END_FLAG : 0) | (xPortGetCoreID() ? TRACE_CORE_FLAG : 0) | taskIndex();
+    portEXIT_CRITICAL_SAFE(&mMux);
+  }
+
+  // Writes the ring, oldest event first, after a header:
+  //   "VMXT", u16 version, u16 event size, u32 cpu Hz, u32 events, u32 dropped,
+  //   2 x (u64 cycles, i64 us) core anchors, u8 ids, ids x char[16] names,
+  //   u8 tasks, tasks x char[16] names, then the events.
+  // Recording is paused meanwhile; events in that time are counted as dropped.
+  void dump(Print &out)
+  {
+    AnchorCall calls[2] = {{this, {}}, {this, {}}};
+    TraceAnchor anchors[2] = {};
+    for (int core = 0; core < portNUM_PROCESSORS && core < 2; core++)
+    {
+      esp_ipc_call_blocking(core, readAnchor, &calls[core]);
+      anchors[core] = calls[core].anchor;
+    }
+    portENTER_CRITICAL(&mMux);
+    mPaused = true;
+    uint32_t head = mHead;
+    uint32_t dropped = mDropped;
+    uint8_t tasks = mTaskCount;
+    portEXIT_CRITICAL(&mMux);
+
+    uint32_t count = min(head, (uint32_t)TRACE_EVENTS);
+    uint16_t version = TRACE_VERSION;
+    uint16_t eventSize = sizeof(TraceEvent);
+    uint32_t cpuHz = getCpuFrequencyMhz() * 1000000;
+    out.write((const uint8_t *)TRACE_MAGIC, 4);
+    out.write((const uint8_t *)&version, sizeof(version));
+    out.write((const uint8_t *)&eventSize, sizeof(eventSize));
+    out.write((const uint8_t *)&cpuHz, sizeof(cpuHz));
+    out.write((const uint8_t *)&count, sizeof(count));
+    out.write((const uint8_t *)&dropped, sizeof(dropped));
+    out.write((const uint8_t *)anchors, sizeof(anchors));
+    out.write((uint8_t)TRACE_MAX);
+    for (int i = 0; i < TRACE_MAX; i++)
+    {
+      writeName(out, traceIdNames[i]);
+    }
+    out.write(tasks);
+    for (uint8_t i = 0; i < tasks; i++)
+    {
+      writeName(out, mTaskNames[i]);
+    }
+    for (uint32_t i = head - count; i != head; i++)
+    {
+      out.write((const uint8_t *)&mEvents[i & (TRACE_EVENTS - 1)], sizeof(TraceEvent));
+    }
+
+    portENTER_CRITICAL(&mMux);
+    mPaused = false;
+    portEXIT_CRITICAL(&mMux);
+  }
+
+private:
+  // Cycle count of this core, with the wraps seen so far. Called with mMux held.
+  uint64_t now(int core)
+  {
+    uint32_t cycles = xthal_get_ccount();
+    if (cycles < mLastCycles[core])
+    {
+      mWraps[core]++;
+    }
+    mLastCycles[core] = cycles;
+    return ((uint64_t)mWraps[core] << 32) | cycles;
+  }
+
+  // Index of the running task in mTaskNames, added on its first event. Called with mMux held.
+  uint8_t taskIndex()
+  {
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    for (uint8_t i = 0; i < mTaskCount; i++)
+    {
+      if (mTasks[i] == task)
+      {
+        return i;
+      }
+    }
+    if (mTaskCount >= TRACE_MAX_TASKS)
+    {
+      return TRACE_MAX_TASKS - 1; // shares the last slot
+    }
+    mTasks[mTaskCount] = task;
+    strlcpy(mTaskNames[mTaskCount], pcTaskGetName(task), TRACE_TASK_NAME_SIZE);
+    return mTaskCount++;
+  }
+
+  struct AnchorCall
+  {
+    Tracer *self;
+    TraceAnchor anchor;
+  };
+
+  // Runs on the core being anchored, from esp_ipc.
+  static void readAnchor(void *arg)
+  {
+    AnchorCall *call = (AnchorCall *)arg;
+    portENTER_CRITICAL(&call->self->mMux);
+    call->anchor.cycles = call->self->now(xPortGetCoreID());
+    call->anchor.us = esp_timer_get_time();
+    portEXIT_CRITICAL(&call->self->mMux);
+  }
+
+  static void writeName(Print &out, const char *name)
+  {
+    char buf[TRACE_TASK_NAME_SIZE] = {};
+    strlcpy(buf, name, sizeof(buf));
+    out.write((const uint8_t *)buf, sizeof(buf));
+  }
+
+  portMUX_TYPE mMux = portMUX_INITIALIZER_UNLOCKED;
+  TraceEvent mEvents[TRACE_EVENTS] = {};
+  uint32_t mHead = 0;
+  uint32_t mDropped = 0;
+  bool mPaused = false;
+  uint32_t mLastCycles[2] = {};
+  uint32_t mWraps[2] = {};
+  TaskHandle_t mTasks[TRACE_MAX_TASKS] = {};
+  char mTaskNames[TRACE_MAX_TASKS][TRACE_TASK_NAME_SIZE] = {};
+  uint8_t mTaskCount = 0;
+};
+
+Tracer mTracer;
+
+// Records begin on construction and end on destruction.
+struct TraceScope
+{
+  explicit TraceScope(uint8_t id) : mId(id) { mTracer.record(id, false); }
+  ~TraceScope() { mTracer.record(mId, true); }
+  uint8_t mId;
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(id) TraceScope TRACE_CONCAT(traceScope, __LINE__)(id)
+
+#else
+
+#define TRACE_SCOPE(id)
+
+#endif // VMX_TRACE
+
+#endif // __VMXTRACE_H__
@@ -16,7 +16,9 @@
  *
  * Reset button (pin 14 - IO0)
  *    Press and hold this button continuously for 5 seconds to clear SSID/password, ControlBox's IP address, ...
+ *    A short press publishes the relay status.
  * Relay control pin (pin 3 - IO22) or (pin 2 - IO 23)
+ * Aux input (IO27), pulled up; it and the reset button trigger the local rules in VMXRules.h
  *
  * 1, 6, 7, 8, 9, 11: crash system
  * 24, 28, 29, 30, 31: invalid pin selected
@@ -56,31 +58,65 @@
 #include "esp32-hal-log.h"
 #include "esp_wps.h"
 #include "esp_event.h"
+#include "lwip/sockets.h"
 
 #include "VMXExt.h"
+#include "VMXBoot.h"
+#include "VMXScan.h"
+#include "VMXArena.h"
+#include "VMXJsonPool.h"
+#include "VMXProfile.h"
+#include "VMXQueue.h"
+#include "VMXGroup.h"
+#include "VMXSession.h"
+#include "VMXTls.h"
+#include "VMXCodec.h"
+#include "VMXSchedule.h"
+#include "VMXPulse.h"
+#include "VMXRules.h"
+#include "VMXTimers.h"
+#include "VMXStatusLED.h"
+#include "VMXButton.h"
+#include "VMXHeartbeat.h"
+#include "VMXBrokers.h"
+#include "VMXTrace.h"
+#include "VMXHeap.h"
 
 #define WRMFWVER 2
 
 #define RESET_BTN_PIN 0
 #define STATUS_LED_PIN 2  // for nodemcu 32S - GCS not work
 #define RELAY_CTRL_PIN 22 // or 23
+#define AUX_INPUT_PIN 27  // dry contact to GND, e.g. a door release button; drives local rules
 
 /*
  * Header: VMXWRM - 6 bytes
  * SSID: 32 bytes
  * Password: 64 bytes
  * CTRLBOX IP address: 16 bytes
+ * MQTT topic mode: 1 byte
+ * Groups: 64 bytes, comma separated
+ * MQTT flags: 1 byte (MQTTFLAG_*)
+ * Fallback brokers: 64 bytes, comma separated
  */
 #define EEPROM_HEADER_SIZE 6
 #define EEPROM_SSID_SIZE 32
 #define EEPROM_PASSWORD_SIZE 64
 #define EEPROM_CTRLBOX_IP_SIZE 16
-#define EEPROM_INFO_SIZE EEPROM_HEADER_SIZE + EEPROM_SSID_SIZE + EEPROM_PASSWORD_SIZE + EEPROM_CTRLBOX_IP_SIZE + 4
+#define EEPROM_TOPIC_MODE_SIZE 1
+#define EEPROM_GROUPS_SIZE GROUP_LIST_SIZE
+#define EEPROM_MQTT_FLAGS_SIZE 1
+#define EEPROM_BROKERS_SIZE BROKER_LIST_SIZE
+#define EEPROM_INFO_SIZE EEPROM_HEADER_SIZE + EEPROM_SSID_SIZE + EEPROM_PASSWORD_SIZE + EEPROM_CTRLBOX_IP_SIZE + EEPROM_TOPIC_MODE_SIZE + EEPROM_GROUPS_SIZE + EEPROM_MQTT_FLAGS_SIZE + EEPROM_BROKERS_SIZE + 8
 #define EEPROM_START_ADDR 0
 #define EEPROM_OFFSET_HEADER EEPROM_START_ADDR
 #define EEPROM_OFFSET_SSID EEPROM_OFFSET_HEADER + EEPROM_HEADER_SIZE + 1
 #define EEPROM_OFFSET_PASSWORD EEPROM_OFFSET_SSID + EEPROM_SSID_SIZE + 1
 #define EEPROM_OFFSET_CTRLBOX_IP EEPROM_OFFSET_PASSWORD + EEPROM_PASSWORD_SIZE + 1
+#define EEPROM_OFFSET_TOPIC_MODE EEPROM_OFFSET_CTRLBOX_IP + EEPROM_CTRLBOX_IP_SIZE + 1
+#define EEPROM_OFFSET_GROUPS EEPROM_OFFSET_TOPIC_MODE + EEPROM_TOPIC_MODE_SIZE + 1
+#define EEPROM_OFFSET_MQTT_FLAGS EEPROM_OFFSET_GROUPS + EEPROM_GROUPS_SIZE + 1
+#define EEPROM_OFFSET_BROKERS EEPROM_OFFSET_MQTT_FLAGS + EEPROM_MQTT_FLAGS_SIZE + 1
 
 #define WPS_MODE WPS_TYPE_PBC
 #define MAX_RETRY_ATTEMPTS 2
@@ -93,6 +129,30 @@
 #define WiFi_retries 250
 
 #define MQTT_BROKER_PORT 1883
+#define MQTT_BROKER_TLS_PORT 8883
+#define MQTT_KEEPALIVE_S 90
+#define MQTT_KEEPALIVE_FAILOVER_S 15 // with fallback brokers: notice a dead broker sooner
+#define MQTT_CONNECT_TIMEOUT_FAILOVER_S 3
+#define MQTTFLAG_TLS 0x01     // connect with TLS on MQTT_BROKER_TLS_PORT
+#define MQTTFLAG_MSGPACK 0x02 // also subscribe to the MessagePack command topics (VMXCodec.h)
+#define MQTTFLAG_TLS_INSECURE 0x04 // with MQTTFLAG_TLS and no CA uploaded: connect without verifying the broker
+// Persistent session: the broker keeps our subscriptions and queues QoS 1 commands while we are offline.
+#define MQTT_PERSISTENT_SESSION true
+#define MQTT_COMMAND_QOS (MQTT_PERSISTENT_SESSION ? 1 : 0)
+
+/*
+ * Tasks: Wi-Fi, lwIP and async_tcp already live on core 0, so MQTT/Wi-Fi handling
+ * runs next to them and the relay, status LED and reset button get core 1 alone.
+ */
+#define NETWORK_TASK_CORE 0
+#define NETWORK_TASK_STACK 8192
+#define NETWORK_TASK_PRIORITY 1
+#define ACTUATION_TASK_CORE 1
+#define ACTUATION_TASK_STACK 3072
+#define ACTUATION_TASK_PRIORITY 5
+#define MQTT_WATCH_TASK_STACK 2048
+#define MQTT_WATCH_POLL_MS 1000 // select() timeout, so a closed socket is let go of
+#define TIMERS_PER_TASK 8
 
 static esp_wps_config_t config = WPS_CONFIG_INIT_DEFAULT(WPS_MODE);
 static wifi_config_t wps_ap_creds[MAX_WPS_AP_CRED];
@@ -109,6 +169,18 @@ enum WRMSTATUS
   WRMSTATUS_MAX
 };
 
+// Which command topic the relay subscribes to. Anything else stored in EEPROM reads as legacy,
+// so relays added by a ControlBox that predates device topics keep working.
+enum MQTTTOPICMODE
+{
+  MQTTTOPICMODE_LEGACY = 0, // shared CtrlBox2relayTopic, filtered on deviceId
+  MQTTTOPICMODE_DEVICE,     // CtrlBox2relayTopic/<chip_id> only
+  MQTTTOPICMODE_BOTH,       // both, while a site migrates
+  MQTTTOPICMODE_MAX
+};
+
+static const char *const mqttTopicModeNames[MQTTTOPICMODE_MAX] = {"legacy", "device", "both"};
+
 enum RELAYSTATUS
 {
   RELAYSTATUS_OFF = 0,
@@ -116,20 +188,87 @@ enum RELAYSTATUS
   RELAYSTATUS_MAX
 };
 
-long lastDebounceTime_statusLED = 0;
-long debounceDelay_statusLED = 1000; // for 1 second
+// Network task -> actuation task
+enum RELAYCMD
+{
+  RELAYCMD_SET = 0, // switch and cancel any running pulse
+  RELAYCMD_PULSE,   // switch to state and run pulse from there
+  RELAYCMD_MAX
+};
+
+struct RelayCommand
+{
+  uint8_t type;
+  uint8_t state;
+  int64_t dueUs; // esp_timer time to switch at, 0 = now
+  PulsePlan pulse;
+};
+
+// Actuation task -> network task
+enum ACTEVENT
+{
+  ACTEVENT_AUTO_OFF = 0,  // last step of a pulse switched the relay off
+  ACTEVENT_PULSE_STEP,    // a pulse sequence switched the relay and goes on
+  ACTEVENT_RULE,          // a local rule switched the relay
+  ACTEVENT_FACTORY_RESET, // reset button held
+  ACTEVENT_STATUS_REPORT, // reset button pressed briefly
+  ACTEVENT_MAX
+};
+
+struct ActuationEvent
+{
+  uint8_t type;
+  uint8_t state;
+};
 
-long lastDebounceTime_resetBtn = 0;
-long debounceDelay_resetBtn = 5000; // for 5 seconds
-bool resetBtnReleased;
+// HTTP/MQTT handlers -> network task, which owns the device state and applies them in order.
+enum DEVCMD
+{
+  DEVCMD_RELAY = 0,      // state, sender; for a group command also arg = group, dueUs, ack
+  DEVCMD_RELAY_AUTO_OFF, // same as DEVCMD_RELAY, plus pulse
+  DEVCMD_REMOVE,         // sender
+  DEVCMD_SET_CTRLBOX,    // arg = ControlBox IP, arg2 = comma separated fallback brokers, state = MQTTTOPICMODE, flags = MQTTFLAG_*, sender
+  DEVCMD_CONNECT_WIFI,   // arg = SSID, arg2 = password
+  DEVCMD_SET_GROUPS,     // arg2 = comma separated group names, sender
+  DEVCMD_LOAD_SCHEDULE,  // data = new SCHEDULE_PATH or NULL, then re-read it
+  DEVCMD_LOAD_RULES,     // data = new RULES_PATH or NULL, then re-read it
+  DEVCMD_LOAD_HEAP,      // data = new HEAP_CONFIG_PATH or NULL, then re-read it
+  DEVCMD_LOAD_TLS_CA,    // data = new TLS_CA_PATH, "" removes it
+  DEVCMD_MAX
+};
 
-long lastDebounceTime_keepAlive = 0;
-long debounceDelay_keepAlive = 10000; // for 10 seconds
-long keepAliveTime = 0;
+struct DeviceCommand
+{
+  uint8_t type;
+  uint8_t state;
+  uint8_t ack;   // GROUPACK
+  uint8_t flags; // MQTTFLAG; MQTTFLAG_MSGPACK on a command: reply in MessagePack
+  int64_t dueUs;
+  PulsePlan pulse;
+  char sender[32];
+  char arg[EEPROM_SSID_SIZE + 1];
+  char arg2[EEPROM_PASSWORD_SIZE + 1];
+  char *data; // malloc'ed file contents, freed by the network task
+};
 
-long lastDebounceTime_Relay = 0;
-long debounceDelay_Relay = 10000; // for 10 seconds
-bool checkAutoRelay = false;
+#define RESET_BTN_HOLD_MS 5000     // hold to factory reset
+#define RELAY_PULSE_DEFAULT_MS 10000 // updateByAccessControl without a duration
+#define EVENT_RETRY_MS 10            // actuation event queue was full
+
+// Network task timers
+TimerService<TIMERS_PER_TASK> networkTimers;
+uint16_t timerWSCleanup;
+uint16_t timerWifiReconnect;
+uint16_t timerNoConnRestart;
+uint16_t timerDeferredInit;
+uint16_t timerSchedule;
+uint16_t timerHeartbeat;
+uint16_t timerBrokerFallback;
+uint16_t timerHeapWatchdog;
+
+// Actuation task timers
+TimerService<TIMERS_PER_TASK> actuationTimers;
+uint16_t timerEventRetry;
 
 char chip_id[40] = {};
 uint64_t chipid;
@@ -140,22 +279,82 @@ char eeprom_header[EEPROM_HEADER_SIZE] = {};
 char eeprom_ssid[EEPROM_SSID_SIZE] = {};
 char eeprom_password[EEPROM_PASSWORD_SIZE] = {};
 char eeprom_ctrlbox_ipaddr[EEPROM_CTRLBOX_IP_SIZE] = {};
-
-int WRMStatus;
-int RelayStatus;
+uint8_t eeprom_topic_mode = MQTTTOPICMODE_LEGACY;
+uint8_t eeprom_mqtt_flags = 0;
+
+volatile int WRMStatus;   // written by the network task
+volatile int RelayStatus; // written by the actuation task and relayPulse
+PulseSequencer relayPulse;
+StatusLED statusLED;
+ButtonWatcher resetBtn;
 bool mDNSDaemonExist = false;
 char jsonMessage[400] = {};
 
 WiFiClient client;
-PubSubClient mqtt_client(client);
+TlsClient tlsClient;
+MqttSessionTap mqttTransport(client);
+PubSubClient mqtt_client(mqttTransport);
+bool mqttSessionReset = false;     // subscriptions changed while offline: next connect starts a clean session
+bool mqttSubscribedThisBoot = false;
+bool mqttSessionResumed = false;
+unsigned long mqttConnectMs = 0;   // start of the last connect sequence until the relay was listening
+int mqttConnectTries = 0;          // attempts in the running connect sequence, 0 before its first
+unsigned long mqttConnectStartMs = 0;
+uint32_t mqttConnectCount = 0;
+uint16_t mqttKeepAliveS = MQTT_KEEPALIVE_S;
+bool mqttTransportTls = false;     // mqttTransport is on tlsClient rather than client
+uint32_t mqttCommandCount = 0;     // messages on the command and group topics
+HeartbeatPacer heartbeat;
+BrokerSelector brokers;
 
 char relay2CtrlBoxTopic[] = "VMXSys/Device2CtrlBox/relay";
 char CtrlBox2relayTopic[] = "VMXSys/CtrlBox2Device/relay";
+char CtrlBox2deviceTopic[sizeof(CtrlBox2relayTopic) + sizeof(chip_id)] = {}; // CtrlBox2relayTopic/<chip_id>
 char mqtt_info[200] = {};
 char reqSender[32] = {};
 
-unsigned long previousMillis = 0;
-const long interval = 30000; // 3 seconds
+SpscQueue<RelayCommand, 16> relayCommandQueue;
+SpscQueue<ActuationEvent, 8> actuationEventQueue;
+MpscQueue<DeviceCommand, 8> deviceCommandQueue;
+bool mqttServerChanged = false;
+TaskHandle_t networkTaskHandle = NULL;
+TaskHandle_t actuationTaskHandle = NULL;
+TaskHandle_t mqttWatchTaskHandle = NULL;
+
+void networkTask(void *arg);
+void actuationTask(void *arg);
+void mqttWatchTask(void *arg);
+
+// Network task: the actuation task switches the status LED pattern when it wakes.
+static void setWRMStatus(int status)
+{
+  WRMStatus = status;
+  if (actuationTaskHandle)
+  {
+    xTaskNotifyGive(actuationTaskHandle);
+  }
+}
+
+// GPIO interrupt or the end of its lockout, through mRules: debounced reset button edge.
+static void onResetBtnEdge(bool pressed)
+{
+  resetBtn.edge(pressed);
+}
+
+// esp_timer task: relayPulse switched the relay. The actuation task reports it.
+static void onRelayPulseEdge()
+{
+  if (actuationTaskHandle)
+  {
+    xTaskNotifyGive(actuationTaskHandle);
+  }
+}
+
+static bool commitEEPROM()
+{
+  TRACE_SCOPE(TRACE_EEPROM_COMMIT);
+  return EEPROM.commit();
+}
 
 static void processFormatWRMEEPROM()
 {
@@ -163,13 +362,35 @@ static void processFormatWRMEEPROM()
   memset(eeprom_ssid, 0, sizeof(eeprom_ssid));
   memset(eeprom_password, 0, sizeof(eeprom_password));
   memset(eeprom_ctrlbox_ipaddr, 0, sizeof(eeprom_ctrlbox_ipaddr));
+  eeprom_topic_mode = MQTTTOPICMODE_LEGACY;
+  memset(mGroups, 0, sizeof(mGroups));
+  groupsPublish();
+  eeprom_mqtt_flags = 0;
 
   sprintf(eeprom_info, "VMXWRM");
   EEPROM.writeString(EEPROM_START_ADDR, eeprom_info);
   EEPROM.writeString(EEPROM_OFFSET_SSID, eeprom_ssid);
   EEPROM.writeString(EEPROM_OFFSET_PASSWORD, eeprom_password);
   EEPROM.writeString(EEPROM_OFFSET_CTRLBOX_IP, eeprom_ctrlbox_ipaddr);
-  EEPROM.commit();
+  EEPROM.writeByte(EEPROM_OFFSET_TOPIC_MODE, eeprom_topic_mode);
+  EEPROM.writeString(EEPROM_OFFSET_GROUPS, mGroups);
+  EEPROM.writeByte(EEPROM_OFFSET_MQTT_FLAGS, eeprom_mqtt_flags);
+  memset(mBrokerFallbacks, 0, sizeof(mBrokerFallbacks));
+  EEPROM.writeString(EEPROM_OFFSET_BROKERS, mBrokerFallbacks);
+  commitEEPROM();
+  brokers.configure(eeprom_ctrlbox_ipaddr, mBrokerFallbacks);
+  // From setup() this runs before the deferred mount; the files must go all the same.
+  if (!filesystemMount())
+  {
+    ESP_LOGI(TAG, "FILESYSTEM not mounted, stored configuration not removed");
+  }
+  FILESYSTEM.remove(SCHEDULE_PATH);
+  mSchedule.count = 0;
+  FILESYSTEM.remove(RULES_PATH);
+  mRules.staging()->count = 0;
+  mRules.commit();
+  FILESYSTEM.remove(HEAP_CONFIG_PATH);
+  mHeapWatchdog.configure(heapWatchdogDefaults);
   delay(100);
   Serial.println("Format VMXWRM format done!");
 }
@@ -235,7 +456,7 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
         memcpy(eeprom_password, wps_ap_creds[0].sta.password, sizeof(wps_ap_creds[0].sta.password));
         EEPROM.writeString(EEPROM_OFFSET_SSID, eeprom_ssid);
         EEPROM.writeString(EEPROM_OFFSET_PASSWORD, eeprom_password);
-        EEPROM.commit();
+        commitEEPROM();
         delay(100);
       }
       /*
@@ -313,47 +534,42 @@ bool tryToConnectWifi()
   return mWifiConnected;
 }
 
-static void rebootEspWithReason(String reason)
+static void rebootEspWithReason(const char *reason)
 {
-  ESP_LOGI(TAG, "root with reason: %s", reason.c_str());
+  ESP_LOGI(TAG, "root with reason: %s", reason);
   ESP.restart();
 }
 
 void performUpdate(Stream &updateSource, size_t updateSize)
 {
-  String result = "";
+  HEAP_SCOPE(HEAPTAG_OTA);
+  char result[128];
+  int len = 0;
   if (Update.begin(updateSize))
   {
     size_t written = Update.writeStream(updateSource);
     if (written == updateSize)
     {
-      Serial.println("Written : " + String(written) + "/" + String(updateSize) + " [100%]");
+      Serial.printf("Written : %u/%u [100%%]\n", (unsigned)written, (unsigned)updateSize);
     }
     else
     {
-      Serial.println("Written only : " + String(written) + "/" + String(updateSize) + ". Retry?");
+      Serial.printf("Written only : %u/%u. Retry?\n", (unsigned)written, (unsigned)updateSize);
     }
-    result += "Written : " + String(written) + "/" + String(updateSize) + " [" + String((written / updateSize) * 100) + "%] \n";
+    len += snprintf(result + len, sizeof(result) - len, "Written : %u/%u [%u%%] \n",
+                    (unsigned)written, (unsigned)updateSize, (unsigned)(written * 100 / updateSize));
     if (Update.end())
     {
-      result += "OTA Done: ";
-      if (Update.isFinished())
-      {
-        result += "Success!\n";
-      }
-      else
-      {
-        result += "Failed!\n";
-      }
+      snprintf(result + len, sizeof(result) - len, "OTA Done: %s\n", Update.isFinished() ? "Success!" : "Failed!");
     }
     else
     {
-      result += "Error #: " + String(Update.getError());
+      snprintf(result + len, sizeof(result) - len, "Error #: %u", (unsigned)Update.getError());
     }
   }
   else
   {
-    result += "Not enough space for OTA";
+    snprintf(result, sizeof(result), "Not enough space for OTA");
   }
   // http send 'result'
 }
@@ -368,7 +584,14 @@ bool checkFirmware()
   String payload = http.getString();
   if (httpCode == 200)
   {
-    StaticJsonDocument<200> jsonBuffer;
+    SmallJsonDoc pooled;
+    if (!pooled)
+    {
+      Serial.println("JSON pool exhausted");
+      http.end();
+      return false;
+    }
+    JsonDocument &jsonBuffer = *pooled;
     DeserializationError error = deserializeJson(jsonBuffer, payload);
     if (error)
     {
@@ -472,6 +695,7 @@ bool downloadFirmware(fs::FS &fs, String fwUrl)
 // check for new firmware version and download if available
 void do_firmware_upgrade(fs::FS &fs)
 {
+  HEAP_SCOPE(HEAPTAG_OTA);
   if (checkFirmware())
   {
     if (fs.exists("/firmware.bin"))
@@ -494,6 +718,8 @@ void do_firmware_upgrade(fs::FS &fs)
 
 int myVprintf(const char *format, va_list args)
 {
+  TRACE_SCOPE(TRACE_LOG_WRITE);
+  HEAP_SCOPE(HEAPTAG_LOG);
   static char buffer[128];
   int len = vsnprintf(buffer, sizeof(buffer), format, args);
   if (len > 0)
@@ -525,8 +751,8 @@ int myVprintf(const char *format, va_list args)
         }
       }
       char record[128];
-      char timeStr[20];
-      getDateTimeString(timeStr, 20);
+      char timeStr[DATETIME_STRING_SIZE];
+      getDateTimeString(timeStr, sizeof(timeStr));
       sprintf(record, "[%s] %s", timeStr, buffer);
       logFile.println(record);
       logFile.flush();
@@ -540,28 +766,30 @@ int myVprintf(const char *format, va_list args)
   return len;
 }
 
-void setup()
+static void startSoftAP()
 {
-  // put your setup code here, to run once:
-  Serial.begin(115200);
-  delay(100); // delay for Serial's initialization.
-
-  chipid = ESP.getEfuseMac(); // The chip ID is essentially its MAC address(length: 6 bytes).
-  offset += sprintf(chip_id + offset, "%04X", (uint16_t)(chipid >> 32));
-  offset += sprintf(chip_id + offset, "%08X", (uint32_t)chipid);
-
-  pinMode(STATUS_LED_PIN, OUTPUT);
-  pinMode(RESET_BTN_PIN, INPUT_PULLUP);
-  pinMode(RELAY_CTRL_PIN, OUTPUT);
+  mWifiMode = AP_MODE;
+  WiFi.mode(WIFI_AP);
+  uint8_t macAddr[6];
+  WiFi.softAPmacAddress(macAddr);
+  String ssid_ap = "ESP32-" + String(macAddr[4], HEX) + String(macAddr[5], HEX);
+  ssid_ap.toUpperCase();
+  WiFi.softAP(ssid_ap.c_str());
+  ESP_LOGI(TAG, "Web server access address: %s", WiFi.softAPIP().toString());
+}
 
-  digitalWrite(STATUS_LED_PIN, LOW);
-  digitalWrite(RELAY_CTRL_PIN, LOW);
-  lastDebounceTime_statusLED = lastDebounceTime_resetBtn = millis();
-  resetBtnReleased = true;
+// Services that are not needed to control the relay: log file, mDNS and web server.
+// They are started after the first MQTT connect, or straight away when there is no
+// ControlBox to connect to (AP mode, no ControlBox IP) or BOOT_DEFER_TIMEOUT expires.
+void startDeferredServices()
+{
+  if (mDeferredInitDone)
+  {
+    return;
+  }
+  mDeferredInitDone = true;
 
-  WRMStatus = WRMSTATUS_INIT;
-  RelayStatus = RELAYSTATUS_OFF;
-  if (FILESYSTEM.begin(true))
+  if (filesystemMount())
   {
     Serial.println("LittleFS mounted successfully");
     esp_log_level_set("*", ESP_LOG_VERBOSE);
@@ -577,12 +805,76 @@ void setup()
     }
     esp_log_level_set(TAG, ESP_LOG_INFO);
     // esp_log_set_vprintf(myVprintf);
+    heapWatchdogLoad();
   }
   else
   {
     ESP_LOGI(TAG, "An Error has occurred while mounting FILESYSTEM");
     rebootEspWithReason("Rebooting due to FILESYSTEM initialisation failure");
   }
+  bootProfileMark(BOOT_PHASE_FILESYSTEM);
+
+  if ((mWifiMode == STAT_MODE) && mWifiConnected && !mDNSDaemonExist)
+  {
+    char mdns_name[48] = {};
+    sprintf(mdns_name, "VMXWRM_%s", chip_id);
+    ESP_LOGI(TAG, "mdns_name: %s", mdns_name);
+    if (MDNS.begin(mdns_name))
+    {
+      // Add service to MDNS-SD
+      MDNS.addService("_vnx_relay", "tcp", REST_SERVER_PORT);
+      ESP_LOGI(TAG, "You can now connect to http://%s.local", mdns_name);
+      mDNSDaemonExist = true;
+      bootProfileMark(BOOT_PHASE_MDNS);
+    }
+    else
+    {
+      ESP_LOGI(TAG, "Error setting up MDNS responder!");
+    }
+  }
+
+  // setup event handler
+  ws.onEvent(onEvent);
+  server.addHandler(&ws);
+  // Start web server
+  runHttpServer();
+  bootProfileMark(BOOT_PHASE_HTTP);
+}
+
+void setup()
+{
+  bootProfileBegin();
+
+  // put your setup code here, to run once:
+  Serial.begin(115200);
+  delay(100); // delay for Serial's initialization.
+
+  chipid = ESP.getEfuseMac(); // The chip ID is essentially its MAC address(length: 6 bytes).
+  offset += sprintf(chip_id + offset, "%04X", (uint16_t)(chipid >> 32));
+  offset += sprintf(chip_id + offset, "%08X", (uint32_t)chipid);
+  snprintf(CtrlBox2deviceTopic, sizeof(CtrlBox2deviceTopic), "%s/%s", CtrlBox2relayTopic, chip_id);
+
+  statusLED.begin(STATUS_LED_PIN);
+  pinMode(RESET_BTN_PIN, INPUT_PULLUP);
+  pinMode(RELAY_CTRL_PIN, OUTPUT);
+
+  digitalWrite(RELAY_CTRL_PIN, LOW);
+  relayPulse.begin(RELAY_CTRL_PIN, &RelayStatus, onRelayPulseEdge);
+  resetBtn.begin(RESET_BTN_PIN, RESET_BTN_HOLD_MS, &actuationTaskHandle);
+  mRules.onEdge(RULEINPUT_BUTTON, onResetBtnEdge);
+  mRules.begin(RESET_BTN_PIN, AUX_INPUT_PIN, &relayPulse, &RelayStatus, &actuationTaskHandle);
+  // Local rules and the schedule work without the ControlBox, so they do not wait for the
+  // deferred services; startDeferredServices() reboots if the mount failed.
+  if (filesystemMount())
+  {
+    rulesLoad();
+    scheduleLoad();
+  }
+
+  WRMStatus = WRMSTATUS_INIT;
+  RelayStatus = RELAYSTATUS_OFF;
+  scanCacheBegin();
+
   ESP_LOGI(TAG, "ESP32 Chip ID: %s", chip_id);
   ESP_LOGI(TAG, "WiFi Relay Module Firmware Version: %d", WRMFWVER);
   if (!EEPROM.begin(EEPROM_INFO_SIZE))
@@ -602,146 +894,200 @@ void setup()
     processFormatWRMEEPROM();
   }
 
-  // Read EEPROM for SSID and password.
+  // Read EEPROM for SSID, password and ControlBox's IP address.
   EEPROM.readString(EEPROM_OFFSET_SSID, eeprom_ssid, EEPROM_SSID_SIZE);
   EEPROM.readString(EEPROM_OFFSET_PASSWORD, eeprom_password, EEPROM_PASSWORD_SIZE);
+  EEPROM.readString(EEPROM_OFFSET_CTRLBOX_IP, eeprom_ctrlbox_ipaddr, EEPROM_CTRLBOX_IP_SIZE);
+  eeprom_topic_mode = EEPROM.readByte(EEPROM_OFFSET_TOPIC_MODE);
+  if (eeprom_topic_mode >= MQTTTOPICMODE_MAX)
+  {
+    eeprom_topic_mode = MQTTTOPICMODE_LEGACY;
+  }
+  EEPROM.readString(EEPROM_OFFSET_GROUPS, mGroups, EEPROM_GROUPS_SIZE);
+  if (mGroups[0] == (char)0xFF)
+  {
+    mGroups[0] = '\0'; // never written
+  }
+  groupsPublish();
+  eeprom_mqtt_flags = EEPROM.readByte(EEPROM_OFFSET_MQTT_FLAGS);
+  if (eeprom_mqtt_flags == 0xFF)
+  {
+    eeprom_mqtt_flags = 0; // never written
+  }
+  EEPROM.readString(EEPROM_OFFSET_BROKERS, mBrokerFallbacks, EEPROM_BROKERS_SIZE);
+  if (mBrokerFallbacks[0] == (char)0xFF)
+  {
+    mBrokerFallbacks[0] = '\0'; // never written
+  }
+  brokers.configure(eeprom_ctrlbox_ipaddr, mBrokerFallbacks);
+  bootProfileMark(BOOT_PHASE_EEPROM);
 
   // Check SSID and password
   WRMStatus = WRMSTATUS_JOIN_AP;
   if (!strlen(eeprom_ssid) || !strlen(eeprom_password))
   {
     ESP_LOGI(TAG, "There is no wifi configuration in EEPROM memory - ESP32 wifi network created!");
-
-    mWifiMode = AP_MODE;
-    WiFi.mode(WIFI_AP);
-    uint8_t macAddr[6];
-    WiFi.softAPmacAddress(macAddr);
-    String ssid_ap = "ESP32-" + String(macAddr[4], HEX) + String(macAddr[5], HEX);
-    ssid_ap.toUpperCase();
-    WiFi.softAP(ssid_ap.c_str());
-
-    ESP_LOGI(TAG, "Web server access address: %s", WiFi.softAPIP().toString());
+    startSoftAP();
   }
-  else
+  else if (tryToConnectWifi() == true)
   {
-    if (tryToConnectWifi() == true)
-    {
-      configTime(0, 0, "pool.ntp.org", "time.nist.gov"); // UTC
-      // do_firmware_upgrade(FILESYSTEM);
-      mLastConnTime = millis();
-      if (!mDNSDaemonExist)
-      {
-        char mdns_name[48] = {};
-        sprintf(mdns_name, "VMXWRM_%s", chip_id);
-        ESP_LOGI(TAG, "mdns_name: %s", mdns_name);
-        if (!MDNS.begin(mdns_name))
-        {
-          ESP_LOGI(TAG, "Error setting up MDNS responder!");
-          while (1)
-          {
-            delay(1000);
-          }
-        }
-        // Add service to MDNS-SD
-        MDNS.addService("_vnx_relay", "tcp", REST_SERVER_PORT);
-        ESP_LOGI(TAG, "You can now connect to http://%s.local", mdns_name);
-        mDNSDaemonExist = true;
-      }
-    }
-    else
-    {
-      ESP_LOGI(TAG, "Cannot connect to SSID: %s. Switch to Soft AP mode", eeprom_ssid);
-      mWifiMode = AP_MODE;
-      WiFi.mode(WIFI_AP);
-      uint8_t macAddr[6];
-      WiFi.softAPmacAddress(macAddr);
-      String ssid_ap = "ESP32-" + String(macAddr[4], HEX) + String(macAddr[5], HEX);
-      ssid_ap.toUpperCase();
-      WiFi.softAP(ssid_ap.c_str());
-      ESP_LOGI(TAG, "Web server access address: ", WiFi.softAPIP().toString());
-    }
+    setClock();
+    // do_firmware_upgrade(FILESYSTEM);
   }
-  // setup event handler
-  ws.onEvent(onEvent);
-  server.addHandler(&ws);
-  // Start web server
-  runHttpServer();
-}
-
-void processStatusLEDwithTimer(int high, int low)
-{ // units in seconds
-  static int flipflop = 0;
-
-  if (flipflop)
+  else
   {
-    // handle LED high level
-    if ((millis() - lastDebounceTime_statusLED) > debounceDelay_statusLED * high)
-    {
-      lastDebounceTime_statusLED = millis();
-      flipflop = 0;
-      digitalWrite(STATUS_LED_PIN, LOW);
-    }
+    ESP_LOGI(TAG, "Cannot connect to SSID: %s. Switch to Soft AP mode", eeprom_ssid);
+    startSoftAP();
   }
-  else
+  bootProfileMark(BOOT_PHASE_WIFI);
+
+  // Without a ControlBox to connect to, the web server is the only way in: start it now.
+  // Otherwise loop() connects to MQTT first and the rest is started afterwards.
+  if ((mWifiMode == AP_MODE) || !strlen(eeprom_ctrlbox_ipaddr))
   {
-    // handle LED low level
-    if ((millis() - lastDebounceTime_statusLED) > debounceDelay_statusLED * low)
-    {
-      lastDebounceTime_statusLED = millis();
-      flipflop = 1;
-      digitalWrite(STATUS_LED_PIN, HIGH);
-    }
+    startDeferredServices();
   }
+
+  xTaskCreatePinnedToCore(actuationTask, "actuation", ACTUATION_TASK_STACK, NULL,
+                          ACTUATION_TASK_PRIORITY, &actuationTaskHandle, ACTUATION_TASK_CORE);
+  xTaskCreatePinnedToCore(mqttWatchTask, "mqtt_watch", MQTT_WATCH_TASK_STACK, NULL,
+                          NETWORK_TASK_PRIORITY, &mqttWatchTaskHandle, NETWORK_TASK_CORE);
+  xTaskCreatePinnedToCore(networkTask, "network", NETWORK_TASK_STACK, NULL,
+                          NETWORK_TASK_PRIORITY, &networkTaskHandle, NETWORK_TASK_CORE);
 }
 
+int mStatusLEDShown = -1; // WRMStatus the LED pattern was last set up for
+
+// Run by the actuation task when WRMStatus changes; LEDC blinks on its own from there.
 void processStatusLED()
 {
+  mStatusLEDShown = WRMStatus;
   switch (WRMStatus)
   {
   case WRMSTATUS_INIT:
-    // Always low
-    digitalWrite(STATUS_LED_PIN, LOW);
+    statusLED.show(0, 1); // Always low
     break;
   case WRMSTATUS_JOIN_AP:
-    processStatusLEDwithTimer(1, 3); // high 1 second, low 3 seconds
+    statusLED.show(1000, 3000); // high 1 second, low 3 seconds
     break;
   case WRMSTATUS_PAIRING:
-    processStatusLEDwithTimer(1, 1); // high 1 second, low 1 second
+    statusLED.show(1000, 1000); // high 1 second, low 1 second
     break;
   case WRMSTATUS_CONNECT_CTRLBOX:
-    processStatusLEDwithTimer(3, 1); // high 3 seconds, low 1 second
+    statusLED.show(3000, 1000); // high 3 seconds, low 1 second
     break;
   case WRMSTATUS_NORMAL:
-    // Always high
-    digitalWrite(STATUS_LED_PIN, HIGH);
+    statusLED.show(1, 0); // Always high
     break;
   default:
     break;
   }
 }
 
+bool pushActuationEvent(const ActuationEvent &evt);
+
+uint32_t mSeenShortPresses = 0;
+uint32_t mSeenLongPresses = 0;
+
+// Queues the reset button presses counted by resetBtn: a short press reports the status,
+// a long press asks for a factory reset.
 void processResetBtn()
 {
-  if (!digitalRead(RESET_BTN_PIN))
+  uint32_t shortPresses = resetBtn.shortPresses();
+  uint32_t longPresses = resetBtn.longPresses();
+  if (shortPresses != mSeenShortPresses)
   {
-    if (((millis() - lastDebounceTime_resetBtn) > debounceDelay_resetBtn) && resetBtnReleased)
+    ActuationEvent evt = {ACTEVENT_STATUS_REPORT, (uint8_t)RelayStatus};
+    if (!pushActuationEvent(evt))
     {
-      lastDebounceTime_resetBtn = millis();
-      resetBtnReleased = false;
-
-      processFormatWRMEEPROM();
-      delay(1000);
-      rebootEspWithReason("Rebooting due to reset button pressed");
+      actuationTimers.start(timerEventRetry, EVENT_RETRY_MS);
+      return;
     }
+    mSeenShortPresses = shortPresses;
   }
-  else
+  if (longPresses != mSeenLongPresses)
   {
-    lastDebounceTime_resetBtn = millis();
-    resetBtnReleased = true;
+    // EEPROM belongs to the network task
+    ActuationEvent evt = {ACTEVENT_FACTORY_RESET, 0};
+    if (!pushActuationEvent(evt))
+    {
+      actuationTimers.start(timerEventRetry, EVENT_RETRY_MS);
+      return;
+    }
+    mSeenLongPresses = longPresses;
   }
 }
 
 bool connectToMQTTBroker();
+void processDeviceCommands();
+void processSchedule();
+void sendJson(AsyncWebServerRequest *req, const JsonDocument &doc);
+
+// Safe from any task; the network task picks the command up on its next pass.
+bool postDeviceCommand(const DeviceCommand &cmd)
+{
+  if (!deviceCommandQueue.push(cmd))
+  {
+    ESP_LOGI(TAG, "Device command queue full, command %d dropped", cmd.type);
+    return false;
+  }
+  if (networkTaskHandle)
+  {
+    xTaskNotifyGive(networkTaskHandle);
+  }
+  return true;
+}
+
+// Posts cmd with a copy of body in cmd.data, for the network task to store: LittleFS is not
+// written from the async_tcp task. Nothing stays allocated when it fails.
+bool postDeviceCommandData(DeviceCommand &cmd, const String &body)
+{
+  cmd.data = strdup(body.c_str());
+  if (!cmd.data)
+  {
+    return false;
+  }
+  if (!postDeviceCommand(cmd))
+  {
+    free(cmd.data);
+    cmd.data = nullptr;
+    return false;
+  }
+  return true;
+}
+
+// Called from the actuation task only (single producer). Wakes the network task, which
+// sleeps until its next timer when there is nothing to poll.
+bool pushActuationEvent(const ActuationEvent &evt)
+{
+  if (!actuationEventQueue.push(evt))
+  {
+    return false;
+  }
+  if (networkTaskHandle)
+  {
+    xTaskNotifyGive(networkTaskHandle);
+  }
+  return true;
+}
+
+void heartbeatChanged();
+
+// Called from the network task only (single producer).
+bool sendRelayCommand(const RelayCommand &cmd)
+{
+  if (!relayCommandQueue.push(cmd))
+  {
+    ESP_LOGI(TAG, "Relay command queue full");
+    return false;
+  }
+  heartbeatChanged();
+  if (actuationTaskHandle)
+  {
+    xTaskNotifyGive(actuationTaskHandle);
+  }
+  return true;
+}
 
 void handleSetupPost(AsyncWebServerRequest *req)
 {
@@ -752,9 +1098,16 @@ void handleSetupPost(AsyncWebServerRequest *req)
     return;
   }
 
-  String body = req->arg("plain");
+  RequestScope scope;
+  const String &body = req->arg("plain");
   Serial.println(body);
-  StaticJsonDocument<200> jsonBuffer, jsonBufferRes;
+  SmallJsonDoc pooledReq, pooledRes;
+  if (!pooledReq || !pooledRes)
+  {
+    ESP_LOGI(TAG, "JSON pool exhausted, request dropped");
+    return;
+  }
+  JsonDocument &jsonBuffer = *pooledReq, &jsonBufferRes = *pooledRes;
   DeserializationError error = deserializeJson(jsonBuffer, body.c_str());
   if (error)
   {
@@ -770,137 +1123,120 @@ void handleSetupPost(AsyncWebServerRequest *req)
     return;
   }
 
-  memcpy(eeprom_ctrlbox_ipaddr, ctrlBoxIP, sizeof(eeprom_ctrlbox_ipaddr));
-  memcpy(reqSender, sender, sizeof(reqSender));
+  // A ControlBox that does not know about device topics keeps the relay on the shared topic.
+  const char *topicMode = jsonBuffer["topicMode"] | mqttTopicModeNames[MQTTTOPICMODE_LEGACY];
+  int mode = 0;
+  while (mode < MQTTTOPICMODE_MAX && strcmp(topicMode, mqttTopicModeNames[mode]) != 0)
+  {
+    mode++;
+  }
+  if (mode == MQTTTOPICMODE_MAX)
+  {
+    ESP_LOGI(TAG, "Unknown topicMode %s", topicMode);
+    req->send(400, "text/plain", "Invalid topicMode");
+    return;
+  }
+
+  // Optional "fallbacks": ["ip", ...], tried in this order when ctrlBoxIP is unreachable.
+  char fallbacks[BROKER_LIST_SIZE] = {};
+  JsonArrayConst fallbackList = jsonBuffer["fallbacks"];
+  if (!brokerListFromJson(fallbackList, fallbacks, sizeof(fallbacks)))
+  {
+    ESP_LOGI(TAG, "Invalid fallbacks");
+    req->send(400, "text/plain", "Invalid fallbacks");
+    return;
+  }
 
-  EEPROM.writeString(EEPROM_OFFSET_CTRLBOX_IP, eeprom_ctrlbox_ipaddr);
-  EEPROM.commit();
-  delay(100);
+  DeviceCommand cmd = {};
+  cmd.type = DEVCMD_SET_CTRLBOX;
+  cmd.state = mode;
+  cmd.flags = ((jsonBuffer["tls"] | false) ? MQTTFLAG_TLS : 0) | ((jsonBuffer["msgpack"] | false) ? MQTTFLAG_MSGPACK : 0) |
+              ((jsonBuffer["tls_insecure"] | false) ? MQTTFLAG_TLS_INSECURE : 0);
+  strlcpy(cmd.arg, ctrlBoxIP, EEPROM_CTRLBOX_IP_SIZE);
+  strlcpy(cmd.arg2, fallbacks, sizeof(cmd.arg2));
+  strlcpy(cmd.sender, sender, sizeof(cmd.sender));
+  if (!postDeviceCommand(cmd))
+  {
+    req->send(503, "text/plain", "Server busy");
+    return;
+  }
 
-  ESP_LOGI(TAG, "ctrlBoxIP: %s with sender: %s", ctrlBoxIP, sender);
+  ESP_LOGI(TAG, "ctrlBoxIP: %s with sender: %s, topic mode %s%s%s%s, fallbacks [%s]", ctrlBoxIP, sender, topicMode,
+           (cmd.flags & MQTTFLAG_TLS) ? ", TLS" : "", (cmd.flags & MQTTFLAG_TLS_INSECURE) ? " (insecure allowed)" : "",
+           (cmd.flags & MQTTFLAG_MSGPACK) ? ", MessagePack" : "", fallbacks);
 
   // Respond to the client
   jsonBufferRes["setup"] = "Commpleted";
   jsonBufferRes["sender"] = jsonBuffer["sender"];
-  serializeJson(jsonBufferRes, jsonMessage);
   serializeJson(jsonBufferRes, Serial);
-  req->send(200, "application/json", jsonMessage);
+  sendJson(req, jsonBufferRes);
+}
 
-  if (!mqtt_client.connected())
+// Compact reply to a MessagePack command, see VMXCodec.h.
+void publishControlReplyMsgPack(const char *action, const char *command, const char *deviceId, const char *sender,
+                                int result, int state, const char *group)
+{
+  SmallJsonDoc pooledRes;
+  if (!pooledRes)
   {
-    connectToMQTTBroker();
+    return;
   }
-  else
+  JsonDocument &jsonBufferRes = *pooledRes;
+  int code = codecCode(codecActionNames, action);
+  if (code >= 0)
   {
-    mqtt_client.disconnect();
-    delay(100);
-    connectToMQTTBroker();
+    jsonBufferRes["a"] = code;
+  }
+  code = codecCode(codecCommandNames, command);
+  if (code >= 0)
+  {
+    jsonBufferRes["c"] = code;
+  }
+  jsonBufferRes["d"] = deviceId;
+  jsonBufferRes["s"] = sender;
+  if (state >= 0)
+  {
+    jsonBufferRes["v"] = state;
+  }
+  if (group)
+  {
+    jsonBufferRes["g"] = group;
   }
+  jsonBufferRes["r"] = (result >= -3 && result <= 1) ? result : -1;
+
+  char topic[sizeof(relay2CtrlBoxTopic) + sizeof(MSGPACK_TOPIC_SUFFIX)];
+  snprintf(topic, sizeof(topic), "%s" MSGPACK_TOPIC_SUFFIX, relay2CtrlBoxTopic);
+  size_t len = serializeMsgPack(jsonBufferRes, jsonMessage, sizeof(jsonMessage));
+  serializeJson(jsonBufferRes, Serial);
+  mqtt_client.publish(topic, (const uint8_t *)jsonMessage, len);
 }
 
-void mqttBrokerCallback(char *topic, byte *payload, unsigned int length)
+void publishControlReply(const char *action, const char *command, const char *deviceId, const char *sender, int result, int state,
+                         const char *group = nullptr, bool msgpack = false)
 {
-  int result = -1;
-
-  memset(mqtt_info, 0, sizeof(mqtt_info));
-  for (int i = 0; i < length; i++)
+  if (msgpack)
   {
-    Serial.print((char)payload[i]);
-    mqtt_info[i] = (char)payload[i];
+    publishControlReplyMsgPack(action, command, deviceId, sender, result, state, group);
+    return;
   }
-
-  StaticJsonDocument<200> jsonBuffer, jsonBufferRes;
-  DeserializationError error = deserializeJson(jsonBuffer, mqtt_info);
-  if (error)
+  SmallJsonDoc pooledRes;
+  if (!pooledRes)
   {
-    Serial.print(F("deserializeJson() failed: "));
-    Serial.println(error.f_str());
     return;
   }
-
-  const char *action = jsonBuffer["action"];
-  const char *deviceId = jsonBuffer["deviceId"];
-  const char *command = jsonBuffer["command"];
-
-  const char *sender = jsonBuffer["sender"];
-  memcpy(reqSender, sender, sizeof(reqSender));
-
-  if (strcmp(topic, CtrlBox2relayTopic) == 0)
+  JsonDocument &jsonBufferRes = *pooledRes;
+  if (state >= 0)
   {
-    Serial.print("action: ");
-    Serial.println(action);
-    Serial.print("deviceId: ");
-    Serial.println(deviceId);
-
-    if (!deviceId || (strcmp(deviceId, chip_id) != 0))
-    {
-      Serial.println("Device ID invalided");
-      result = -2;
-      goto mqttBrokerCallback_handle_error;
-    }
-
-    if (action && (strcmp(action, "control") == 0))
-    {
-      if (command && ((strcmp(command, "update") == 0) || (strcmp(command, "updateByAccessControl") == 0)))
-      {
-        int state = jsonBuffer["state"];
-
-        if (state == 1)
-        {
-          digitalWrite(RELAY_CTRL_PIN, HIGH);
-          RelayStatus = RELAYSTATUS_ON;
-          result = 0;
-        }
-        else
-        {
-          digitalWrite(RELAY_CTRL_PIN, LOW);
-          RelayStatus = RELAYSTATUS_OFF;
-          result = 0;
-        }
-        jsonBufferRes["state"] = RelayStatus;
-        checkAutoRelay = false;
-
-        if (strcmp(command, "updateByAccessControl") == 0)
-        {
-          lastDebounceTime_Relay = millis();
-          checkAutoRelay = true;
-        }
-      }
-
-      if (command && (strcmp(command, "remove") == 0))
-      {
-        // Respond to the client
-        memset(jsonMessage, 0, sizeof(jsonMessage));
-        jsonBufferRes.clear();
-        jsonBufferRes["action"] = "control";
-        jsonBufferRes["command"] = "remove";
-        jsonBufferRes["deviceId"] = chip_id;
-        jsonBufferRes["result"] = "completed";
-        jsonBufferRes["sender"] = sender;
-        serializeJson(jsonBufferRes, jsonMessage);
-        serializeJson(jsonBufferRes, Serial);
-
-        mqtt_client.publish(relay2CtrlBoxTopic, jsonMessage);
-        delay(100);
-        processFormatWRMEEPROM();
-        result = 0;
-
-        rebootEspWithReason("Rebooting due to remove command received");
-      }
-    }
-  }
-  else
-  {
-    result = -3;
-    // do nothing
-    return;
+    jsonBufferRes["state"] = state;
   }
-
-mqttBrokerCallback_handle_error:
   jsonBufferRes["action"] = action;
   jsonBufferRes["command"] = command;
   jsonBufferRes["deviceId"] = deviceId;
   jsonBufferRes["sender"] = sender;
+  if (group)
+  {
+    jsonBufferRes["group"] = group;
+  }
   // Respond to the client
   memset(jsonMessage, 0, sizeof(jsonMessage));
   switch (result)
@@ -917,6 +1253,9 @@ mqttBrokerCallback_handle_error:
   case -3:
     jsonBufferRes["result"] = "parameter invalid";
     break;
+  case 1:
+    jsonBufferRes["result"] = "completed";
+    break;
   default:
     jsonBufferRes["result"] = "failure";
     break;
@@ -927,54 +1266,469 @@ mqttBrokerCallback_handle_error:
   mqtt_client.publish(relay2CtrlBoxTopic, jsonMessage);
 }
 
+// Pulse of an updateByAccessControl command: "duration" or "sequence" in ms, by default
+// RELAY_PULSE_DEFAULT_MS. False if they are invalid.
+bool relayPulseFromJson(const JsonDocument &jsonBuffer, PulsePlan &pulse)
+{
+  if (!pulsePlanFromJson(jsonBuffer.as<JsonVariantConst>(), pulse))
+  {
+    return false;
+  }
+  if (!pulse.steps)
+  {
+    pulse = {1, {RELAY_PULSE_DEFAULT_MS}};
+  }
+  return true;
+}
+
+// One message actuates every member of a group, optionally at a common epoch time ("at", ms) so
+// the members switch together. Without SNTP sync the command applies on arrival.
+void handleGroupCommand(const char *group, const JsonDocument &jsonBuffer, bool msgpack)
+{
+  const char *action = jsonBuffer["action"];
+  const char *command = jsonBuffer["command"];
+  const char *sender = jsonBuffer["sender"] | "";
+  const char *ack = jsonBuffer["ack"] | groupAckNames[GROUPACK_NONE];
+  double at = jsonBuffer["at"] | 0.0; // epoch ms exceeds 32 bits; a double holds it exactly
+
+  DeviceCommand cmd = {};
+  cmd.type = DEVCMD_MAX;
+  if (action && command && (strcmp(action, "control") == 0))
+  {
+    if (strcmp(command, "update") == 0)
+    {
+      cmd.type = DEVCMD_RELAY;
+    }
+    else if (strcmp(command, "updateByAccessControl") == 0 && relayPulseFromJson(jsonBuffer, cmd.pulse))
+    {
+      cmd.type = DEVCMD_RELAY_AUTO_OFF;
+    }
+  }
+  cmd.ack = (strcmp(ack, groupAckNames[GROUPACK_EACH]) == 0) ? GROUPACK_EACH : GROUPACK_NONE;
+  if (at)
+  {
+    cmd.dueUs = clockTimerUsFromEpochMs((uint64_t)at);
+    if (cmd.dueUs - esp_timer_get_time() > GROUP_MAX_SCHEDULE_AHEAD * 1000LL)
+    {
+      cmd.type = DEVCMD_MAX;
+    }
+  }
+
+  if (cmd.type == DEVCMD_MAX)
+  {
+    if (cmd.ack == GROUPACK_EACH)
+    {
+      publishControlReply(action, command, chip_id, sender, -3, -1, group, msgpack);
+    }
+    return;
+  }
+  cmd.state = (jsonBuffer["state"] == 1) ? RELAYSTATUS_ON : RELAYSTATUS_OFF;
+  strlcpy(cmd.sender, sender, sizeof(cmd.sender));
+  strlcpy(cmd.arg, group, sizeof(cmd.arg));
+  cmd.flags = msgpack ? MQTTFLAG_MSGPACK : 0;
+  if (!postDeviceCommand(cmd) && cmd.ack == GROUPACK_EACH)
+  {
+    publishControlReply(action, command, chip_id, sender, -1, -1, group, msgpack);
+  }
+}
+
+// Commands arrive on the shared topic, the device topic or both, depending on eeprom_topic_mode.
+bool isCommandTopic(const char *topic)
+{
+  if (eeprom_topic_mode != MQTTTOPICMODE_DEVICE && strcmp(topic, CtrlBox2relayTopic) == 0)
+  {
+    return true;
+  }
+  return eeprom_topic_mode != MQTTTOPICMODE_LEGACY && strcmp(topic, CtrlBox2deviceTopic) == 0;
+}
+
+void mqttBrokerCallback(char *topic, byte *payload, unsigned int length)
+{
+  TRACE_SCOPE(TRACE_MQTT_CALLBACK);
+  HEAP_SCOPE(HEAPTAG_MQTT);
+  int result = -1;
+
+  // Same topics with MSGPACK_TOPIC_SUFFIX carry the compact MessagePack encoding.
+  bool msgpack = codecStripTopicSuffix(topic);
+  const char *group = groupFromTopic(topic);
+  if (!group && !isCommandTopic(topic))
+  {
+    // do nothing
+    return;
+  }
+  mqttCommandCount++;
+
+  memset(mqtt_info, 0, sizeof(mqtt_info));
+  memcpy(mqtt_info, payload, min((size_t)length, sizeof(mqtt_info) - 1));
+  if (!msgpack)
+  {
+    ESP_LOGD(TAG, "%s: %s", topic, mqtt_info);
+  }
+
+  SmallJsonDoc pooledReq;
+  if (!pooledReq)
+  {
+    ESP_LOGI(TAG, "JSON pool exhausted, message on %s dropped", topic);
+    return;
+  }
+  JsonDocument &jsonBuffer = *pooledReq;
+  // mqtt_info is writable, so both parsers keep strings in place instead of copying them.
+  DeserializationError error = msgpack ? deserializeMsgPack(jsonBuffer, mqtt_info, min((size_t)length, sizeof(mqtt_info) - 1))
+                                       : deserializeJson(jsonBuffer, mqtt_info);
+  if (error)
+  {
+    Serial.print(msgpack ? F("deserializeMsgPack() failed: ") : F("deserializeJson() failed: "));
+    Serial.println(error.f_str());
+    return;
+  }
+  if (msgpack)
+  {
+    codecExpandCommand(jsonBuffer);
+  }
+
+  if (group)
+  {
+    handleGroupCommand(group, jsonBuffer, msgpack);
+    return;
+  }
+
+  const char *action = jsonBuffer["action"];
+  const char *deviceId = jsonBuffer["deviceId"];
+  const char *command = jsonBuffer["command"];
+  const char *sender = jsonBuffer["sender"];
+
+  Serial.print("action: ");
+  Serial.println(action);
+  Serial.print("deviceId: ");
+  Serial.println(deviceId);
+
+  if (!deviceId || (strcmp(deviceId, chip_id) != 0))
+  {
+    Serial.println("Device ID invalided");
+    result = -2;
+  }
+  else if (action && (strcmp(action, "control") == 0) && command)
+  {
+    // Relay and remove commands are replied to by the network task once applied.
+    DeviceCommand cmd = {};
+    cmd.type = DEVCMD_MAX;
+    if (strcmp(command, "update") == 0)
+    {
+      cmd.type = DEVCMD_RELAY;
+    }
+    else if (strcmp(command, "updateByAccessControl") == 0)
+    {
+      cmd.type = DEVCMD_RELAY_AUTO_OFF;
+      if (!relayPulseFromJson(jsonBuffer, cmd.pulse))
+      {
+        cmd.type = DEVCMD_MAX;
+        result = -3;
+      }
+    }
+    else if (strcmp(command, "remove") == 0)
+    {
+      cmd.type = DEVCMD_REMOVE;
+    }
+    else if (strcmp(command, "setGroups") == 0)
+    {
+      cmd.type = DEVCMD_SET_GROUPS;
+      if (!groupListFromJson(jsonBuffer["groups"], cmd.arg2, sizeof(cmd.arg2)))
+      {
+        cmd.type = DEVCMD_MAX;
+        result = -3;
+      }
+    }
+
+    if (cmd.type != DEVCMD_MAX)
+    {
+      cmd.state = (jsonBuffer["state"] == 1) ? RELAYSTATUS_ON : RELAYSTATUS_OFF;
+      cmd.flags = msgpack ? MQTTFLAG_MSGPACK : 0;
+      strlcpy(cmd.sender, sender ? sender : "", sizeof(cmd.sender));
+      if (postDeviceCommand(cmd))
+      {
+        return;
+      }
+    }
+  }
+
+  publishControlReply(action, command, deviceId, sender, result, -1, nullptr, msgpack);
+}
+
+// Apply one queued command. Runs on the network task only.
+// Writes the file contents posted with cmd to path, or removes path when they are empty,
+// and frees them.
+void storeDeviceCommandData(const DeviceCommand &cmd, const char *path)
+{
+  if (!cmd.data)
+  {
+    return;
+  }
+  size_t len = strlen(cmd.data);
+  if (!len)
+  {
+    FILESYSTEM.remove(path);
+    free(cmd.data);
+    return;
+  }
+  File file = FILESYSTEM.open(path, FILE_WRITE);
+  if (!file || file.write((const uint8_t *)cmd.data, len) != len)
+  {
+    ESP_LOGI(TAG, "Writing %s failed", path);
+  }
+  file.close();
+  free(cmd.data);
+}
+
+void applyDeviceCommand(const DeviceCommand &cmd)
+{
+  switch (cmd.type)
+  {
+  case DEVCMD_RELAY:
+  case DEVCMD_RELAY_AUTO_OFF:
+  {
+    strlcpy(reqSender, cmd.sender, sizeof(reqSender));
+    RelayCommand relayCmd;
+    relayCmd.type = (cmd.type == DEVCMD_RELAY_AUTO_OFF) ? RELAYCMD_PULSE : RELAYCMD_SET;
+    relayCmd.state = cmd.state;
+    relayCmd.dueUs = cmd.dueUs;
+    relayCmd.pulse = cmd.pulse;
+    int result = sendRelayCommand(relayCmd) ? 0 : -1;
+    // Group commands reply only when asked to; a scheduled one replies once it is queued.
+    if (!cmd.arg[0] || cmd.ack == GROUPACK_EACH)
+    {
+      publishControlReply("control", (cmd.type == DEVCMD_RELAY_AUTO_OFF) ? "updateByAccessControl" : "update",
+                          chip_id, cmd.sender, result, cmd.state, cmd.arg[0] ? cmd.arg : nullptr,
+                          cmd.flags & MQTTFLAG_MSGPACK);
+    }
+    break;
+  }
+  case DEVCMD_SET_GROUPS:
+    if (mqtt_client.connected())
+    {
+      forEachGroupTopic(unsubscribeCommandTopic);
+    }
+    else
+    {
+      // The stored session still holds the old group subscriptions.
+      mqttSessionReset = true;
+    }
+    strlcpy(mGroups, cmd.arg2, sizeof(mGroups));
+    groupsPublish();
+    EEPROM.writeString(EEPROM_OFFSET_GROUPS, mGroups);
+    commitEEPROM();
+    if (mqtt_client.connected())
+    {
+      forEachGroupTopic(subscribeCommandTopic);
+      publishControlReply("control", "setGroups", chip_id, cmd.sender, 0, -1, nullptr, cmd.flags & MQTTFLAG_MSGPACK);
+    }
+    ESP_LOGI(TAG, "Groups: %s", mGroups);
+    break;
+  case DEVCMD_REMOVE:
+    publishControlReply("control", "remove", chip_id, cmd.sender, 1, -1, nullptr, cmd.flags & MQTTFLAG_MSGPACK);
+    delay(100);
+    processFormatWRMEEPROM();
+    rebootEspWithReason("Rebooting due to remove command received");
+    break;
+  case DEVCMD_SET_CTRLBOX:
+    strlcpy(eeprom_ctrlbox_ipaddr, cmd.arg, sizeof(eeprom_ctrlbox_ipaddr));
+    strlcpy(reqSender, cmd.sender, sizeof(reqSender));
+    if (eeprom_topic_mode != cmd.state || ((eeprom_mqtt_flags ^ cmd.flags) & MQTTFLAG_MSGPACK))
+    {
+      mqttSessionReset = true;
+    }
+    eeprom_topic_mode = cmd.state;
+    eeprom_mqtt_flags = cmd.flags;
+    EEPROM.writeString(EEPROM_OFFSET_CTRLBOX_IP, eeprom_ctrlbox_ipaddr);
+    EEPROM.writeByte(EEPROM_OFFSET_TOPIC_MODE, eeprom_topic_mode);
+    EEPROM.writeByte(EEPROM_OFFSET_MQTT_FLAGS, eeprom_mqtt_flags);
+    strlcpy(mBrokerFallbacks, cmd.arg2, sizeof(mBrokerFallbacks));
+    EEPROM.writeString(EEPROM_OFFSET_BROKERS, mBrokerFallbacks);
+    commitEEPROM();
+    brokers.configure(eeprom_ctrlbox_ipaddr, mBrokerFallbacks);
+    // Reconnect from networkLoop() with the new address and subscriptions.
+    mqttServerChanged = true;
+    if (mqtt_client.connected())
+    {
+      mqtt_client.disconnect();
+    }
+    if (WRMStatus == WRMSTATUS_NORMAL)
+    {
+      setWRMStatus(WRMSTATUS_CONNECT_CTRLBOX);
+    }
+    break;
+  case DEVCMD_LOAD_SCHEDULE:
+    storeDeviceCommandData(cmd, SCHEDULE_PATH);
+    scheduleLoad();
+    break;
+  case DEVCMD_LOAD_RULES:
+    storeDeviceCommandData(cmd, RULES_PATH);
+    rulesLoad();
+    break;
+  case DEVCMD_LOAD_HEAP:
+    storeDeviceCommandData(cmd, HEAP_CONFIG_PATH);
+    heapWatchdogLoad();
+    break;
+  case DEVCMD_LOAD_TLS_CA:
+    storeDeviceCommandData(cmd, TLS_CA_PATH);
+    tlsClient.reload();
+    break;
+  case DEVCMD_CONNECT_WIFI:
+    if (WiFi.status() == WL_CONNECTED)
+    {
+      WiFi.disconnect();
+    }
+    WiFi.begin(cmd.arg, cmd.arg2);
+    if (WiFi.waitForConnectResult() != WL_CONNECTED)
+    {
+      ESP_LOGI(TAG, "Failed to connect to SSID %s", cmd.arg);
+      break;
+    }
+    mWifiConnected = true;
+    ESP_LOGI(TAG, "Connected to SSID %s with IP address: %s", cmd.arg, WiFi.localIP().toString().c_str());
+    // Save the new credentials to EEPROM
+    EEPROM.writeString(EEPROM_OFFSET_SSID, cmd.arg);
+    EEPROM.writeString(EEPROM_OFFSET_PASSWORD, cmd.arg2);
+    commitEEPROM();
+    // automatically restart ESP after 10 seconds
+    restartTimer.once_ms(10000, []()
+                         { rebootEspWithReason("Rebooting to connect to new AP"); });
+    break;
+  default:
+    break;
+  }
+}
+
+void processDeviceCommands()
+{
+  DeviceCommand cmd;
+  while (deviceCommandQueue.pop(cmd))
+  {
+    applyDeviceCommand(cmd);
+  }
+}
+
+// Longest command topic (device or group) plus MSGPACK_TOPIC_SUFFIX.
+#define COMMAND_TOPIC_MSGPACK_SIZE (sizeof(GROUP_TOPIC_PREFIX) + GROUP_NAME_SIZE + sizeof(chip_id) + sizeof(MSGPACK_TOPIC_SUFFIX))
+
+// Subscribes to topic and, with MQTTFLAG_MSGPACK, to its MessagePack twin.
+void subscribeCommandTopic(const char *topic)
+{
+  mqtt_client.subscribe(topic, MQTT_COMMAND_QOS);
+  if (eeprom_mqtt_flags & MQTTFLAG_MSGPACK)
+  {
+    char packed[COMMAND_TOPIC_MSGPACK_SIZE];
+    snprintf(packed, sizeof(packed), "%s" MSGPACK_TOPIC_SUFFIX, topic);
+    mqtt_client.subscribe(packed, MQTT_COMMAND_QOS);
+  }
+}
+
+void unsubscribeCommandTopic(const char *topic)
+{
+  mqtt_client.unsubscribe(topic);
+  if (eeprom_mqtt_flags & MQTTFLAG_MSGPACK)
+  {
+    char packed[COMMAND_TOPIC_MSGPACK_SIZE];
+    snprintf(packed, sizeof(packed), "%s" MSGPACK_TOPIC_SUFFIX, topic);
+    mqtt_client.unsubscribe(packed);
+  }
+}
+
+// Command topics for eeprom_topic_mode plus one per group.
+void subscribeCommandTopics()
+{
+  if (eeprom_topic_mode != MQTTTOPICMODE_DEVICE)
+  {
+    subscribeCommandTopic(CtrlBox2relayTopic);
+  }
+  if (eeprom_topic_mode != MQTTTOPICMODE_LEGACY)
+  {
+    subscribeCommandTopic(CtrlBox2deviceTopic);
+  }
+  forEachGroupTopic(subscribeCommandTopic);
+  // mqtt_client.subscribe(relay2CtrlBoxTopic, qos);
+}
+
+// One step of the MQTT connect sequence: at most one connect attempt, so networkLoop()
+// serves commands, events and timers between attempts. After a failure the next broker is
+// tried on the following pass; when all of them are backing off, networkLoop() sleeps until
+// the first is ready again (BrokerSelector::waitMs()).
 bool connectToMQTTBroker()
 {
-  int qos = 0; // Make sure the qos is zero in the MQTT broker of AWS
+  TRACE_SCOPE(TRACE_MQTT_CONNECT);
+  HEAP_SCOPE(HEAPTAG_MQTT);
   static char mqtt_id[48] = {};
   static bool mqttFirstConnTime = true;
-  int retries = 0;
 
   if (!strlen(eeprom_ctrlbox_ipaddr))
     return false;
 
+  bool useTls = eeprom_mqtt_flags & MQTTFLAG_TLS;
+  uint16_t port = useTls ? MQTT_BROKER_TLS_PORT : MQTT_BROKER_PORT;
   if (mqttFirstConnTime)
   {
-    mqtt_client.setServer(eeprom_ctrlbox_ipaddr, MQTT_BROKER_PORT);
     mqtt_client.setCallback(mqttBrokerCallback);
-    mqtt_client.setKeepAlive(90); // seconds
     sprintf(mqtt_id, "VMXWRM%s", chip_id);
     mqttFirstConnTime = false;
   }
+  if (!mqttConnectTries || mqttServerChanged)
+  {
+    // A new sequence, or the ControlBox settings changed under the running one.
+    mqttTransport.setTransport(useTls ? (Client &)tlsClient : (Client &)client);
+    mqttTransportTls = useTls;
+    tlsClient.setInsecure(eeprom_mqtt_flags & MQTTFLAG_TLS_INSECURE);
+    // With somewhere to fail over to, a dead broker is given up on in seconds, not minutes.
+    bool failover = brokers.count() > 1;
+    mqttKeepAliveS = failover ? MQTT_KEEPALIVE_FAILOVER_S : MQTT_KEEPALIVE_S;
+    mqtt_client.setKeepAlive(mqttKeepAliveS);
+    mqtt_client.setSocketTimeout(failover ? MQTT_CONNECT_TIMEOUT_FAILOVER_S : MQTT_SOCKET_TIMEOUT);
+    mqttServerChanged = false;
+    mqttConnectTries = 0;
+    mqttConnectStartMs = millis();
+  }
 
-  // Try to connect to the MQTT broker
-  while (!mqtt_client.connect(mqtt_id) && retries < MQTT_MAX_RECONNECT_TRIES)
+  int broker = brokers.pick();
+  if (broker < 0 || !brokers.ready(broker))
   {
-    // If we fail to connect to the MQTT broker, we will try again later.
-    ESP_LOGI(TAG, "Attempting to connect to MQTT broker at %s (try %d)...", eeprom_ctrlbox_ipaddr, retries);
-    delay(1000);
-    retries++;
-    processStatusLED();
-    processResetBtn();
+    return false;
   }
 
-  // Make sure that we did indeed successfully connect to the MQTT broker
-  // If not we just end the function and wait for the next loop.
-  if (!mqtt_client.connected())
+  // mqtt_id is stable per chip, so the broker can hand a persistent session back to us.
+  bool cleanSession = !MQTT_PERSISTENT_SESSION || mqttSessionReset;
+  ESP_LOGI(TAG, "Attempting to connect to MQTT broker at %s (try %d)...", brokers.host(broker), mqttConnectTries);
+  mqtt_client.setServer(brokers.host(broker), port);
+  unsigned long attemptMs = millis();
+  mqttConnectTries++;
+  if (!mqtt_client.connect(mqtt_id, NULL, NULL, NULL, 0, false, NULL, cleanSession))
   {
-    ESP_LOGI(TAG, "Timeout! Unable to connect to MQTT broker at %s", eeprom_ctrlbox_ipaddr);
+    brokers.failed(broker);
+    if (mqttConnectTries >= MQTT_MAX_RECONNECT_TRIES)
+    {
+      ESP_LOGI(TAG, "Timeout! Unable to connect to any of %u MQTT brokers", (unsigned)brokers.count());
+      mqttConnectTries = 0;
+    }
     return false;
   }
-  else
+  brokers.connected(broker, millis() - attemptMs);
+  mqttConnectTries = 0;
+
+  // If we land here, we have successfully connected to AWS!
+  // A resumed session already has our subscriptions and delivers queued commands right away.
+  // The first connect after boot still subscribes, in case the config changed before a reboot.
+  mqttSessionResumed = !cleanSession && mqttTransport.sessionPresent();
+  if (!mqttSessionResumed || !mqttSubscribedThisBoot)
   {
-    // If we land here, we have successfully connected to AWS!
-    // And we can subscribe to topics and send messages.
-    mqtt_client.subscribe(CtrlBox2relayTopic, qos);
-    // mqtt_client.subscribe(relay2CtrlBoxTopic, qos);
+    subscribeCommandTopics();
+    mqttSubscribedThisBoot = true;
+  }
+  mqttSessionReset = false;
+  mqttConnectMs = millis() - mqttConnectStartMs;
 
-    StaticJsonDocument<200> jsonBufferRes;
+  SmallJsonDoc pooledRes;
+  if (pooledRes)
+  {
+    JsonDocument &jsonBufferRes = *pooledRes;
     // Respond to the client
     memset(jsonMessage, 0, sizeof(jsonMessage));
-    jsonBufferRes.clear();
     jsonBufferRes["action"] = "control";
     jsonBufferRes["command"] = "connect";
     jsonBufferRes["deviceId"] = chip_id;
@@ -984,47 +1738,80 @@ bool connectToMQTTBroker()
     serializeJson(jsonBufferRes, Serial);
 
     mqtt_client.publish(relay2CtrlBoxTopic, jsonMessage);
-    WRMStatus = WRMSTATUS_NORMAL;
   }
-  ESP_LOGI(TAG, "Connected to MQTT broker at %s", eeprom_ctrlbox_ipaddr);
+  setWRMStatus(WRMSTATUS_NORMAL);
+  mqttConnectCount++;
+  heartbeat.reset();
+  networkTimers.start(timerHeartbeat, HEARTBEAT_MIN_MS);
+  ESP_LOGI(TAG, "Connected to MQTT broker at %s in %lu ms, session %s", brokers.host(broker), mqttConnectMs,
+           mqttSessionResumed ? "resumed" : "new");
+  bootProfileMark(BOOT_PHASE_MQTT);
+  startDeferredServices();
   return true;
 }
 
-String bcrypt(String payload)
+// SHA1 of the concatenated parts as a 40 hex digits string.
+void bcrypt(const char *const parts[], size_t count, char hashString[41])
 {
   uint8_t sha1Result[20];
   mbedtls_md_context_t ctx;
   mbedtls_md_init(&ctx);
   mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA1), 0);
   mbedtls_md_starts(&ctx);
-  mbedtls_md_update(&ctx, (const unsigned char *)payload.c_str(), payload.length());
+  for (size_t i = 0; i < count; i++)
+  {
+    mbedtls_md_update(&ctx, (const unsigned char *)parts[i], strlen(parts[i]));
+  }
   mbedtls_md_finish(&ctx, sha1Result);
   mbedtls_md_free(&ctx);
 
-  char hashString[41];
   for (int i = 0; i < 20; i++)
   {
     sprintf(&hashString[i * 2], "%02x", sha1Result[i]);
   }
   hashString[40] = '\0'; // Null-terminate the string
+}
 
-  return String(hashString);
+// The session token only depends on the credentials and the chip ID, so it is computed once.
+const char *getAuthToken()
+{
+  static char token[41] = {};
+  if (!token[0])
+  {
+    const char *parts[] = {username, password, chip_id};
+    bcrypt(parts, 3, token);
+  }
+  return token;
 }
 
 bool requireAuthentication(AsyncWebServerRequest *req)
 {
-  if (req->hasHeader("Cookie"))
+  const AsyncWebHeader *cookie = req->getHeader("Cookie");
+  if (cookie)
   {
-    String cookie = req->header("Cookie");
-    String token = bcrypt(String(username) + String(password) + chip_id);
-    if (cookie.indexOf("ClientID=" + token) != -1)
+    const char *found = strstr(cookie->value().c_str(), "ClientID=");
+    while (found)
     {
-      return true; // Authenticated
+      if (strncmp(found + 9, getAuthToken(), 40) == 0)
+      {
+        return true; // Authenticated
+      }
+      found = strstr(found + 9, "ClientID=");
     }
   }
   return false; // Not authenticated
 }
 
+// Send a JSON document without building an intermediate String: it is serialized straight
+// into the response buffer, sized once from measureJson() and freed when it has been sent.
+void sendJson(AsyncWebServerRequest *req, const JsonDocument &doc)
+{
+  HEAP_SCOPE(HEAPTAG_JSON);
+  AsyncResponseStream *res = req->beginResponseStream("application/json", measureJson(doc));
+  serializeJson(doc, *res);
+  req->send(res);
+}
+
 // Function to get the error message from the Update process
 void getUpdateErrorMsg()
 {
@@ -1050,118 +1837,410 @@ void runHttpServer()
       req->send(400,"text/plain","Bad Request");
       return;
     }
-
-    if(req->arg("username") == String(username) && req->arg("password") == String(password)) {
-      String token = bcrypt(String(username)+String(password)+chip_id);
-      AsyncWebServerResponse *res = req->beginResponse(200, "application/json", "{\"access_token\":\""+token+"\"}");
-      res->addHeader("Set-Cookie","ClientID=" + token + "; Path=/; Max-Age=3600");
-      req->send(res);
-    } else{
-      req->send(401,"text/plain","Login failed!");
-    } });
-
-  server.on("/api/v1/logout", HTTP_GET, [](AsyncWebServerRequest *req)
-            {
-   AsyncWebServerResponse *res = req->beginResponse(200, "application/json", "{\"message\":\"Logout successful\"}");
-   res->addHeader("Set-Cookie","ClientID=0; Max-Age=0");
-   req->send(res); });
-  server.on("/api/v1/scan", HTTP_GET, [](AsyncWebServerRequest *req)
+
+    RequestScope scope;
+    if(!strcmp(req->arg("username").c_str(), username) && !strcmp(req->arg("password").c_str(), password)) {
+      const char *token = getAuthToken();
+      AsyncResponseStream *res = req->beginResponseStream("application/json", 64);
+      res->printf("{\"access_token\":\"%s\"}", token);
+      res->addHeader("Set-Cookie", requestArena.printf("ClientID=%s; Path=/; Max-Age=3600", token));
+      req->send(res);
+    } else{
+      req->send(401,"text/plain","Login failed!");
+    } });
+
+  server.on("/api/v1/logout", HTTP_GET, [](AsyncWebServerRequest *req)
+            {
+   AsyncWebServerResponse *res = req->beginResponse(200, "application/json", "{\"message\":\"Logout successful\"}");
+   res->addHeader("Set-Cookie","ClientID=0; Max-Age=0");
+   req->send(res); });
+  server.on("/api/v1/scan", HTTP_GET, [](AsyncWebServerRequest *req)
+            {
+    if (!requireAuthentication(req)) {
+      req->send(401,"text/plain","Access denied");
+      return;
+    }
+    RequestScope scope;
+    LargeJsonDoc pooled;
+    if (!pooled) {
+      req->send(503,"text/plain","Server busy");
+      return;
+    }
+    JsonDocument &doc = *pooled;
+    if (!scanCacheToJson(doc)) {
+      // The very first request will be empty, reload /scan endpoint
+      req->send(200, "application/json", "{\"reload\" : 1}");
+      return;
+    }
+    sendJson(req, doc); });
+  server.on("/api/v1/connect", HTTP_POST, [](AsyncWebServerRequest *req)
+            {
+    if (!requireAuthentication(req)) {
+      req->send(401,"text/plain","Access denied");
+      return;
+    }
+    if (!req->hasArg("ssid") || !req->hasArg("password")) {
+      req->send(400,"text/plain","Bad Request");
+      return;
+    }
+    char resp[256];
+    const String &ssid_temp = req->arg("ssid");
+    const String &password_temp = req->arg("password");
+    if (ssid_temp.length() == 0) {
+      req->send(400,"text/plain","SSID cannot be empty");
+      return;
+    }
+    DeviceCommand cmd = {};
+    cmd.type = DEVCMD_CONNECT_WIFI;
+    strlcpy(cmd.arg, ssid_temp.c_str(), sizeof(cmd.arg));
+    strlcpy(cmd.arg2, password_temp.c_str(), sizeof(cmd.arg2));
+    if (!postDeviceCommand(cmd)) {
+      req->send(503,"text/plain","Server busy");
+      return;
+    }
+    // The connection attempt runs on the network task; the device restarts 10 seconds after it succeeds.
+    snprintf(resp, sizeof(resp),
+        "Connecting to <b>%s</b> WiFi network.<br><br>"
+        "If the connection succeeds the ESP restarts; then reload this page from the new LAN address.",
+        ssid_temp.c_str());
+    req->send(200,"text/html",resp); });
+  server.on("/api/v1/status", HTTP_GET, [](AsyncWebServerRequest *req)
+            {
+    if (!requireAuthentication(req)) {
+      req->send(401,"text/plain","Access denied");
+      return;
+    }
+    RequestScope scope;
+    SmallJsonDoc pooled;
+    if (!pooled) {
+      req->send(503,"text/plain","Server busy");
+      return;
+    }
+    JsonDocument &doc = *pooled;
+    doc["firmware_version"] = WRMFWVER;
+    doc["chip_id"] = chip_id;
+    if (mWifiMode == AP_MODE) {
+      doc["wifi_mode"] = "Access Point";
+    } else {
+      wifi_ap_record_t apInfo = {};
+      if (esp_wifi_sta_get_ap_info(&apInfo) != ESP_OK) {
+        strlcpy((char *)apInfo.ssid, eeprom_ssid, sizeof(apInfo.ssid));
+      }
+      doc["wifi_mode"] = requestArena.printf("Station-[%s]", (const char *)apInfo.ssid);
+    }
+    doc["wifi_connected"] = mWifiConnected;
+    IPAddress ip = mWifiConnected ? WiFi.localIP() : WiFi.softAPIP();
+    doc["ip_address"] = requestArena.printf("%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+    doc["ctrlbox_ip"] = strlen(eeprom_ctrlbox_ipaddr) ? eeprom_ctrlbox_ipaddr : "Not set";
+    doc["mqtt_status"] = mqtt_client.connected() ? "Connected" : "Disconnected";
+    doc["mqtt_topic_mode"] = mqttTopicModeNames[eeprom_topic_mode];
+    doc["mqtt_session"] = mqttSessionResumed ? "resumed" : "new";
+    doc["mqtt_connect_ms"] = mqttConnectMs;
+    doc["mqtt_tls"] = (bool)(eeprom_mqtt_flags & MQTTFLAG_TLS);
+    doc["mqtt_tls_insecure"] = (bool)(eeprom_mqtt_flags & MQTTFLAG_TLS_INSECURE);
+    doc["mqtt_msgpack"] = (bool)(eeprom_mqtt_flags & MQTTFLAG_MSGPACK);
+    doc["wrm_status"] = WRMStatus == WRMSTATUS_INIT ? "Init" : WRMStatus == WRMSTATUS_JOIN_AP ? "Joining AP" : WRMStatus == WRMSTATUS_PAIRING ? "Paring" : WRMStatus == WRMSTATUS_CONNECT_CTRLBOX ? "Connecting MQTT" : "Normal";
+    doc["relay_status"] = RelayStatus == RELAYSTATUS_ON ? "On" : "Off";
+    char timeStr[DATETIME_STRING_SIZE];
+    getDateTimeString(timeStr, sizeof(timeStr));
+    doc["time"] = timeStr;
+    doc["time_synced"] = mClockSynced;
+    sendJson(req, doc); });
+  server.on("/api/v1/boot", HTTP_GET, [](AsyncWebServerRequest *req)
+            {
+    if (!requireAuthentication(req)) {
+      req->send(401,"text/plain","Access denied");
+      return;
+    }
+    RequestScope scope;
+    SmallJsonDoc pooled;
+    if (!pooled) {
+      req->send(503,"text/plain","Server busy");
+      return;
+    }
+    JsonDocument &doc = *pooled;
+    bootProfileToJson(doc);
+    sendJson(req, doc); });
+  server.on("/api/v1/stats", HTTP_GET, [](AsyncWebServerRequest *req)
+            {
+    if (!requireAuthentication(req)) {
+      req->send(401,"text/plain","Access denied");
+      return;
+    }
+    RequestScope scope;
+    SmallJsonDoc pooled;
+    if (!pooled) {
+      req->send(503,"text/plain","Server busy");
+      return;
+    }
+    JsonDocument &doc = *pooled;
+    jsonPoolToJson(doc);
+    JsonObject arena = doc.createNestedObject("request_arena");
+    arena["size"] = REQUEST_ARENA_SIZE;
+    arena["high_water"] = requestArena.highWater();
+    arena["failures"] = requestArena.failures();
+    tlsClient.toJson(doc.createNestedObject("tls"));
+    relayPulse.toJson(doc.createNestedObject("pulse"));
+    mRules.toJson(doc.createNestedObject("rules"));
+    brokers.toJson(doc.createNestedArray("brokers"));
+    sendJson(req, doc); });
+#ifdef VMX_TRACE
+  // Binary trace ring, see Tracer::dump(); tools/vmxtrace.py converts it to Chrome trace JSON.
+  server.on("/api/v1/trace", HTTP_GET, [](AsyncWebServerRequest *req)
+            {
+    if (!requireAuthentication(req)) {
+      req->send(401,"text/plain","Access denied");
+      return;
+    }
+    AsyncResponseStream *res = req->beginResponseStream("application/octet-stream");
+    mTracer.dump(*res);
+    req->send(res); });
+#endif
+  server.on("/api/v1/heap", HTTP_GET, [](AsyncWebServerRequest *req)
+            {
+    if (!requireAuthentication(req)) {
+      req->send(401,"text/plain","Access denied");
+      return;
+    }
+    RequestScope scope;
+    SmallJsonDoc pooled;
+    if (!pooled) {
+      req->send(503,"text/plain","Server busy");
+      return;
+    }
+    JsonDocument &doc = *pooled;
+    heapToJson(doc);
+    sendJson(req, doc); });
+  // Body: watchdog config as described in VMXHeap.h; missing fields take the defaults.
+  server.on("/api/v1/heap", HTTP_POST, [](AsyncWebServerRequest *req)
+            {
+    if (!requireAuthentication(req)) {
+      req->send(401,"text/plain","Access denied");
+      return;
+    }
+    if (!req->hasArg("plain")) {
+      req->send(400,"text/plain","Bad Request");
+      return;
+    }
+    RequestScope scope;
+    SmallJsonDoc pooled;
+    if (!pooled) {
+      req->send(503,"text/plain","Server busy");
+      return;
+    }
+    JsonDocument &doc = *pooled;
+    const String &body = req->arg("plain");
+    HeapWatchdogConfig config;
+    if (body.length() > HEAP_MAX_FILE_SIZE || deserializeJson(doc, body.c_str()) ||
+        !heapWatchdogConfigFromJson(doc, config)) {
+      req->send(400,"text/plain","Invalid watchdog config");
+      return;
+    }
+    DeviceCommand cmd = {};
+    cmd.type = DEVCMD_LOAD_HEAP;
+    if (!postDeviceCommandData(cmd, body)) {
+      req->send(503,"text/plain","Server busy");
+      return;
+    }
+    sendJson(req, doc); });
+  server.on("/api/v1/profile", HTTP_GET, [](AsyncWebServerRequest *req)
+            {
+    if (!requireAuthentication(req)) {
+      req->send(401,"text/plain","Access denied");
+      return;
+    }
+    RequestScope scope;
+    LargeJsonDoc pooled;
+    if (!pooled) {
+      req->send(503,"text/plain","Server busy");
+      return;
+    }
+    JsonDocument &doc = *pooled;
+    doc["uptime_ms"] = millis();
+    // task name: [cpu % since previous request, minimum free stack in bytes]
+    taskProfileToJson(doc.createNestedObject("tasks"));
+#if (configGENERATE_RUN_TIME_STATS != 1)
+    doc["tasks_cpu"] = "null, needs CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS (custom sdkconfig)";
+#endif
+    // slowest: [duration us, end millis, branches...]
+    loopProfileToJson(doc.createNestedObject("loop"));
+    sendJson(req, doc); });
+  server.on("/api/v1/groups", HTTP_GET, [](AsyncWebServerRequest *req)
+            {
+    if (!requireAuthentication(req)) {
+      req->send(401,"text/plain","Access denied");
+      return;
+    }
+    RequestScope scope;
+    SmallJsonDoc pooled;
+    if (!pooled) {
+      req->send(503,"text/plain","Server busy");
+      return;
+    }
+    JsonDocument &doc = *pooled;
+    groupListToJson(doc.createNestedArray("groups"));
+    sendJson(req, doc); });
+  // Body: {"groups": ["name", ...]}, at most GROUP_MAX_COUNT names of [A-Za-z0-9_-].
+  server.on("/api/v1/groups", HTTP_POST, [](AsyncWebServerRequest *req)
+            {
+    if (!requireAuthentication(req)) {
+      req->send(401,"text/plain","Access denied");
+      return;
+    }
+    if (!req->hasArg("plain")) {
+      req->send(400,"text/plain","Bad Request");
+      return;
+    }
+    RequestScope scope;
+    SmallJsonDoc pooled;
+    if (!pooled) {
+      req->send(503,"text/plain","Server busy");
+      return;
+    }
+    JsonDocument &doc = *pooled;
+    DeviceCommand cmd = {};
+    cmd.type = DEVCMD_SET_GROUPS;
+    if (deserializeJson(doc, req->arg("plain").c_str()) ||
+        !groupListFromJson(doc["groups"], cmd.arg2, sizeof(cmd.arg2))) {
+      req->send(400,"text/plain","Invalid groups");
+      return;
+    }
+    if (!postDeviceCommand(cmd)) {
+      req->send(503,"text/plain","Server busy");
+      return;
+    }
+    sendJson(req, doc); });
+  // Body: PEM of the CA that signed the ControlBox broker certificate; empty removes it.
+  // The certificate must name the broker IP as its CN or as a DNS name SAN.
+  server.on("/api/v1/tls", HTTP_POST, [](AsyncWebServerRequest *req)
+            {
+    if (!requireAuthentication(req)) {
+      req->send(401,"text/plain","Access denied");
+      return;
+    }
+    if (!req->hasArg("plain")) {
+      req->send(400,"text/plain","Bad Request");
+      return;
+    }
+    const String &pem = req->arg("plain");
+    if (pem.length() && (pem.length() >= TLS_CA_MAX_SIZE || pem.indexOf("-----BEGIN CERTIFICATE-----") < 0)) {
+      req->send(400,"text/plain","Invalid CA");
+      return;
+    }
+    DeviceCommand cmd = {};
+    cmd.type = DEVCMD_LOAD_TLS_CA;
+    if (!postDeviceCommandData(cmd, pem)) {
+      req->send(503,"text/plain","Server busy");
+      return;
+    }
+    req->send(200,"text/plain",pem.length() ? "CA stored, used from the next connect" : "CA removed"); });
+  server.on("/api/v1/schedule", HTTP_GET, [](AsyncWebServerRequest *req)
             {
     if (!requireAuthentication(req)) {
       req->send(401,"text/plain","Access denied");
       return;
     }
-    /** https://github.com/ESP32Async/ESPAsyncWebServer/wiki#scanning-for-available-wifi-networks */
-        ESP_LOGI(TAG,"Waiting Wfi"); 
-int res = WiFi.scanComplete();
-    if (res == -2){
-        WiFi.scanNetworks(true);
-        // The very first request will be empty, reload /scan endpoint
-        req->send(200, "application/json", "{\"reload\" : 1}");
-   } else if (res) {
-      ESP_LOGI(TAG, "Number of networks: %d", res);
-      DynamicJsonDocument doc(512);
-      for(int i = 0; i < res; ++i) {
-        Serial.println(WiFi.SSID(i));
-        doc.add(WiFi.SSID(i));
-      }
-      String json;
-      serializeJson(doc, json);
-      req->send(200, "application/json", json);
-      WiFi.scanDelete(); // clean up RAM
-      if(WiFi.scanComplete() == -2){
-        WiFi.scanNetworks(true);
-      }
-    } });
-  server.on("/api/v1/connect", HTTP_POST, [](AsyncWebServerRequest *req)
+    RequestScope scope;
+    LargeJsonDoc pooled;
+    if (!pooled) {
+      req->send(503,"text/plain","Server busy");
+      return;
+    }
+    JsonDocument &doc = *pooled;
+    File file = FILESYSTEM.exists(SCHEDULE_PATH) ? FILESYSTEM.open(SCHEDULE_PATH, FILE_READ) : File();
+    if (!file || deserializeJson(doc, file)) {
+      doc.clear();
+      doc.createNestedArray("entries");
+    }
+    scheduleToJson(doc);
+    sendJson(req, doc); });
+  // Body: schedule document as described in VMXSchedule.h; replaces the stored schedule.
+  server.on("/api/v1/schedule", HTTP_POST, [](AsyncWebServerRequest *req)
             {
     if (!requireAuthentication(req)) {
       req->send(401,"text/plain","Access denied");
       return;
     }
-    if (!req->hasArg("ssid") || !req->hasArg("password")) {
+    if (!req->hasArg("plain")) {
       req->send(400,"text/plain","Bad Request");
       return;
     }
-    char resp[256];
-    String ssid_temp = req->arg("ssid");
-    String password_temp = req->arg("password");
-    if (WiFi.status() == WL_CONNECTED) {
-        snprintf(resp, sizeof(resp),
-            "ESP is currently connected to a WiFi network.<br><br>"
-            "Actual connection will be closed and a new attempt will be done with <b>"
-            "%s</b> WiFi network.", ssid_temp.c_str());
-        req->send(200,"text/html",resp);
-        delay(1000);
-        WiFi.disconnect();
-    }
-    if (ssid_temp.length() != 0) {
-      WiFi.begin(ssid_temp.c_str(), password_temp.c_str());
-      if (WiFi.waitForConnectResult() != WL_CONNECTED) {
-        req->send(500,"text/plain","Failed to connect to WiFi");
-        return;
-      }
-      mWifiConnected = true;
-      IPAddress ip = WiFi.localIP();
-      snprintf(resp, sizeof(resp),
-          "Restart ESP and then reload this page from "
-          "<a href='%d:%d.%d.%d:%d'>the new LAN address</a>",
-          ip[0], ip[1], ip[2], ip[3], REST_SERVER_PORT);
-      // Save the new credentials to EEPROM
-      EEPROM.writeString(EEPROM_OFFSET_SSID,ssid_temp);
-      EEPROM.writeString(EEPROM_OFFSET_PASSWORD,password_temp);
-      EEPROM.commit();
-      req->send(200, "text/plain", resp);
-      // automatically restart ESP after 10 seconds
-      restartTimer.once_ms(10000, []() {
-        rebootEspWithReason("Rebooting to connect to new AP");
-      });
-    } else {
-      req->send(400,"text/plain","SSID cannot be empty");
-    } });
-  server.on("/api/v1/status", HTTP_GET, [](AsyncWebServerRequest *req)
+    RequestScope scope;
+    LargeJsonDoc pooled;
+    if (!pooled) {
+      req->send(503,"text/plain","Server busy");
+      return;
+    }
+    JsonDocument &doc = *pooled;
+    const String &body = req->arg("plain");
+    if (body.length() > SCHEDULE_MAX_FILE_SIZE || deserializeJson(doc, body.c_str()) ||
+        !scheduleFromJson(doc, nullptr)) {
+      req->send(400,"text/plain","Invalid schedule");
+      return;
+    }
+    DeviceCommand cmd = {};
+    cmd.type = DEVCMD_LOAD_SCHEDULE;
+    if (!postDeviceCommandData(cmd, body)) {
+      req->send(503,"text/plain","Server busy");
+      return;
+    }
+    sendJson(req, doc); });
+  server.on("/api/v1/rules", HTTP_GET, [](AsyncWebServerRequest *req)
             {
     if (!requireAuthentication(req)) {
       req->send(401,"text/plain","Access denied");
       return;
     }
-    DynamicJsonDocument doc(512);
-    doc["firmware_version"] = WRMFWVER;
-    doc["chip_id"] = chip_id;
-    doc["wifi_mode"] = mWifiMode == AP_MODE ? "Access Point" : ("Station-[" + WiFi.SSID() +"]");
-    doc["wifi_connected"] = mWifiConnected;
-    doc["ip_address"] = mWifiConnected ? WiFi.localIP().toString() : WiFi.softAPIP().toString();
-    doc["ctrlbox_ip"] = strlen(eeprom_ctrlbox_ipaddr) ? String(eeprom_ctrlbox_ipaddr) : "Not set";
-    doc["mqtt_status"] = mqtt_client.connected() ? "Connected" : "Disconnected";
-    doc["wrm_status"] = WRMStatus == WRMSTATUS_INIT ? "Init" : WRMStatus == WRMSTATUS_JOIN_AP ? "Joining AP" : WRMStatus == WRMSTATUS_PAIRING ? "Paring" : WRMStatus == WRMSTATUS_CONNECT_CTRLBOX ? "Connecting MQTT" : "Normal";
-    doc["relay_status"] = RelayStatus == RELAYSTATUS_ON ? "On" : "Off";
-    String json;
-    serializeJson(doc, json);
-    req->send(200, "application/json", json); });
+    RequestScope scope;
+    LargeJsonDoc pooled;
+    if (!pooled) {
+      req->send(503,"text/plain","Server busy");
+      return;
+    }
+    JsonDocument &doc = *pooled;
+    File file = FILESYSTEM.exists(RULES_PATH) ? FILESYSTEM.open(RULES_PATH, FILE_READ) : File();
+    if (!file || deserializeJson(doc, file)) {
+      doc.clear();
+      doc.createNestedArray("rules");
+    }
+    rulesToJson(doc);
+    sendJson(req, doc); });
+  // Body: rules document as described in VMXRules.h; replaces the stored rules.
+  server.on("/api/v1/rules", HTTP_POST, [](AsyncWebServerRequest *req)
+            {
+    if (!requireAuthentication(req)) {
+      req->send(401,"text/plain","Access denied");
+      return;
+    }
+    if (!req->hasArg("plain")) {
+      req->send(400,"text/plain","Bad Request");
+      return;
+    }
+    RequestScope scope;
+    LargeJsonDoc pooled;
+    if (!pooled) {
+      req->send(503,"text/plain","Server busy");
+      return;
+    }
+    JsonDocument &doc = *pooled;
+    const String &body = req->arg("plain");
+    if (body.length() > RULES_MAX_FILE_SIZE || deserializeJson(doc, body.c_str()) ||
+        !rulesFromJson(doc, nullptr)) {
+      req->send(400,"text/plain","Invalid rules");
+      return;
+    }
+    DeviceCommand cmd = {};
+    cmd.type = DEVCMD_LOAD_RULES;
+    if (!postDeviceCommandData(cmd, body)) {
+      req->send(503,"text/plain","Server busy");
+      return;
+    }
+    sendJson(req, doc); });
   server.on("/api/v1/update", HTTP_POST, [](AsyncWebServerRequest *req)
             {
+    RequestScope scope;
     if (mUpdateResult != UPDATE_OK) {
-      req->send(500,"text/plain","update error: " + mUpdateErrorMsg);
+      req->send(500,"text/plain",requestArena.printf("update error: %s", mUpdateErrorMsg.c_str()));
       return;
     } else {
       req->send(200,"text/plain","update ok, rebooting...");
@@ -1170,6 +2249,7 @@ int res = WiFi.scanComplete();
       });
     } }, [](AsyncWebServerRequest *req, String filename, size_t index, uint8_t *data, size_t len, bool final)
             {
+    HEAP_SCOPE(HEAPTAG_OTA);
 
     StreamString stream;
     if (!index) {
@@ -1192,10 +2272,11 @@ int res = WiFi.scanComplete();
     } });
   server.on("/api/v1/download", HTTP_GET, [](AsyncWebServerRequest *req)
             {
+    RequestScope scope;
     if(req->hasArg("filename")) {
-      String fileName = req->arg("filename");
-        if (FILESYSTEM.exists("/" + fileName)) {
-          req->send(FILESYSTEM, "/" + fileName, "application/octet-stream", true); // true to download
+      const char *filePath = requestArena.printf("/%s", req->arg("filename").c_str());
+        if (*filePath && FILESYSTEM.exists(filePath)) {
+          req->send(FILESYSTEM, filePath, "application/octet-stream", true); // true to download
         } else {
           req->send(404,"text/plain","File not found");
         }
@@ -1226,7 +2307,8 @@ int res = WiFi.scanComplete();
       req->send(401,"text/plain","Access denied");
       return;
     }
-    String path = req->arg("path");
+    RequestScope scope;
+    const String &path = req->arg("path");
     if (path != "/" && !FILESYSTEM.exists(path)) {
       req->send(404, "text/plain", "File not found");
       return;
@@ -1241,20 +2323,28 @@ int res = WiFi.scanComplete();
       return;
     }
 
-    DynamicJsonDocument doc(1024);
+    LargeJsonDoc pooled;
+    if (!pooled) {
+      req->send(503,"text/plain","Server busy");
+      return;
+    }
+    JsonDocument &doc = *pooled;
     JsonArray array = doc.to<JsonArray>();
 
     File file = root.openNextFile();
     while(file){
       JsonObject fileObj = array.createNestedObject();
-      fileObj["name"] = String(file.name()).substring(1); // remove leading '/'
-      fileObj["size"] = formatBytes(file.size());
+      const char *name = file.name();
+      if (*name == '/') {
+        name++; // remove leading '/'
+      }
+      char size[16];
+      fileObj["name"] = requestArena.strdup(name);
+      fileObj["size"] = requestArena.strdup(formatBytes(file.size(), size, sizeof(size)));
       fileObj["type"] = file.isDirectory() ? "dir" : "file";
       file = root.openNextFile();
     }
-    String json;
-    serializeJson(doc, json);
-    req->send(200, "application/json", json); });
+    sendJson(req, doc); });
 
   server.on("/api/v1/reboot", HTTP_GET, [](AsyncWebServerRequest *req)
             {
@@ -1295,64 +2385,444 @@ int res = WiFi.scanComplete();
   Serial.println("HTTP server started");
 }
 
+// Start SNTP; the epoch offset is captured by onTimeSync() once the server answers.
 void setClock()
 {
-  configTime(0, 0, "pool.ntp.org", "time.nist.gov"); // UTC
+  clockBegin();
+}
+
+void publishRelayStatus(const char *command, uint8_t state)
+{
+  SmallJsonDoc pooledRes;
+  if (!pooledRes)
+  {
+    return;
+  }
+  JsonDocument &jsonBufferRes = *pooledRes;
+  memset(jsonMessage, 0, sizeof(jsonMessage));
+  jsonBufferRes["action"] = "status";
+  jsonBufferRes["command"] = command;
+  jsonBufferRes["deviceId"] = chip_id;
+  jsonBufferRes["state"] = state;
+  jsonBufferRes["sender"] = reqSender;
+  serializeJson(jsonBufferRes, jsonMessage);
+  serializeJson(jsonBufferRes, Serial);
+  Serial.println("");
+
+  mqtt_client.publish(relay2CtrlBoxTopic, jsonMessage);
+}
+
+// Drain events from the actuation task. Only the network task may consume them.
+// Health of the relay in one message on relay2CtrlBoxTopic, so the ControlBox sees it is
+// alive between commands without scraping /api/v1/stats. Counters are totals since boot.
+void publishHeartbeat(uint32_t nextMs)
+{
+  SmallJsonDoc pooledRes;
+  if (!pooledRes)
+  {
+    return;
+  }
+  JsonDocument &jsonBufferRes = *pooledRes;
+  memset(jsonMessage, 0, sizeof(jsonMessage));
+  jsonBufferRes["action"] = "heartbeat";
+  jsonBufferRes["deviceId"] = chip_id;
+  jsonBufferRes["state"] = RelayStatus;
+  jsonBufferRes["rssi"] = WiFi.RSSI();
+  jsonBufferRes["heap"] = ESP.getFreeHeap();
+  jsonBufferRes["heap_min"] = ESP.getMinFreeHeap();
+  jsonBufferRes["heap_block"] = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  jsonBufferRes["uptime"] = (uint32_t)(esp_timer_get_time() / 1000000);
+  jsonBufferRes["next"] = nextMs / 1000; // seconds until the next heartbeat at the latest
+  jsonBufferRes["broker"] = brokers.current(); // 0: ctrlBoxIP, then the fallbacks
+  JsonObject counters = jsonBufferRes.createNestedObject("counters");
+  counters["commands"] = mqttCommandCount;
+  counters["connects"] = mqttConnectCount;
+  counters["rules"] = mRules.fired();
+  counters["pulse_edges"] = relayPulse.edges();
+  serializeJson(jsonBufferRes, jsonMessage);
+
+  mqtt_client.publish(relay2CtrlBoxTopic, jsonMessage);
+}
 
-  time_t now = time(nullptr);
-  while (now < 8 * 3600 * 2)
-  { // wait for time to be set
-    yield();
-    delay(500);
-    Serial.print(F("."));
-    now = time(nullptr);
+// Heartbeat timer. Stops while MQTT is down; connectToMQTTBroker() starts it again.
+void processHeartbeat()
+{
+  if (!mqtt_client.connected())
+  {
+    return;
   }
+  uint32_t nextMs = heartbeat.sent();
+  publishHeartbeat(nextMs);
+  networkTimers.start(timerHeartbeat, nextMs);
+}
 
-  struct tm timeinfo;
-  gmtime_r(&now, &timeinfo);
+// Network task: the relay switched or was commanded. Brings the next heartbeat forward to
+// HEARTBEAT_MIN_MS if it is further away.
+void heartbeatChanged()
+{
+  if (heartbeat.changed() && networkTimers.active(timerHeartbeat) &&
+      networkTimers.remaining(timerHeartbeat) > HEARTBEAT_MIN_MS)
+  {
+    networkTimers.start(timerHeartbeat, HEARTBEAT_MIN_MS);
+  }
 }
 
-void loop()
+void processActuationEvents()
+{
+  if (xTaskGetCurrentTaskHandle() != networkTaskHandle)
+  {
+    return;
+  }
+
+  ActuationEvent evt;
+  while (actuationEventQueue.pop(evt))
+  {
+    switch (evt.type)
+    {
+    case ACTEVENT_AUTO_OFF:
+    case ACTEVENT_PULSE_STEP:
+      loopProfileBranch(LOOP_BRANCH_AUTO_OFF);
+      heartbeatChanged();
+      Serial.printf("Pulse switched relay %s\n", evt.state == RELAYSTATUS_ON ? "on" : "off");
+      if (mqtt_client.connected())
+      {
+        publishRelayStatus("updateByAccessControl", evt.state);
+      }
+      break;
+    case ACTEVENT_RULE:
+      loopProfileBranch(LOOP_BRANCH_RULE);
+      heartbeatChanged();
+      strlcpy(reqSender, "rule", sizeof(reqSender));
+      if (mqtt_client.connected())
+      {
+        publishRelayStatus("rule", evt.state);
+      }
+      break;
+    case ACTEVENT_STATUS_REPORT:
+      ESP_LOGI(TAG, "Reset button: WRMStatus %d, relay %s, MQTT %s", WRMStatus,
+               evt.state == RELAYSTATUS_ON ? "on" : "off", mqtt_client.connected() ? "connected" : "disconnected");
+      strlcpy(reqSender, "button", sizeof(reqSender));
+      if (mqtt_client.connected())
+      {
+        publishRelayStatus("button", evt.state);
+      }
+      break;
+    case ACTEVENT_FACTORY_RESET:
+      processFormatWRMEEPROM();
+      delay(1000);
+      rebootEspWithReason("Rebooting due to reset button pressed");
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+// Relay level last known to the network task: switched by a command or reported by an event.
+int mReportedRelayStatus = RELAYSTATUS_OFF;
+uint32_t mSeenPulseEdges = 0;
+uint32_t mSeenPulseStarts = 0;
+uint32_t mSeenRuleFires = 0;
+
+void applyRelayCommand(const RelayCommand &cmd)
+{
+  if (cmd.type == RELAYCMD_PULSE && cmd.pulse.steps)
+  {
+    relayPulse.start(cmd.state, cmd.pulse);
+  }
+  else
+  {
+    relayPulse.set(cmd.state);
+  }
+  mReportedRelayStatus = cmd.state;
+  mSeenPulseEdges = relayPulse.edges();
+  mSeenRuleFires = mRules.fired();
+}
+
+// Reports relay changes made by relayPulse and the local rules since the last call. Both
+// switch the relay themselves; only the event, and so the status publish, waits for this task.
+void processRelayEdges()
+{
+  uint32_t starts = relayPulse.starts();
+  if (starts != mSeenPulseStarts)
+  {
+    // A scheduled command switched the relay; it was reported when it was queued.
+    mSeenPulseStarts = starts;
+    mReportedRelayStatus = relayPulse.startState();
+  }
+  uint32_t edges = relayPulse.edges();
+  uint32_t fires = mRules.fired();
+  if (edges == mSeenPulseEdges && fires == mSeenRuleFires)
+  {
+    return;
+  }
+  int state = RelayStatus;
+  if (state != mReportedRelayStatus)
+  {
+    uint8_t type = (fires != mSeenRuleFires) ? ACTEVENT_RULE
+                   : relayPulse.running()    ? ACTEVENT_PULSE_STEP
+                                             : ACTEVENT_AUTO_OFF;
+    ActuationEvent evt = {type, (uint8_t)state};
+    if (!pushActuationEvent(evt))
+    {
+      actuationTimers.start(timerEventRetry, EVENT_RETRY_MS);
+      return;
+    }
+    mReportedRelayStatus = state;
+  }
+  mSeenPulseEdges = edges;
+  mSeenRuleFires = fires;
+}
+
+// Queues events for whatever the interrupt and timer callbacks changed since the last call.
+// timerEventRetry runs it again when the event queue was full.
+void processActuationChanges()
 {
-  // put your main code here, to run repeatedly:
-  processStatusLED();
+  processRelayEdges();
   processResetBtn();
+}
+
+// Relay, status LED and reset button. Wakes on a relay command, a pulse edge, a rule, a
+// button press, a WRMStatus change or its next timer. Scheduled relay commands are switched
+// by relayPulse's esp_timer at their due time.
+void actuationTask(void *arg)
+{
+  actuationTimers.begin();
+  timerEventRetry = actuationTimers.add(processActuationChanges);
 
-  if (millis() - mLastWSCleanupTime > WS_CLEANUP_INTERVAL)
+  for (;;)
   {
-    ws.cleanupClients();
-    mLastWSCleanupTime = millis();
+    RelayCommand cmd;
+    while (relayCommandQueue.pop(cmd))
+    {
+      if (cmd.dueUs > esp_timer_get_time())
+      {
+        // Only the latest scheduled command is kept.
+        PulsePlan plan = cmd.type == RELAYCMD_PULSE ? cmd.pulse : PulsePlan{};
+        relayPulse.startAt(cmd.dueUs, cmd.state, plan);
+      }
+      else
+      {
+        // A command issued after a scheduled one supersedes it.
+        relayPulse.cancelStart();
+        applyRelayCommand(cmd);
+      }
+    }
+
+    processActuationChanges();
+    if (WRMStatus != mStatusLEDShown)
+    {
+      processStatusLED();
+    }
+
+    ulTaskNotifyTake(pdTRUE, timerWaitTicks(actuationTimers.run()));
   }
-  // try to connect to WiFi again if it is disconnected.
-  if ((mWifiMode != AP_MODE) && (WiFi.status() != WL_CONNECTED))
+}
+
+// Schedule timer, on every second of the SNTP clock. Switches the relay for due schedule
+// entries; runs without a broker and reports the change as a "schedule" status when connected.
+void processSchedule()
+{
+  networkTimers.start(timerSchedule, clockMsToNextSecond());
+  scheduleRun(clockEpoch(), [](const ScheduleEntry &entry)
+              {
+    loopProfileBranch(LOOP_BRANCH_SCHEDULE);
+    strlcpy(reqSender, "schedule", sizeof(reqSender));
+    RelayCommand relayCmd = {};
+    relayCmd.type = entry.autoOff ? RELAYCMD_PULSE : RELAYCMD_SET;
+    relayCmd.state = entry.state ? RELAYSTATUS_ON : RELAYSTATUS_OFF;
+    relayCmd.pulse = {1, {RELAY_PULSE_DEFAULT_MS}};
+    if (sendRelayCommand(relayCmd) && mqtt_client.connected())
+    {
+      publishRelayStatus("schedule", relayCmd.state);
+    } });
+}
+
+void processWSCleanup()
+{
+  loopProfileBranch(LOOP_BRANCH_WS_CLEANUP);
+  ws.cleanupClients();
+}
+
+// Every RE_CONN_WIFI_DELAY: try to connect to WiFi again if it is disconnected.
+void processWifiReconnect()
+{
+  if ((mWifiMode == AP_MODE) || (WiFi.status() == WL_CONNECTED))
+  {
+    return;
+  }
+  ESP_LOGI(TAG, "WiFi not connected, try to reconnect ...");
+  loopProfileBranch(LOOP_BRANCH_WIFI_RECONNECT);
+  tryToConnectWifi();
+}
+
+// Armed while WiFi is down: if we cannot connect to WiFi for 1h, we restart the system.
+void processNoConnRestart()
+{
+  rebootEspWithReason("Rebooting due to no WiFi connection for over 1 hour");
+}
+
+BrokerProbe brokerProbe;
+
+// Every BROKER_FALLBACK_CHECK_MS: while connected to a fallback broker, probe the preferred
+// one and move back to it as soon as it accepts connections again. The probe connects in
+// the background; the timer looks at it every BROKER_PROBE_POLL_MS until it is answered.
+void processBrokerFallback()
+{
+  uint8_t probe = brokerProbe.poll();
+  if (!mqtt_client.connected() || brokers.current() <= 0)
+  {
+    brokerProbe.stop();
+    return;
+  }
+  if (probe == PROBE_IDLE)
+  {
+    if (!brokers.ready(0))
+    {
+      return;
+    }
+    uint16_t port = (eeprom_mqtt_flags & MQTTFLAG_TLS) ? MQTT_BROKER_TLS_PORT : MQTT_BROKER_PORT;
+    brokerProbe.start(brokers.host(0), port);
+    probe = brokerProbe.poll();
+  }
+  if (probe == PROBE_PENDING)
+  {
+    networkTimers.start(timerBrokerFallback, BROKER_PROBE_POLL_MS, BROKER_FALLBACK_CHECK_MS);
+    return;
+  }
+  brokerProbe.stop();
+  if (probe != PROBE_UP)
+  {
+    brokers.failed(0);
+    return;
+  }
+  ESP_LOGI(TAG, "Preferred MQTT broker %s is back, leaving %s", brokers.host(0), brokers.host(brokers.current()));
+  brokers.reachable(0);
+  brokers.disconnected();
+  mqtt_client.disconnect();
+  setWRMStatus(WRMSTATUS_CONNECT_CTRLBOX);
+}
+
+// Every HEAP_WATCHDOG_INTERVAL_MS. A fragmented heap is restarted cleanly, preferably while
+// the relay is off and idle, instead of crashing on a failed allocation later.
+void processHeapWatchdog()
+{
+  bool quiet = RelayStatus == RELAYSTATUS_OFF && !relayPulse.running();
+  HEAPWD state = heapWatchdogCheck(quiet);
+  if (state == HEAPWD_OK)
+  {
+    return;
+  }
+  ESP_LOGI(TAG, "Heap degraded: largest block %u, fragmentation %u%%%s", (unsigned)mHeapWatchdog.largest(),
+           (unsigned)mHeapWatchdog.fragmentation(), state == HEAPWD_RESTART ? ", restarting" : "");
+  if (state != HEAPWD_RESTART)
+  {
+    return;
+  }
+  if (mqtt_client.connected())
+  {
+    strlcpy(reqSender, "heap", sizeof(reqSender));
+    publishRelayStatus("restart", RelayStatus);
+    mqtt_client.disconnect();
+  }
+  rebootEspWithReason("Rebooting due to heap fragmentation");
+}
+
+void processDeferredInit()
+{
+  if (!mDeferredInitDone)
+  {
+    loopProfileBranch(LOOP_BRANCH_DEFERRED_INIT);
+    startDeferredServices();
+  }
+}
+
+// A WiFi scan still has to be polled. Otherwise the network task sleeps until a timer or a
+// notification; MQTT data wakes it through mqttWatchTask.
+bool networkNeedsPolling()
+{
+  return scanCache.scanning || scanCache.requested;
+}
+
+volatile bool mqttWatchArmed = false;
+volatile int mqttWatchFd = -1;
+
+// Blocks in select() on the MQTT socket and wakes the network task when data, EOF or an
+// error arrives, then waits to be armed again by mqttWatchArm().
+void mqttWatchTask(void *arg)
+{
+  for (;;)
   {
-    if (millis() - mLastReConnTime > RE_CONN_WIFI_DELAY)
-    { // 10 seconds
-      ESP_LOGI(TAG, "WiFi not connected, try to reconnect ...");
-      mLastReConnTime = millis();
-      if (tryToConnectWifi() == true)
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    while (mqttWatchArmed)
+    {
+      int fd = mqttWatchFd;
+      if (fd < 0)
       {
-        mLastConnTime = millis();
+        mqttWatchArmed = false;
+        break;
+      }
+      fd_set readable;
+      FD_ZERO(&readable);
+      FD_SET(fd, &readable);
+      struct timeval timeout = {MQTT_WATCH_POLL_MS / 1000, (MQTT_WATCH_POLL_MS % 1000) * 1000};
+      if (select(fd + 1, &readable, NULL, NULL, &timeout) != 0)
+      {
+        // loop() finds out which it was.
+        mqttWatchArmed = false;
+        xTaskNotifyGive(networkTaskHandle);
       }
     }
-    // If we cannot connect to WiFi after 1h, we restart the system.
-    if (millis() - mLastConnTime > NO_CONN_RESTART_DELAY)
+  }
+}
+
+// Network task, after loop() read what was there: wake on the next data on fd.
+void mqttWatchArm(int fd)
+{
+  mqttWatchFd = fd;
+  if (!mqttWatchArmed)
+  {
+    mqttWatchArmed = true;
+    xTaskNotifyGive(mqttWatchTaskHandle);
+  }
+}
+
+// One pass of the network task. Returns the ms until its next timer, or until the next MQTT
+// connect attempt while connecting to the ControlBox.
+uint32_t networkLoop()
+{
+  LoopProfileScope profile;
+  uint32_t wait = TIMERS_FOREVER;
+
+  processActuationEvents();
+  processDeviceCommands();
+  networkTimers.run();
+
+  if (scanCache.scanning || scanCache.requested)
+  {
+    loopProfileBranch(LOOP_BRANCH_SCAN);
+  }
+  processScanCache();
+
+  if ((mWifiMode != AP_MODE) && (WiFi.status() != WL_CONNECTED))
+  {
+    if (!networkTimers.active(timerNoConnRestart))
     {
-      rebootEspWithReason("Rebooting due to no WiFi connection for over 1 hour");
+      networkTimers.start(timerNoConnRestart, NO_CONN_RESTART_DELAY);
     }
   }
   else if ((WRMStatus == WRMSTATUS_JOIN_AP) && (WiFi.status() == WL_CONNECTED))
   {
-    WRMStatus = WRMSTATUS_PAIRING;
+    setWRMStatus(WRMSTATUS_PAIRING);
     ESP_LOGI(TAG, "WRMStatus transition from JOIN_AP to PAIRING");
   }
 
   if (WiFi.status() == WL_CONNECTED)
   {
-    mLastConnTime = millis();
+    networkTimers.stop(timerNoConnRestart);
     if (WRMStatus == WRMSTATUS_PAIRING)
     {
-      WRMStatus = WRMSTATUS_CONNECT_CTRLBOX;
+      setWRMStatus(WRMSTATUS_CONNECT_CTRLBOX);
       EEPROM.readString(EEPROM_OFFSET_CTRLBOX_IP, eeprom_ctrlbox_ipaddr, EEPROM_CTRLBOX_IP_SIZE);
       ESP_LOGI(TAG, "Connecting to CtrlBoxIP %s", eeprom_ctrlbox_ipaddr);
     }
@@ -1362,7 +2832,11 @@ void loop()
       // check if control box IP address is exist.
       if (strlen(eeprom_ctrlbox_ipaddr) > 0)
       {
-        connectToMQTTBroker();
+        loopProfileBranch(LOOP_BRANCH_MQTT_CONNECT);
+        if (!connectToMQTTBroker())
+        {
+          wait = min(wait, brokers.waitMs());
+        }
       }
       else
       {
@@ -1374,57 +2848,84 @@ void loop()
     {
       if (!mqtt_client.connected())
       {
-        WRMStatus = WRMSTATUS_CONNECT_CTRLBOX;
+        brokers.dropped();
+        setWRMStatus(WRMSTATUS_CONNECT_CTRLBOX);
+        wait = 0; // reconnect on the next pass
       }
       else
       {
+        loopProfileBranch(LOOP_BRANCH_MQTT_LOOP);
+        HEAP_SCOPE(HEAPTAG_MQTT);
         mqtt_client.loop(); // Listen for incoming messages
       }
+    }
+  }
+  return min(wait, networkTimers.wait());
+}
+
+// WiFi came up or went down: re-evaluate the connection state now.
+static void onWifiEvent(WiFiEvent_t event)
+{
+  if (networkTaskHandle)
+  {
+    xTaskNotifyGive(networkTaskHandle);
+  }
+}
 
-      // If 10 seconds have passed, the relay is turned off
-      if (checkAutoRelay)
+// Wi-Fi, MQTT and housekeeping. Polls every tick during a WiFi scan; otherwise sleeps until
+// the next timer, and while MQTT is connected at most half a keepalive, so loop() pings in
+// time. MQTT data (mqttWatchTask), postDeviceCommand(), actuation events and WiFi events
+// wake the task early.
+void networkTask(void *arg)
+{
+  networkTimers.begin();
+  timerWSCleanup = networkTimers.add(processWSCleanup);
+  timerWifiReconnect = networkTimers.add(processWifiReconnect);
+  timerNoConnRestart = networkTimers.add(processNoConnRestart);
+  timerDeferredInit = networkTimers.add(processDeferredInit);
+  timerSchedule = networkTimers.add(processSchedule);
+  timerHeartbeat = networkTimers.add(processHeartbeat);
+  timerBrokerFallback = networkTimers.add(processBrokerFallback);
+  timerHeapWatchdog = networkTimers.add(processHeapWatchdog);
+  networkTimers.start(timerWSCleanup, WS_CLEANUP_INTERVAL, WS_CLEANUP_INTERVAL);
+  networkTimers.start(timerWifiReconnect, RE_CONN_WIFI_DELAY, RE_CONN_WIFI_DELAY);
+  if (!mDeferredInitDone)
+  {
+    networkTimers.start(timerDeferredInit, BOOT_DEFER_TIMEOUT > millis() ? BOOT_DEFER_TIMEOUT - millis() : 0);
+  }
+  networkTimers.start(timerSchedule, 0);
+  networkTimers.start(timerBrokerFallback, BROKER_FALLBACK_CHECK_MS, BROKER_FALLBACK_CHECK_MS);
+  networkTimers.start(timerHeapWatchdog, HEAP_WATCHDOG_INTERVAL_MS, HEAP_WATCHDOG_INTERVAL_MS);
+  WiFi.onEvent(onWifiEvent, ARDUINO_EVENT_WIFI_STA_GOT_IP);
+  WiFi.onEvent(onWifiEvent, ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
+
+  for (;;)
+  {
+    uint32_t waitMs = networkLoop();
+    if (mqtt_client.connected())
+    {
+      // loop() reads one packet per pass; the rest, or a record TLS has decrypted already,
+      // does not show on the socket.
+      waitMs = mqttTransport.available() ? 0 : min(waitMs, (uint32_t)mqttKeepAliveS * 500);
+      if (waitMs)
       {
-        if ((millis() - lastDebounceTime_Relay) > debounceDelay_Relay && RelayStatus == RELAYSTATUS_ON)
-        {
-          checkAutoRelay = false;
-          digitalWrite(RELAY_CTRL_PIN, LOW);
-          RelayStatus = RELAYSTATUS_OFF;
-
-          Serial.println("ON after 10 seconds");
-          // Respond to the client
-          StaticJsonDocument<200> jsonBufferRes;
-
-          memset(jsonMessage, 0, sizeof(jsonMessage));
-          jsonBufferRes.clear();
-          jsonBufferRes["action"] = "status";
-          jsonBufferRes["command"] = "updateByAccessControl";
-          jsonBufferRes["deviceId"] = chip_id;
-          jsonBufferRes["state"] = RelayStatus;
-          jsonBufferRes["sender"] = reqSender;
-          serializeJson(jsonBufferRes, jsonMessage);
-          serializeJson(jsonBufferRes, Serial);
-          Serial.println("");
-
-          mqtt_client.publish(relay2CtrlBoxTopic, jsonMessage);
-        }
+        mqttWatchArm(mqttTransportTls ? tlsClient.fd() : client.fd());
       }
     }
+    TickType_t wait = timerWaitTicks(waitMs);
+    ulTaskNotifyTake(pdTRUE, networkNeedsPolling() ? min(wait, (TickType_t)1) : wait);
   }
 }
 
-void notifyClients(String message)
+void loop()
 {
-  if (!ws.availableForWriteAll())
-  {
-    Serial.println("No clients available for WebSocket write");
-    return;
-  }
-  Serial.println("Notifying clients: " + message);
-  ws.textAll(message);
+  // All work is done by networkTask and actuationTask.
+  vTaskDelete(NULL);
 }
 
 void notifyToClient(const char *message, size_t len)
 {
+  HEAP_SCOPE(HEAPTAG_WS);
   if (!ws.availableForWriteAll())
   {
     Serial.println("No clients available for WebSocket write");
@@ -1439,14 +2940,14 @@ void handleWebSocketMessage(void *arg, uint8_t *data, size_t len)
   AwsFrameInfo *info = (AwsFrameInfo *)arg;
   if (info->final && info->index == 0 && info->len == len && info->opcode == WS_TEXT)
   {
-    data[len] = 0;
-    String message = (char *)data;
-    notifyClients(message);
+    // Echoed to every client straight from the frame buffer.
+    notifyToClient((const char *)data, len);
   }
 }
 
 void onEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)
 {
+  HEAP_SCOPE(HEAPTAG_WS);
   switch (type)
   {
   case WS_EVT_CONNECT:
@@ -1468,12 +2969,7 @@ void onEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType
 
 String getDateTimeString()
 {
-  struct tm timeinfo;
-  if (!getLocalTime(&timeinfo))
-  {
-    return "0000-00-00 00:00:00";
-  }
-  char buffer[20];
-  strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &timeinfo);
+  char buffer[DATETIME_STRING_SIZE];
+  clockFormat(buffer, sizeof(buffer));
   return String(buffer);
 }
\ No newline at end of file
@@ -0,0 +1,79 @@
+// Host test of the request arena: pio test -e native
+#include <string.h>
+#include <unity.h>
+#include "VMXArena.h"
+
+static BumpArena arena;
+
+void setUp()
+{
+  arena = BumpArena();
+}
+
+void tearDown() {}
+
+void test_alloc_rounds_to_four_bytes()
+{
+  char *a = arena.alloc(1);
+  char *b = arena.alloc(3);
+  char *c = arena.alloc(5);
+  char *d = arena.alloc(4);
+  TEST_ASSERT_NOT_NULL(a);
+  TEST_ASSERT_EQUAL(4, b - a);
+  TEST_ASSERT_EQUAL(8, c - a);
+  TEST_ASSERT_EQUAL(16, d - a);
+  TEST_ASSERT_EQUAL(20, arena.highWater());
+}
+
+void test_reset_reuses_the_buffer()
+{
+  char *first = arena.alloc(100);
+  arena.alloc(200);
+  arena.reset();
+  TEST_ASSERT_EQUAL_PTR(first, arena.alloc(8));
+  TEST_ASSERT_EQUAL(300, arena.highWater()); // high water survives the reset
+}
+
+void test_overflow_fails_and_counts()
+{
+  TEST_ASSERT_NOT_NULL(arena.alloc(REQUEST_ARENA_SIZE - 8));
+  TEST_ASSERT_NULL(arena.alloc(16));
+  TEST_ASSERT_EQUAL(1, arena.failures());
+  TEST_ASSERT_NOT_NULL(arena.alloc(8)); // what is left is still handed out
+  TEST_ASSERT_NULL(arena.alloc(1));
+  TEST_ASSERT_EQUAL(2, arena.failures());
+  arena.reset();
+  TEST_ASSERT_NULL(arena.alloc(REQUEST_ARENA_SIZE + 1));
+  TEST_ASSERT_NOT_NULL(arena.alloc(REQUEST_ARENA_SIZE));
+  TEST_ASSERT_EQUAL(3, arena.failures());
+}
+
+void test_printf_and_strdup()
+{
+  const char *s = arena.printf("ClientID=%s; Max-Age=%d", "abc", 3600);
+  TEST_ASSERT_EQUAL_STRING("ClientID=abc; Max-Age=3600", s);
+  const char *d = arena.strdup(s);
+  TEST_ASSERT_EQUAL_STRING(s, d);
+  TEST_ASSERT_TRUE(d != s);
+  TEST_ASSERT_EQUAL(0, arena.failures());
+}
+
+void test_printf_overflow_returns_empty()
+{
+  arena.alloc(REQUEST_ARENA_SIZE - 8);
+  const char *s = arena.printf("%s", "longer than eight bytes");
+  TEST_ASSERT_EQUAL_STRING("", s);
+  TEST_ASSERT_EQUAL(1, arena.failures());
+  TEST_ASSERT_EQUAL_STRING("short", arena.printf("short")); // 6 bytes still fit
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_alloc_rounds_to_four_bytes);
+  RUN_TEST(test_reset_reuses_the_buffer);
+  RUN_TEST(test_overflow_fails_and_counts);
+  RUN_TEST(test_printf_and_strdup);
+  RUN_TEST(test_printf_overflow_returns_empty);
+  return UNITY_END();
+}
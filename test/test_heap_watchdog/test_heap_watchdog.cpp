@@ -0,0 +1,124 @@
+// Host test of the heap watchdog decision: pio test -e native
+#include <unity.h>
+#include "VMXHeapWatchdog.h"
+
+#define HEALTHY_FREE 100000
+#define HEALTHY_BLOCK 60000
+
+static HeapWatchdog watchdog;
+
+void setUp()
+{
+  watchdog = HeapWatchdog();
+}
+
+void tearDown() {}
+
+// checks - 1 bad samples: degraded, not yet a restart.
+static void sampleBad(uint32_t largest, bool quiet, uint32_t nowMs)
+{
+  for (int i = 0; i < HEAP_WATCHDOG_CHECKS - 1; i++)
+  {
+    TEST_ASSERT_EQUAL(HEAPWD_DEGRADED, watchdog.check(quiet, HEALTHY_FREE, largest, nowMs));
+  }
+}
+
+void test_healthy_heap_is_ok()
+{
+  TEST_ASSERT_EQUAL(HEAPWD_OK, watchdog.check(false, HEALTHY_FREE, HEALTHY_BLOCK, 0));
+  TEST_ASSERT_EQUAL(40, watchdog.fragmentation());
+  TEST_ASSERT_EQUAL(0, watchdog.badChecks());
+}
+
+void test_restart_waits_for_enough_bad_samples()
+{
+  sampleBad(HEAP_WATCHDOG_MIN_BLOCK - 1, true, 0);
+  TEST_ASSERT_EQUAL(HEAPWD_RESTART, watchdog.check(true, HEALTHY_FREE, HEAP_WATCHDOG_MIN_BLOCK - 1, 0));
+}
+
+void test_good_sample_clears_the_count()
+{
+  sampleBad(HEAP_WATCHDOG_MIN_BLOCK - 1, true, 0);
+  TEST_ASSERT_EQUAL(HEAPWD_OK, watchdog.check(true, HEALTHY_FREE, HEALTHY_BLOCK, 0));
+  TEST_ASSERT_EQUAL(HEAPWD_DEGRADED, watchdog.check(true, HEALTHY_FREE, HEAP_WATCHDOG_MIN_BLOCK - 1, 0));
+}
+
+void test_fragmentation_alone_is_bad()
+{
+  // The largest block is big enough, but holds only 10 % of the free heap.
+  uint32_t largest = HEAP_WATCHDOG_MIN_BLOCK * 2;
+  uint32_t freeBytes = largest * 10;
+  for (int i = 0; i < HEAP_WATCHDOG_CHECKS - 1; i++)
+  {
+    TEST_ASSERT_EQUAL(HEAPWD_DEGRADED, watchdog.check(true, freeBytes, largest, 0));
+  }
+  TEST_ASSERT_EQUAL(HEAPWD_RESTART, watchdog.check(true, freeBytes, largest, 0));
+  TEST_ASSERT_EQUAL(90, watchdog.fragmentation());
+}
+
+void test_busy_relay_defers_until_max_defer()
+{
+  uint32_t largest = HEAP_WATCHDOG_MIN_BLOCK - 1;
+  sampleBad(largest, false, 1000);
+  TEST_ASSERT_EQUAL(HEAPWD_DEGRADED, watchdog.check(false, HEALTHY_FREE, largest, 1000));
+  TEST_ASSERT_EQUAL(HEAPWD_DEGRADED, watchdog.check(false, HEALTHY_FREE, largest, 1000 + HEAP_WATCHDOG_MAX_DEFER_MS - 1));
+  TEST_ASSERT_EQUAL(HEAPWD_RESTART, watchdog.check(false, HEALTHY_FREE, largest, 1000 + HEAP_WATCHDOG_MAX_DEFER_MS));
+}
+
+void test_quiet_moment_ends_the_deferral()
+{
+  uint32_t largest = HEAP_WATCHDOG_MIN_BLOCK - 1;
+  sampleBad(largest, false, 0);
+  TEST_ASSERT_EQUAL(HEAPWD_DEGRADED, watchdog.check(false, HEALTHY_FREE, largest, 0));
+  TEST_ASSERT_EQUAL(HEAPWD_RESTART, watchdog.check(true, HEALTHY_FREE, largest, 60000));
+}
+
+void test_critical_block_does_not_wait()
+{
+  uint32_t largest = HEAP_WATCHDOG_CRITICAL_BLOCK - 1;
+  sampleBad(largest, false, 0);
+  TEST_ASSERT_EQUAL(HEAPWD_RESTART, watchdog.check(false, HEALTHY_FREE, largest, 0));
+}
+
+void test_deferral_survives_millis_wrap()
+{
+  uint32_t largest = HEAP_WATCHDOG_MIN_BLOCK - 1;
+  uint32_t start = UINT32_MAX - 1000;
+  sampleBad(largest, false, start);
+  TEST_ASSERT_EQUAL(HEAPWD_DEGRADED, watchdog.check(false, HEALTHY_FREE, largest, start));
+  TEST_ASSERT_EQUAL(HEAPWD_DEGRADED, watchdog.check(false, HEALTHY_FREE, largest, start + 2000));
+  TEST_ASSERT_EQUAL(HEAPWD_RESTART, watchdog.check(false, HEALTHY_FREE, largest, start + HEAP_WATCHDOG_MAX_DEFER_MS));
+}
+
+void test_disabled_never_restarts()
+{
+  HeapWatchdogConfig config = heapWatchdogDefaults;
+  config.enabled = false;
+  watchdog.configure(config);
+  for (int i = 0; i < HEAP_WATCHDOG_CHECKS * 2; i++)
+  {
+    TEST_ASSERT_EQUAL(HEAPWD_OK, watchdog.check(true, HEALTHY_FREE, 0, 0));
+  }
+}
+
+void test_empty_heap_is_not_fragmented()
+{
+  TEST_ASSERT_EQUAL(HEAPWD_DEGRADED, watchdog.check(false, 0, 0, 0));
+  TEST_ASSERT_EQUAL(0, watchdog.fragmentation());
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_healthy_heap_is_ok);
+  RUN_TEST(test_restart_waits_for_enough_bad_samples);
+  RUN_TEST(test_good_sample_clears_the_count);
+  RUN_TEST(test_fragmentation_alone_is_bad);
+  RUN_TEST(test_busy_relay_defers_until_max_defer);
+  RUN_TEST(test_quiet_moment_ends_the_deferral);
+  RUN_TEST(test_critical_block_does_not_wait);
+  RUN_TEST(test_deferral_survives_millis_wrap);
+  RUN_TEST(test_disabled_never_restarts);
+  RUN_TEST(test_empty_heap_is_not_fragmented);
+  return UNITY_END();
+}
@@ -0,0 +1,383 @@
+#!/usr/bin/env python3
+"""Site capacity simulator: many virtual relays against one broker.
+
+Runs --relays instances of the relay protocol (vmxmqtt.VirtualRelay, one MQTT
+connection and chip_id each) plus a ControlBox stand-in that publishes relay
+commands. Optional reconnect storms drop a fraction of the fleet at once and
+let it reconnect with jitter, the way a site behaves after an access point or
+power blip. With --scene group every scene is one message on a group topic
+instead of one command per relay, optionally scheduled --schedule-ms ahead.
+
+Reported:
+  * broker CPU time (in-process broker child, or --broker-pid for mosquitto)
+  * message amplification: PUBLISH deliveries seen by all clients per
+    published message and per command, and the share that reached the relay
+    the command was meant for
+  * command round trip overall and per device, loss, connect/reconnect times
+  * for group scenes: members switched and the skew between them
+
+Examples:
+    python3 tools/fleet_sim.py --relays 500 --duration 30 --rate 20
+    python3 tools/fleet_sim.py --relays 500 --duration 30 --rate 20 --topic-mode device
+    python3 tools/fleet_sim.py --relays 200 --rate 5 --fanout 10 --storm-every 10 --storm-fraction 0.5
+    python3 tools/fleet_sim.py --relays 200 --rate 20 --topic-mode device --storm-every 5 --persistent
+    python3 tools/fleet_sim.py --relays 200 --rate 5 --fanout 10 --topic-mode device --scene group --schedule-ms 200
+    python3 tools/fleet_sim.py --broker 127.0.0.1:1883 --broker-pid $(pidof mosquitto) --relays 500
+"""
+
+import argparse
+import asyncio
+import json
+import multiprocessing
+import os
+import random
+import sys
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import vmxmqtt  # noqa: E402
+
+
+def process_cpu_seconds(pid):
+    """utime + stime of a process from /proc, or None where unavailable."""
+    try:
+        with open("/proc/%d/stat" % pid) as f:
+            fields = f.read().rsplit(")", 1)[1].split()
+        return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+    except (OSError, IndexError, ValueError):
+        return None
+
+
+def _broker_main(host, port, ready, conn):
+    async def serve():
+        broker = vmxmqtt.Broker()
+        await broker.start(host, port)
+        ready.set()
+        await asyncio.get_event_loop().run_in_executor(None, conn.recv)
+        conn.send(dict(broker.stats))
+        await broker.stop()
+
+    asyncio.run(serve())
+
+
+class BrokerProcess:
+    """vmxmqtt.Broker in a child process so its CPU time is not mixed with the fleet's."""
+
+    def __init__(self, host, port):
+        self._conn, child_conn = multiprocessing.Pipe()
+        ready = multiprocessing.Event()
+        self._proc = multiprocessing.Process(target=_broker_main, args=(host, port, ready, child_conn), daemon=True)
+        self._proc.start()
+        if not ready.wait(10):
+            raise SystemExit("broker did not start")
+        self.pid = self._proc.pid
+
+    def stop(self):
+        self._conn.send("stop")
+        stats = self._conn.recv() if self._conn.poll(10) else {}
+        self._proc.join(5)
+        return stats
+
+
+def raise_fd_limit():
+    try:
+        import resource
+        soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+        resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+    except (ImportError, ValueError, OSError):
+        pass
+
+
+async def connect_relay(relay, host, port, retry_s):
+    """Connect like connectToMQTTBroker(): retry every retry_s until it works."""
+    t0 = time.perf_counter()
+    while True:
+        try:
+            await relay.start(host, port)
+            return time.perf_counter() - t0
+        except (OSError, ConnectionError, asyncio.IncompleteReadError):
+            relay.client.abort()
+            await asyncio.sleep(retry_s)
+
+
+def summary(values_s):
+    ms = sorted(v * 1000.0 for v in values_s)
+    return {"n": len(ms), "p50": vmxmqtt.percentile(ms, 50), "p99": vmxmqtt.percentile(ms, 99),
+            "p999": vmxmqtt.percentile(ms, 99.9), "max": ms[-1] if ms else float("nan")}
+
+
+async def run(args):
+    raise_fd_limit()
+    rng = random.Random(args.seed)
+    broker = None
+    broker_pid = args.broker_pid
+    if args.broker:
+        host, port = args.broker.rsplit(":", 1)
+        port = int(port)
+    else:
+        host, port = "127.0.0.1", args.port
+        broker = BrokerProcess(host, port)
+        broker_pid = broker.pid
+    cpu_start = process_cpu_seconds(broker_pid) if broker_pid else None
+
+    # ControlBox stand-in: publishes commands, collects every reply.
+    pending = {}  # sender -> (device id, t0)
+    rtts = {}     # device id -> [seconds]
+    counts = {"sent": 0, "acked": 0, "failed": 0, "nak": 0, "connect_msgs": 0, "lost": 0, "group_acks": 0}
+    scenes = {}     # group scene sender -> (members, due wall time)
+    actuated = {}   # sender -> [wall time of each switch]
+
+    def on_actuate(sender, when):
+        if sender in scenes:
+            actuated.setdefault(sender, []).append(when)
+
+    def on_reply(topic, payload):
+        try:
+            msg = json.loads(payload)
+        except ValueError:
+            return
+        if msg.get("command") == "connect":
+            counts["connect_msgs"] += 1
+            return
+        if msg.get("group"):
+            counts["group_acks"] += 1
+            return
+        if msg.get("result") == "device id invalid":
+            counts["nak"] += 1
+            return
+        entry = pending.pop(msg.get("sender"), None)
+        if entry is None:
+            return
+        device_id, t0 = entry
+        rtts.setdefault(device_id, []).append(time.perf_counter() - t0)
+        counts["acked"] += 1
+        if msg.get("result") != "success":
+            counts["failed"] += 1
+
+    ctrlbox = vmxmqtt.Client("fleetsim-ctrlbox-%04x" % (os.getpid() & 0xFFFF), on_reply)
+    await ctrlbox.connect(host, port)
+    await ctrlbox.subscribe(vmxmqtt.RELAY_TO_CTRLBOX)
+
+    # Group scenes partition the fleet into groups of --fanout relays: g0, g1, ...
+    group_of = (lambda i: ["g%d" % (i // args.fanout)]) if args.scene == "group" else (lambda i: [])
+    relays = [vmxmqtt.VirtualRelay("%012X" % (0x3C6105000000 + i), args.ack_delay_ms, args.ack_jitter_ms,
+                                   args.ack_loss, random.Random(rng.random()), args.topic_mode,
+                                   group_of(i), on_actuate, args.persistent)
+              for i in range(args.relays)]
+    ids = [r.device_id for r in relays]
+    groups = {}
+    for relay in relays:
+        for group in relay.groups:
+            groups.setdefault(group, []).append(relay.device_id)
+    group_names = sorted(groups)
+
+    # Initial connect: the whole site coming up at once is the first storm.
+    t0 = time.perf_counter()
+    sem = asyncio.Semaphore(args.connect_concurrency)
+
+    async def initial(relay):
+        async with sem:
+            return await connect_relay(relay, host, port, args.retry_s)
+
+    connect_times = await asyncio.gather(*(initial(r) for r in relays))
+    fleet_up_s = time.perf_counter() - t0
+    print("%d relays connected in %.2f s" % (len(relays), fleet_up_s))
+
+    reconnect_times = []
+    storms = [0]
+    resumed = [0]
+    lossy_devices = set()
+    stop = asyncio.Event()
+
+    async def storm_loop():
+        while not stop.is_set():
+            try:
+                await asyncio.wait_for(stop.wait(), args.storm_every)
+                return
+            except asyncio.TimeoutError:
+                pass
+            victims = rng.sample(relays, max(1, int(len(relays) * args.storm_fraction)))
+            storms[0] += 1
+            for relay in victims:
+                relay.client.abort()
+
+            async def rejoin(relay):
+                await asyncio.sleep(rng.uniform(0, args.storm_jitter))
+                reconnect_times.append(await connect_relay(relay, host, port, args.retry_s))
+                resumed[0] += relay.session_present
+
+            await asyncio.gather(*(rejoin(r) for r in victims))
+
+    async def expire(sender):
+        await asyncio.sleep(args.timeout)
+        entry = pending.pop(sender, None)
+        if entry is not None:
+            counts["lost"] += 1
+            lossy_devices.add(entry[0])
+
+    qos = 1 if args.persistent else 0
+
+    async def command_loop():
+        timers = []
+        seq = 0
+        start = time.perf_counter()
+        interval = 1.0 / args.rate
+        scene = 0
+        while time.perf_counter() - start < args.duration:
+            if args.scene == "group":
+                group = rng.choice(group_names)
+                sender = "fs%d" % seq
+                seq += 1
+                due = time.time() + args.schedule_ms / 1000.0
+                cmd = {"action": "control", "command": "update", "state": seq & 1, "sender": sender,
+                       "ack": args.group_ack}
+                if args.schedule_ms:
+                    cmd["at"] = int(due * 1000)
+                scenes[sender] = (len(groups[group]), due)
+                ctrlbox.publish(vmxmqtt.group_topic(group), json.dumps(cmd, separators=(",", ":")), qos)
+                counts["sent"] += 1
+            else:
+                # One scene switches --fanout distinct relays with one message per relay.
+                for device_id in rng.sample(ids, min(args.fanout, len(ids))):
+                    sender = "fs%d" % seq
+                    seq += 1
+                    cmd = {"action": "control", "command": "update", "deviceId": device_id,
+                           "state": seq & 1, "sender": sender}
+                    pending[sender] = (device_id, time.perf_counter())
+                    ctrlbox.publish(vmxmqtt.command_topic(device_id, args.topic_mode),
+                                    json.dumps(cmd, separators=(",", ":")), qos)
+                    counts["sent"] += 1
+                    timers.append(asyncio.ensure_future(expire(sender)))
+            await ctrlbox.drain()
+            scene += 1
+            delay = start + scene * interval - time.perf_counter()
+            if delay > 0:
+                await asyncio.sleep(delay)
+        await asyncio.gather(*timers)
+
+    storm_task = asyncio.ensure_future(storm_loop()) if args.storm_every else None
+    await command_loop()
+    if scenes:
+        await asyncio.sleep(args.schedule_ms / 1000.0 + 0.5)
+    stop.set()
+    if storm_task:
+        await storm_task
+
+    cpu_end = process_cpu_seconds(broker_pid) if broker_pid else None
+    await ctrlbox.close()
+    for relay in relays:
+        await relay.client.close()
+    broker_stats = broker.stop() if broker else None
+
+    clients = [r.client for r in relays] + [ctrlbox]
+    published = sum(c.published for c in clients)
+    delivered = sum(c.received for c in clients)
+    to_target = sum(r.commands for r in relays)
+    per_device_p99 = sorted((vmxmqtt.percentile(sorted(v), 99) * 1000.0, d) for d, v in rtts.items())
+    all_rtts = [x for v in rtts.values() for x in v]
+
+    report = {
+        "relays": len(relays),
+        "topic_mode": args.topic_mode,
+        "duration_s": args.duration,
+        "storms": storms[0],
+        "fleet_connect_s": fleet_up_s,
+        "connect_ms": summary(connect_times),
+        "reconnect_ms": summary(reconnect_times),
+        "sessions_resumed": resumed[0],
+        "commands": counts,
+        "loss_pct": 100.0 * counts["lost"] / counts["sent"] if counts["sent"] else 0.0,
+        "rtt_ms": summary(all_rtts),
+        "per_device_p99_ms": {
+            "median": vmxmqtt.percentile([p for p, _ in per_device_p99], 50),
+            "worst": per_device_p99[-1][0] if per_device_p99 else float("nan"),
+            "worst_device": per_device_p99[-1][1] if per_device_p99 else None,
+            "devices_with_loss": len(lossy_devices),
+        },
+        "amplification": {
+            "published": published,
+            "delivered": delivered,
+            "deliveries_per_publish": delivered / published if published else 0.0,
+            "deliveries_per_command": delivered / counts["sent"] if counts["sent"] else 0.0,
+            "useful_pct": 100.0 * to_target / delivered if delivered else 0.0,
+        },
+    }
+    if scenes:
+        expected = sum(n for n, _ in scenes.values())
+        switched = sum(len(actuated.get(sender, ())) for sender in scenes)
+        skews = [max(t) - min(t) for t in actuated.values() if len(t) > 1]
+        late = [max(t) - scenes[sender][1] for sender, t in actuated.items()]
+        report["group_scenes"] = {"scenes": len(scenes), "members_expected": expected, "members_switched": switched,
+                                  "skew_ms": summary(skews), "last_member_after_due_ms": summary(late)}
+    if cpu_start is not None and cpu_end is not None:
+        cpu = cpu_end - cpu_start
+        report["broker_cpu"] = {"seconds": cpu, "ms_per_command": 1000.0 * cpu / counts["sent"] if counts["sent"] else 0.0}
+    if broker_stats:
+        report["broker"] = broker_stats
+
+    if args.json:
+        print(json.dumps(report, indent=2))
+        return 0
+    c = report["commands"]
+    print("commands sent %d  acked %d  failed %d  lost %d (%.2f%%)  nak %d  connect msgs %d"
+          % (c["sent"], c["acked"], c["failed"], c["lost"], report["loss_pct"], c["nak"], c["connect_msgs"]))
+    if report["rtt_ms"]["n"]:
+        print("rtt ms        p50 %(p50).2f  p99 %(p99).2f  p999 %(p999).2f  max %(max).2f" % report["rtt_ms"])
+        pd = report["per_device_p99_ms"]
+        print("per-device p99 ms  median %.2f  worst %.2f (%s)  devices with loss %d"
+              % (pd["median"], pd["worst"], pd["worst_device"], pd["devices_with_loss"]))
+    print("connect ms    p50 %(p50).2f  p99 %(p99).2f  max %(max).2f" % report["connect_ms"])
+    if reconnect_times:
+        print("reconnect ms  p50 %(p50).2f  p99 %(p99).2f  max %(max).2f  (%(n)d over " % report["reconnect_ms"]
+              + "%d storms, %d sessions resumed)" % (storms[0], resumed[0]))
+    if "group_scenes" in report:
+        g = report["group_scenes"]
+        print("group scenes  %d  members switched %d of %d  group acks %d"
+              % (g["scenes"], g["members_switched"], g["members_expected"], c["group_acks"]))
+        print("scene skew ms p50 %(p50).2f  p99 %(p99).2f  max %(max).2f" % g["skew_ms"])
+        print("last member after due ms  p50 %(p50).2f  p99 %(p99).2f  max %(max).2f" % g["last_member_after_due_ms"])
+    a = report["amplification"]
+    print("amplification %.1f deliveries/publish, %.1f deliveries/command, %.2f%% reached the target relay"
+          % (a["deliveries_per_publish"], a["deliveries_per_command"], a["useful_pct"]))
+    if "broker_cpu" in report:
+        print("broker cpu    %.2f s  (%.3f ms/command)" % (report["broker_cpu"]["seconds"],
+                                                         report["broker_cpu"]["ms_per_command"]))
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--broker", help="external broker HOST:PORT (default: in-process broker child)")
+    parser.add_argument("--broker-pid", type=int, help="PID of the external broker, for CPU accounting")
+    parser.add_argument("--port", type=int, default=18831, help="port of the in-process broker")
+    parser.add_argument("--relays", type=int, default=100)
+    parser.add_argument("--topic-mode", default="legacy", choices=vmxmqtt.TOPIC_MODES,
+                        help="relay subscriptions; commands go to the device topic unless legacy")
+    parser.add_argument("--duration", type=float, default=10.0, help="seconds of command traffic")
+    parser.add_argument("--rate", type=float, default=10.0, help="scenes per second")
+    parser.add_argument("--fanout", type=int, default=1, help="relays switched per scene (group size)")
+    parser.add_argument("--scene", default="device", choices=["device", "group"],
+                        help="one command per relay, or one message on a group topic")
+    parser.add_argument("--schedule-ms", type=float, default=0.0, help="group scenes: switch this far ahead (\"at\")")
+    parser.add_argument("--group-ack", default="none", choices=["none", "each"], help="group scenes: reply policy")
+    parser.add_argument("--ack-delay-ms", type=float, default=2.0, help="relay processing time before the reply")
+    parser.add_argument("--ack-jitter-ms", type=float, default=3.0, help="uniform extra reply delay")
+    parser.add_argument("--ack-loss", type=float, default=0.0, help="probability a relay drops a command")
+    parser.add_argument("--storm-every", type=float, default=0.0, help="seconds between reconnect storms (0 = none)")
+    parser.add_argument("--storm-fraction", type=float, default=0.3, help="share of relays dropped per storm")
+    parser.add_argument("--storm-jitter", type=float, default=2.0, help="reconnects spread over this many seconds")
+    parser.add_argument("--persistent", action="store_true",
+                        help="relays use persistent sessions and QoS 1, commands are published at QoS 1")
+    parser.add_argument("--retry-s", type=float, default=1.0, help="relay connect retry interval")
+    parser.add_argument("--connect-concurrency", type=int, default=256, help="initial connects in flight")
+    parser.add_argument("--timeout", type=float, default=5.0, help="seconds before a command counts as lost")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--json", action="store_true", help="print the report as JSON")
+    args = parser.parse_args()
+    if args.rate <= 0:
+        parser.error("--rate must be positive")
+    return asyncio.run(run(args))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,200 @@
+#!/usr/bin/env python3
+"""Relay command throughput / latency harness.
+
+Fires relay commands at CtrlBox2relayTopic the way the ControlBox does, matches
+the replies on relay2CtrlBoxTopic by their "sender" field and reports
+throughput, round-trip percentiles and loss.
+
+The device under test can be a real relay, the firmware running in QEMU, or
+--fake-relay (an in-process responder, useful to measure the harness and the
+broker alone). By default an in-process broker is started on --listen; point the
+relay at this machine with POST /api/v1/add {"ctrlBoxIP": "<host ip>", ...}.
+Use --broker HOST:PORT to go through mosquitto or any other broker instead.
+--encoding msgpack sends the compact MessagePack form (src/VMXCodec.h) on the
+"/mp" topics, for a relay set up with {"msgpack": true}; the report includes the
+average command and reply payload size either way.
+With --tls-cert/--tls-key the in-process broker only accepts TLS, as a relay
+configured with {"tls": true} expects on port 8883; the report then counts full
+and resumed handshakes.
+
+Examples:
+    python3 tools/mqtt_loadtest.py --fake-relay --count 20000 --window 32
+    python3 tools/mqtt_loadtest.py --device-id 3C61052A1B2C --rate 50 --count 2000
+    python3 tools/mqtt_loadtest.py --broker 127.0.0.1:1883 --device-id 3C61052A1B2C --window 1
+    python3 tools/mqtt_loadtest.py --listen 0.0.0.0:8883 --tls-cert broker.crt --tls-key broker.key \
+        --device-id 3C61052A1B2C
+"""
+
+import argparse
+import asyncio
+import json
+import os
+import ssl
+import sys
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import vmxmqtt  # noqa: E402
+
+
+async def wait_for_device(broker, device_id, timeout):
+    client_id = "VMXWRM" + device_id
+    deadline = time.monotonic() + timeout
+    while not broker.online(client_id):
+        if time.monotonic() > deadline:
+            raise SystemExit("relay %s did not connect within %d s" % (client_id, timeout))
+        await asyncio.sleep(0.2)
+
+
+async def run(args):
+    broker = None
+    server_ctx = client_ctx = None
+    if args.tls_cert:
+        server_ctx = ssl.create_default_context(ssl.Purpose.CLIENT_AUTH)
+        server_ctx.load_cert_chain(args.tls_cert, args.tls_key)
+        client_ctx = ssl.create_default_context()
+        client_ctx.check_hostname = False
+        client_ctx.verify_mode = ssl.CERT_NONE
+    if args.broker:
+        host, port = args.broker.rsplit(":", 1)
+        port = int(port)
+    else:
+        broker = vmxmqtt.Broker()
+        lhost, lport = args.listen.rsplit(":", 1)
+        port = await broker.start(lhost, int(lport), ssl=server_ctx)
+        host = "127.0.0.1"
+        print("broker listening on %s:%d%s" % (lhost, port, " (TLS)" if server_ctx else ""))
+
+    if args.fake_relay:
+        args.device_id = args.device_id or "FAKE00000001"
+        relay = vmxmqtt.VirtualRelay(args.device_id, ack_delay_ms=args.fake_delay_ms, topic_mode=args.topic_mode,
+                                     msgpack=args.encoding == "msgpack")
+        await relay.start(host, port, ssl=client_ctx)
+    elif not args.device_id:
+        raise SystemExit("--device-id is required unless --fake-relay is used")
+    elif broker:
+        await wait_for_device(broker, args.device_id, args.wait)
+
+    pending = {}
+    rtts = []
+    failures = [0]
+    sizes = {"command": 0, "reply": 0}
+    window = asyncio.Semaphore(args.window)
+    run_id = "%04x" % (os.getpid() & 0xFFFF)
+
+    def on_reply(topic, payload):
+        encoding = "msgpack" if topic.endswith(vmxmqtt.MSGPACK_SUFFIX) else "json"
+        try:
+            msg = vmxmqtt.decode_message(payload, encoding)
+        except ValueError:
+            return
+        t0 = pending.pop(msg.get("sender"), None)
+        if t0 is None:
+            return
+        rtts.append(time.perf_counter() - t0)
+        sizes["reply"] += len(payload)
+        if msg.get("result") != "success":
+            failures[0] += 1
+        window.release()
+
+    ctrlbox = vmxmqtt.Client("loadtest-" + run_id, on_reply)
+    await ctrlbox.connect(host, port, ssl=client_ctx)
+    await ctrlbox.subscribe(vmxmqtt.RELAY_TO_CTRLBOX)
+    if args.encoding == "msgpack":
+        await ctrlbox.subscribe(vmxmqtt.RELAY_TO_CTRLBOX + vmxmqtt.MSGPACK_SUFFIX)
+
+    async def expire(sender):
+        await asyncio.sleep(args.timeout)
+        if pending.pop(sender, None) is not None:
+            window.release()
+
+    topic = vmxmqtt.command_topic(args.device_id, args.topic_mode, args.encoding)
+    timers = []
+    start = time.perf_counter()
+    interval = 1.0 / args.rate if args.rate else 0.0
+    for seq in range(args.count):
+        await window.acquire()
+        if interval:
+            delay = start + seq * interval - time.perf_counter()
+            if delay > 0:
+                await asyncio.sleep(delay)
+        sender = "lt%s-%d" % (run_id, seq)
+        cmd = {"action": "control", "command": args.command, "deviceId": args.device_id,
+               "state": seq & 1, "sender": sender}
+        pending[sender] = time.perf_counter()
+        payload = vmxmqtt.encode_message(cmd, args.encoding)
+        sizes["command"] += len(payload)
+        ctrlbox.publish(topic, payload, args.qos)
+        timers.append(asyncio.ensure_future(expire(sender)))
+        await ctrlbox.drain()
+
+    deadline = time.perf_counter() + args.timeout
+    while pending and time.perf_counter() < deadline:
+        await asyncio.sleep(0.01)
+    elapsed = time.perf_counter() - start
+    for t in timers:
+        t.cancel()
+
+    await ctrlbox.close()
+    if args.fake_relay:
+        await relay.client.close()
+    if broker:
+        await broker.stop()
+
+    rtts.sort()
+    ms = [r * 1000.0 for r in rtts]
+    report = {
+        "sent": args.count,
+        "acked": len(rtts),
+        "failed": failures[0],
+        "lost": args.count - len(rtts),
+        "loss_pct": 100.0 * (args.count - len(rtts)) / args.count if args.count else 0.0,
+        "elapsed_s": elapsed,
+        "throughput_per_s": len(rtts) / elapsed if elapsed else 0.0,
+        "rtt_ms": {"p50": vmxmqtt.percentile(ms, 50), "p99": vmxmqtt.percentile(ms, 99),
+                   "p999": vmxmqtt.percentile(ms, 99.9), "max": ms[-1] if ms else float("nan")},
+        "encoding": args.encoding,
+        "command_bytes": sizes["command"] / args.count if args.count else 0.0,
+        "reply_bytes": sizes["reply"] / len(rtts) if rtts else 0.0,
+    }
+    if broker:
+        report["broker"] = dict(broker.stats)
+    if args.json:
+        print(json.dumps(report, indent=2))
+    else:
+        print("sent %(sent)d  acked %(acked)d  failed %(failed)d  lost %(lost)d (%(loss_pct).2f%%)" % report)
+        print("throughput %.1f cmd/s over %.2f s" % (report["throughput_per_s"], elapsed))
+        print("rtt ms  p50 %(p50).2f  p99 %(p99).2f  p999 %(p999).2f  max %(max).2f" % report["rtt_ms"])
+        print("%(encoding)s payload bytes  command %(command_bytes).1f  reply %(reply_bytes).1f" % report)
+    return 0 if report["lost"] == 0 else 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--broker", help="external broker HOST:PORT (default: start an in-process broker)")
+    parser.add_argument("--listen", default="0.0.0.0:1883", help="in-process broker address (default %(default)s)")
+    parser.add_argument("--tls-cert", help="PEM certificate for the in-process broker; enables TLS")
+    parser.add_argument("--tls-key", help="PEM private key matching --tls-cert")
+    parser.add_argument("--device-id", help="relay chip_id as printed at boot / shown in /api/v1/status")
+    parser.add_argument("--fake-relay", action="store_true", help="answer commands with an in-process relay")
+    parser.add_argument("--fake-delay-ms", type=float, default=0.0, help="processing delay of the fake relay")
+    parser.add_argument("--count", type=int, default=1000, help="commands to send")
+    parser.add_argument("--rate", type=float, default=0.0, help="offered load in commands/s (0 = window bound)")
+    parser.add_argument("--window", type=int, default=1, help="maximum commands awaiting a reply")
+    parser.add_argument("--command", default="update", choices=["update", "updateByAccessControl"])
+    parser.add_argument("--topic-mode", default="legacy", choices=vmxmqtt.TOPIC_MODES,
+                        help="relay's topicMode; commands go to the device topic unless legacy")
+    parser.add_argument("--encoding", default="json", choices=vmxmqtt.ENCODINGS,
+                        help="command encoding; msgpack needs a relay set up with {\"msgpack\": true}")
+    parser.add_argument("--qos", type=int, default=0, choices=[0, 1])
+    parser.add_argument("--timeout", type=float, default=5.0, help="seconds before a command counts as lost")
+    parser.add_argument("--wait", type=float, default=60.0, help="seconds to wait for the relay to connect")
+    parser.add_argument("--json", action="store_true", help="print the report as JSON")
+    args = parser.parse_args()
+    if args.tls_cert and (args.broker or not args.tls_key):
+        parser.error("--tls-cert needs --tls-key and the in-process broker")
+    return asyncio.run(run(args))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
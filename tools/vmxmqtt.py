@@ -0,0 +1,600 @@
+"""Minimal asyncio MQTT 3.1.1 client and broker used by the host-side test tools.
+
+No third-party dependencies. Only what the relay protocol needs is implemented:
+QoS 0/1 publish, subscribe with + and # wildcards, keepalive ping and
+persistent sessions (clean session = 0: subscriptions survive a disconnect and
+QoS 1 messages are queued until the client is back). The broker keeps per-run
+counters so the tools can report message amplification and broker CPU time. VirtualRelay reproduces the relay side of
+the protocol for tools that need many devices without hardware. encode_message()
+and decode_message() speak both the JSON protocol and its compact MessagePack
+form (src/VMXCodec.h).
+"""
+
+import asyncio
+import json
+import random
+import struct
+import time
+
+CONNECT, CONNACK, PUBLISH, PUBACK = 1, 2, 3, 4
+SUBSCRIBE, SUBACK, UNSUBSCRIBE, UNSUBACK = 8, 9, 10, 11
+PINGREQ, PINGRESP, DISCONNECT = 12, 13, 14
+
+# Firmware topics (see CtrlBox2relayTopic / relay2CtrlBoxTopic in src/main.cpp)
+CTRLBOX_TO_RELAY = "VMXSys/CtrlBox2Device/relay"
+RELAY_TO_CTRLBOX = "VMXSys/Device2CtrlBox/relay"
+TOPIC_MODES = ("legacy", "device", "both")  # MQTTTOPICMODE in src/main.cpp
+ENCODINGS = ("json", "msgpack")
+MSGPACK_SUFFIX = "/mp"  # MSGPACK_TOPIC_SUFFIX in src/VMXCodec.h
+
+
+def device_topic(device_id):
+    """Per-device command topic (CtrlBox2deviceTopic)."""
+    return CTRLBOX_TO_RELAY + "/" + device_id
+
+
+def group_topic(group):
+    """Group command topic (GROUP_TOPIC_PREFIX in src/VMXGroup.h)."""
+    return "VMXSys/CtrlBox2Device/group/" + group
+
+
+def command_topic(device_id, topic_mode, encoding="json"):
+    """Topic a ControlBox publishes a command for device_id on."""
+    topic = CTRLBOX_TO_RELAY if topic_mode == "legacy" else device_topic(device_id)
+    return topic + MSGPACK_SUFFIX if encoding == "msgpack" else topic
+
+
+def msgpack_pack(obj):
+    """MessagePack for None, bool, int, float, str, list and dict; enough for the relay protocol."""
+    if obj is None:
+        return b"\xc0"
+    if obj is True or obj is False:
+        return b"\xc3" if obj else b"\xc2"
+    if isinstance(obj, int):
+        if 0 <= obj < 0x80:
+            return bytes([obj])
+        if -32 <= obj < 0:
+            return struct.pack("b", obj)
+        if 0 <= obj <= 0xFFFFFFFF:
+            return b"\xce" + struct.pack("!I", obj) if obj > 0xFFFF else \
+                (b"\xcd" + struct.pack("!H", obj) if obj > 0xFF else b"\xcc" + bytes([obj]))
+        if -0x80000000 <= obj < 0:
+            return b"\xd2" + struct.pack("!i", obj)
+        return b"\xd3" + struct.pack("!q", obj) if obj < 0 else b"\xcf" + struct.pack("!Q", obj)
+    if isinstance(obj, float):
+        return b"\xcb" + struct.pack("!d", obj)
+    if isinstance(obj, str):
+        data = obj.encode()
+        if len(data) < 32:
+            return bytes([0xA0 | len(data)]) + data
+        return (b"\xd9" + bytes([len(data)]) if len(data) < 256 else b"\xda" + struct.pack("!H", len(data))) + data
+    if isinstance(obj, (list, tuple)):
+        head = bytes([0x90 | len(obj)]) if len(obj) < 16 else b"\xdc" + struct.pack("!H", len(obj))
+        return head + b"".join(msgpack_pack(v) for v in obj)
+    if isinstance(obj, dict):
+        head = bytes([0x80 | len(obj)]) if len(obj) < 16 else b"\xde" + struct.pack("!H", len(obj))
+        return head + b"".join(msgpack_pack(k) + msgpack_pack(v) for k, v in obj.items())
+    raise TypeError("cannot pack %r" % type(obj))
+
+
+def msgpack_unpack(data):
+    """Inverse of msgpack_pack() (plus the other fixed-size int and float forms). Raises ValueError."""
+    def read(pos):
+        b = data[pos]
+        pos += 1
+        if b < 0x80:
+            return b, pos
+        if b >= 0xE0:
+            return b - 0x100, pos
+        if 0xA0 <= b < 0xC0:
+            n = b & 0x1F
+            return data[pos:pos + n].decode(), pos + n
+        if 0x90 <= b < 0xA0 or 0x80 <= b < 0x90:
+            return collection(b & 0x0F, pos, b < 0x90)
+        if b in (0xC0, 0xC2, 0xC3):
+            return {0xC0: None, 0xC2: False, 0xC3: True}[b], pos
+        fixed = {0xCC: "!B", 0xCD: "!H", 0xCE: "!I", 0xCF: "!Q", 0xD0: "!b", 0xD1: "!h", 0xD2: "!i", 0xD3: "!q",
+                 0xCA: "!f", 0xCB: "!d"}
+        if b in fixed:
+            size = struct.calcsize(fixed[b])
+            return struct.unpack(fixed[b], data[pos:pos + size])[0], pos + size
+        if b in (0xD9, 0xDA):
+            size = 1 if b == 0xD9 else 2
+            n = int.from_bytes(data[pos:pos + size], "big")
+            pos += size
+            return data[pos:pos + n].decode(), pos + n
+        if b in (0xDC, 0xDE):
+            n = struct.unpack("!H", data[pos:pos + 2])[0]
+            return collection(n, pos + 2, b == 0xDE)
+        raise ValueError("unsupported MessagePack type 0x%02x" % b)
+
+    def collection(n, pos, is_map):
+        if is_map:
+            out = {}
+            for _ in range(n):
+                k, pos = read(pos)
+                out[k], pos = read(pos)
+            return out, pos
+        out = []
+        for _ in range(n):
+            v, pos = read(pos)
+            out.append(v)
+        return out, pos
+
+    try:
+        obj, pos = read(0)
+    except (IndexError, struct.error, UnicodeDecodeError) as e:
+        raise ValueError(str(e))
+    if pos != len(data):
+        raise ValueError("trailing bytes")
+    return obj
+
+
+# Compact keys and integer enums of src/VMXCodec.h
+_COMPACT_KEYS = {"action": "a", "command": "c", "deviceId": "d", "sender": "s", "state": "v", "group": "g",
+                 "groups": "G", "at": "t", "ack": "k", "result": "r", "duration": "u", "sequence": "q"}
+_COMPACT_ENUMS = {
+    "action": ["control"],
+    "command": ["update", "updateByAccessControl", "remove", "setGroups"],
+    "ack": ["none", "each"],
+}
+_COMPACT_RESULTS = {"success": 0, "failure": -1, "device id invalid": -2, "parameter invalid": -3, "completed": 1}
+
+
+def encode_message(msg, encoding="json"):
+    """JSON protocol dict -> payload bytes."""
+    if encoding == "json":
+        return json.dumps(msg, separators=(",", ":")).encode()
+    compact = {}
+    for key, value in msg.items():
+        if key in _COMPACT_ENUMS:
+            if value not in _COMPACT_ENUMS[key]:
+                continue  # like codecCode(): unknown names are left out
+            value = _COMPACT_ENUMS[key].index(value)
+        elif key == "result":
+            value = _COMPACT_RESULTS.get(value, -1)
+        compact[_COMPACT_KEYS.get(key, key)] = value
+    return msgpack_pack(compact)
+
+
+def decode_message(payload, encoding="json"):
+    """Payload bytes -> JSON protocol dict. Raises ValueError."""
+    if encoding == "json":
+        return json.loads(payload)
+    compact = msgpack_unpack(payload)
+    if not isinstance(compact, dict):
+        raise ValueError("not a map")
+    names = {v: k for k, v in _COMPACT_KEYS.items()}
+    results = {v: k for k, v in _COMPACT_RESULTS.items()}
+    msg = {}
+    for key, value in compact.items():
+        key = names.get(key, key)
+        if key in _COMPACT_ENUMS:
+            enum = _COMPACT_ENUMS[key]
+            value = enum[value] if isinstance(value, int) and 0 <= value < len(enum) else None
+        elif key == "result":
+            value = results.get(value, "failure")
+        msg[key] = value
+    return msg
+
+
+def _encode_length(n):
+    out = bytearray()
+    while True:
+        byte = n % 128
+        n //= 128
+        out.append(byte | 0x80 if n else byte)
+        if not n:
+            return bytes(out)
+
+
+def _string(s):
+    data = s.encode() if isinstance(s, str) else s
+    return struct.pack("!H", len(data)) + data
+
+
+def packet(ptype, flags, body=b""):
+    return bytes([(ptype << 4) | flags]) + _encode_length(len(body)) + body
+
+
+async def read_packet(reader):
+    """Return (type, flags, body) or None on EOF."""
+    try:
+        first = await reader.readexactly(1)
+        mult, length = 1, 0
+        while True:
+            b = (await reader.readexactly(1))[0]
+            length += (b & 0x7F) * mult
+            if not b & 0x80:
+                break
+            mult *= 128
+        body = await reader.readexactly(length) if length else b""
+    except (asyncio.IncompleteReadError, ConnectionError):
+        return None
+    return first[0] >> 4, first[0] & 0x0F, body
+
+
+def parse_publish(flags, body):
+    tlen = struct.unpack("!H", body[:2])[0]
+    topic = body[2:2 + tlen].decode()
+    pos = 2 + tlen
+    qos = (flags >> 1) & 3
+    pid = None
+    if qos:
+        pid = struct.unpack("!H", body[pos:pos + 2])[0]
+        pos += 2
+    return topic, body[pos:], qos, pid
+
+
+def topic_matches(pattern, topic):
+    pparts, tparts = pattern.split("/"), topic.split("/")
+    for i, p in enumerate(pparts):
+        if p == "#":
+            return True
+        if i >= len(tparts) or (p != "+" and p != tparts[i]):
+            return False
+    return len(pparts) == len(tparts)
+
+
+class Client:
+    """MQTT client. on_message(topic, payload) is called for every PUBLISH."""
+
+    def __init__(self, client_id, on_message=None, keepalive=60):
+        self.client_id = client_id
+        self.on_message = on_message
+        self.keepalive = keepalive
+        self._reader = self._writer = None
+        self._pid = 0
+        self._acks = {}
+        self._tasks = []
+        self.published = 0  # PUBLISH packets sent
+        self.received = 0   # PUBLISH packets delivered to this client
+
+    def _next_pid(self):
+        self._pid = self._pid % 65535 + 1
+        return self._pid
+
+    async def connect(self, host, port, clean_session=True, ssl=None):
+        """Returns the broker's session present flag. ssl: an ssl.SSLContext for port 8883."""
+        self._reader, self._writer = await asyncio.open_connection(host, port, ssl=ssl)
+        flags = 0x02 if clean_session else 0x00
+        body = _string("MQTT") + bytes([4, flags]) + struct.pack("!H", self.keepalive) + _string(self.client_id)
+        self._writer.write(packet(CONNECT, 0, body))
+        pkt = await read_packet(self._reader)
+        if not pkt or pkt[0] != CONNACK or pkt[2][1] != 0:
+            raise ConnectionError("MQTT connect refused: %r" % (pkt,))
+        self._tasks = [asyncio.ensure_future(self._read_loop()), asyncio.ensure_future(self._ping_loop())]
+        return bool(pkt[2][0] & 0x01)
+
+    async def subscribe(self, topic, qos=0):
+        pid = self._next_pid()
+        fut = self._acks[pid] = asyncio.get_event_loop().create_future()
+        self._writer.write(packet(SUBSCRIBE, 2, struct.pack("!H", pid) + _string(topic) + bytes([qos])))
+        await fut
+
+    def publish(self, topic, payload, qos=0):
+        if isinstance(payload, str):
+            payload = payload.encode()
+        body = _string(topic)
+        fut = None
+        if qos:
+            pid = self._next_pid()
+            body += struct.pack("!H", pid)
+            fut = self._acks[pid] = asyncio.get_event_loop().create_future()
+        self._writer.write(packet(PUBLISH, qos << 1, body + payload))
+        self.published += 1
+        return fut
+
+    def connected(self):
+        return self._writer is not None and not self._writer.is_closing()
+
+    async def drain(self):
+        await self._writer.drain()
+
+    async def close(self):
+        for t in self._tasks:
+            t.cancel()
+        if self._writer:
+            try:
+                self._writer.write(packet(DISCONNECT, 0))
+                self._writer.close()
+            except ConnectionError:
+                pass
+
+    def abort(self):
+        """Drop the TCP connection without DISCONNECT, like a Wi-Fi blip."""
+        for t in self._tasks:
+            t.cancel()
+        if self._writer:
+            self._writer.transport.abort()
+
+    async def _ping_loop(self):
+        while True:
+            await asyncio.sleep(self.keepalive / 2)
+            self._writer.write(packet(PINGREQ, 0))
+
+    async def _read_loop(self):
+        while True:
+            pkt = await read_packet(self._reader)
+            if pkt is None:
+                return
+            ptype, flags, body = pkt
+            if ptype == PUBLISH:
+                topic, payload, qos, pid = parse_publish(flags, body)
+                self.received += 1
+                if qos:
+                    self._writer.write(packet(PUBACK, 0, struct.pack("!H", pid)))
+                if self.on_message:
+                    self.on_message(topic, payload)
+            elif ptype in (PUBACK, SUBACK, UNSUBACK):
+                fut = self._acks.pop(struct.unpack("!H", body[:2])[0], None)
+                if fut and not fut.done():
+                    fut.set_result(True)
+
+
+class Broker:
+    """In-process MQTT broker stand-in. Publishes are forwarded at
+    min(publish QoS, subscription QoS) to every subscriber; QoS 1 messages for
+    an offline persistent session are queued (up to queue_limit) and sent
+    when it reconnects. Outgoing QoS 1 is not retransmitted."""
+
+    def __init__(self, queue_limit=1000):
+        # client id -> {"subs": {topic: qos}, "writer": w or None while offline, "pid": n,
+        #               "clean": bool, "queue": [(topic, payload, qos)]}
+        self.sessions = {}
+        self.queue_limit = queue_limit
+        self.stats = {"connects": 0, "resumed": 0, "msgs_in": 0, "msgs_out": 0, "queued": 0, "dropped": 0,
+                      "bytes_in": 0, "bytes_out": 0, "tls_full": 0, "tls_resumed": 0}
+        self._server = None
+        self._cpu_start = time.process_time()
+
+    async def start(self, host="0.0.0.0", port=1883, ssl=None):
+        """ssl: an ssl.SSLContext to accept MQTT over TLS (the relays' port 8883)."""
+        # Large backlog so a reconnect storm measures the broker, not the listen queue.
+        self._server = await asyncio.start_server(self._handle, host, port, backlog=1024, ssl=ssl)
+        return self._server.sockets[0].getsockname()[1]
+
+    def online(self, client_id):
+        session = self.sessions.get(client_id)
+        return session is not None and session["writer"] is not None
+
+    async def stop(self):
+        for session in list(self.sessions.values()):
+            if session["writer"]:
+                session["writer"].transport.abort()
+        self._server.close()
+        await self._server.wait_closed()
+        await asyncio.sleep(0.05)  # let the connection handlers finish
+
+    def cpu_seconds(self):
+        """Process CPU time since start. Shared with the tool in the same process."""
+        return time.process_time() - self._cpu_start
+
+    def _send(self, writer, data):
+        self.stats["bytes_out"] += len(data)
+        writer.write(data)
+
+    def _deliver(self, topic, payload, qos):
+        for session in self.sessions.values():
+            sub_qos = max((q for t, q in session["subs"].items() if topic_matches(t, topic)), default=None)
+            if sub_qos is None:
+                continue
+            out_qos = min(qos, sub_qos)
+            if session["writer"] is None:
+                if out_qos and len(session["queue"]) < self.queue_limit:
+                    session["queue"].append((topic, payload, out_qos))
+                    self.stats["queued"] += 1
+                else:
+                    self.stats["dropped"] += 1
+                continue
+            self._publish_to(session, topic, payload, out_qos)
+
+    def _publish_to(self, session, topic, payload, qos):
+        body = _string(topic)
+        if qos:
+            session["pid"] = session["pid"] % 65535 + 1
+            body += struct.pack("!H", session["pid"])
+        self.stats["msgs_out"] += 1
+        self._send(session["writer"], packet(PUBLISH, qos << 1, body + payload))
+
+    async def _handle(self, reader, writer):
+        tls = writer.get_extra_info("ssl_object")
+        if tls is not None:
+            self.stats["tls_resumed" if tls.session_reused else "tls_full"] += 1
+        pkt = await read_packet(reader)
+        if not pkt or pkt[0] != CONNECT:
+            writer.close()
+            return
+        body = pkt[2]
+        name_len = struct.unpack("!H", body[:2])[0]
+        clean = bool(body[2 + name_len + 1] & 0x02)
+        pos = 2 + name_len + 4
+        cid_len = struct.unpack("!H", body[pos:pos + 2])[0]
+        client_id = body[pos + 2:pos + 2 + cid_len].decode()
+
+        old = self.sessions.get(client_id)
+        if old and old["writer"]:
+            old["writer"].transport.abort()
+            old["writer"] = None
+        present = bool(old) and not clean and not old["clean"]
+        if present:
+            session = old
+            self.stats["resumed"] += 1
+        else:
+            session = {"subs": {}, "pid": 0, "queue": []}
+        session["writer"] = writer
+        session["clean"] = clean
+        self.sessions[client_id] = session
+        self.stats["connects"] += 1
+        self._send(writer, packet(CONNACK, 0, bytes([1 if present else 0, 0])))
+        queued, session["queue"] = session["queue"], []
+        for topic, payload, qos in queued:
+            self._publish_to(session, topic, payload, qos)
+
+        try:
+            while True:
+                pkt = await read_packet(reader)
+                if pkt is None:
+                    break
+                ptype, flags, body = pkt
+                self.stats["bytes_in"] += len(body) + 2
+                if ptype == PUBLISH:
+                    topic, payload, qos, pid = parse_publish(flags, body)
+                    self.stats["msgs_in"] += 1
+                    if qos:
+                        self._send(writer, packet(PUBACK, 0, struct.pack("!H", pid)))
+                    self._deliver(topic, payload, qos)
+                elif ptype == SUBSCRIBE:
+                    pid = body[:2]
+                    pos, granted = 2, bytearray()
+                    while pos < len(body):
+                        tlen = struct.unpack("!H", body[pos:pos + 2])[0]
+                        topic = body[pos + 2:pos + 2 + tlen].decode()
+                        qos = min(body[pos + 2 + tlen], 1)
+                        session["subs"][topic] = qos
+                        granted.append(qos)
+                        pos += 3 + tlen
+                    self._send(writer, packet(SUBACK, 0, pid + bytes(granted)))
+                elif ptype == UNSUBSCRIBE:
+                    pos = 2
+                    while pos < len(body):
+                        tlen = struct.unpack("!H", body[pos:pos + 2])[0]
+                        session["subs"].pop(body[pos + 2:pos + 2 + tlen].decode(), None)
+                        pos += 2 + tlen
+                    self._send(writer, packet(UNSUBACK, 0, body[:2]))
+                elif ptype == PINGREQ:
+                    self._send(writer, packet(PINGRESP, 0))
+                elif ptype == DISCONNECT:
+                    break
+        finally:
+            if self.sessions.get(client_id) is session and session["writer"] is writer:
+                if session["clean"]:
+                    del self.sessions[client_id]
+                else:
+                    session["writer"] = None
+            writer.close()
+
+
+class VirtualRelay:
+    """Relay side of the protocol as implemented by mqttBrokerCallback() and
+    applyDeviceCommand() in src/main.cpp: client id "VMXWRM" + chip_id, a
+    "connect" announcement after every connect, one reply per command, and a
+    "device id invalid" reply to every command addressed to another relay.
+    topic_mode selects the subscriptions like eeprom_topic_mode; groups are
+    handled like handleGroupCommand(). msgpack=True adds the MessagePack topics
+    like MQTTFLAG_MSGPACK; replies use the encoding of the command.
+    on_actuate(sender, wall_time) is called whenever the relay switches."""
+
+    def __init__(self, device_id, ack_delay_ms=0.0, ack_jitter_ms=0.0, ack_loss=0.0, rng=None,
+                 topic_mode="legacy", groups=(), on_actuate=None, persistent=False, msgpack=False):
+        self.device_id = device_id
+        self.msgpack = msgpack
+        self.persistent = persistent
+        self.session_present = False
+        self._subscribed = False
+        self.topic_mode = topic_mode
+        self.groups = list(groups)
+        self.on_actuate = on_actuate
+        self.ack_delay = ack_delay_ms / 1000.0
+        self.ack_jitter = ack_jitter_ms / 1000.0
+        self.ack_loss = ack_loss
+        self.rng = rng or random.Random()
+        self.state = 0
+        self.sender = ""  # reqSender: last sender whose command was applied
+        self.commands = 0
+        self.client = Client("VMXWRM" + device_id, self._on_message, keepalive=90)
+
+    async def start(self, host, port, ssl=None):
+        # Like connectToMQTTBroker(): QoS 1 subscriptions on a persistent session,
+        # skipped when the broker resumed it and they were made since "boot".
+        self.session_present = await self.client.connect(host, port, clean_session=not self.persistent, ssl=ssl)
+        if not (self.session_present and self._subscribed):
+            topics = []
+            if self.topic_mode != "device":
+                topics.append(CTRLBOX_TO_RELAY)
+            if self.topic_mode != "legacy":
+                topics.append(device_topic(self.device_id))
+            topics += [group_topic(group) for group in self.groups]
+            for topic in topics:
+                await self.client.subscribe(topic, 1 if self.persistent else 0)
+                if self.msgpack:
+                    await self.client.subscribe(topic + MSGPACK_SUFFIX, 1 if self.persistent else 0)
+            self._subscribed = True
+        self._publish({"action": "control", "command": "connect", "deviceId": self.device_id,
+                       "state": self.state, "sender": self.sender}, delay=0.0)
+
+    def _publish(self, reply, delay=None, encoding="json"):
+        data = encode_message(reply, encoding)
+        topic = RELAY_TO_CTRLBOX + MSGPACK_SUFFIX if encoding == "msgpack" else RELAY_TO_CTRLBOX
+        if delay is None:
+            delay = self.ack_delay + (self.rng.uniform(0, self.ack_jitter) if self.ack_jitter else 0.0)
+        if delay:
+            asyncio.get_event_loop().call_later(delay, self._send, topic, data)
+        else:
+            self._send(topic, data)
+
+    def _send(self, topic, data):
+        if self.client.connected():
+            self.client.publish(topic, data)
+
+    def _on_message(self, topic, payload):
+        encoding = "json"
+        if topic.endswith(MSGPACK_SUFFIX):
+            topic, encoding = topic[:-len(MSGPACK_SUFFIX)], "msgpack"
+        try:
+            msg = decode_message(payload, encoding)
+        except ValueError:
+            return
+        action, command, device_id, sender = (msg.get("action"), msg.get("command"),
+                                              msg.get("deviceId"), msg.get("sender"))
+        if topic.startswith(group_topic("")):
+            self._on_group_message(topic[len(group_topic("")):], msg, encoding)
+            return
+        reply = {"action": action, "command": command, "deviceId": device_id, "sender": sender}
+        if device_id != self.device_id:
+            reply["result"] = "device id invalid"
+        elif action == "control" and command in ("update", "updateByAccessControl"):
+            self.commands += 1
+            if self.ack_loss and self.rng.random() < self.ack_loss:
+                return
+            self._switch(msg.get("state"), sender)
+            reply["state"] = self.state
+            reply["result"] = "success"
+        elif action == "control" and command == "remove":
+            reply["result"] = "completed"
+        else:
+            reply["result"] = "failure"
+        self._publish(reply, encoding=encoding)
+
+
+    def _switch(self, state, sender):
+        self.state = 1 if state == 1 else 0
+        self.sender = sender or ""
+        if self.on_actuate:
+            self.on_actuate(self.sender, time.time())
+
+    def _on_group_message(self, group, msg, encoding):
+        command, sender = msg.get("command"), msg.get("sender") or ""
+        if msg.get("action") != "control" or command not in ("update", "updateByAccessControl"):
+            return
+        self.commands += 1
+        if self.ack_loss and self.rng.random() < self.ack_loss:
+            return
+        at = msg.get("at")
+        delay = max(0.0, at / 1000.0 - time.time()) if at else 0.0
+        state = msg.get("state")
+        if delay:
+            asyncio.get_event_loop().call_later(delay, self._switch, state, sender)
+        else:
+            self._switch(state, sender)
+        if msg.get("ack") == "each":
+            self._publish({"state": 1 if state == 1 else 0, "action": "control", "command": command,
+                           "deviceId": self.device_id, "sender": sender, "group": group, "result": "success"},
+                          encoding=encoding)
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return float("nan")
+    k = min(len(sorted_values) - 1, int(round(p / 100.0 * (len(sorted_values) - 1))))
+    return sorted_values[k]
@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+"""Event trace converter: relay trace ring to Chrome trace JSON.
+
+Reads the binary dump of GET /api/v1/trace (firmware built with -DVMX_TRACE,
+env nodemcu-32s-trace; layout in src/VMXTrace.h, Tracer::dump()) from a file or
+straight from the relay, and writes Chrome trace JSON that opens in Perfetto
+(ui.perfetto.dev) or chrome://tracing. Each task is a track; begin/end pairs
+become slices. Cycle counts are put on esp_timer time with the per-core anchors
+in the dump, so both cores share one timeline.
+
+Examples:
+    python3 tools/vmxtrace.py trace.bin -o trace.json
+    python3 tools/vmxtrace.py --url http://192.168.1.50/api/v1/trace --token <ClientID> -o trace.json
+"""
+
+import argparse
+import json
+import struct
+import sys
+import urllib.request
+
+MAGIC = b"VMXT"
+HEADER = struct.Struct("<4sHHIII")
+ANCHOR = struct.Struct("<Qq")
+NAME_SIZE = 16
+EVENT = struct.Struct("<IHBB")
+END_FLAG = 0x80
+CORE_FLAG = 0x40
+TASK_MASK = 0x3F
+
+
+def _name(raw):
+    return raw.split(b"\0", 1)[0].decode("ascii", "replace")
+
+
+def parse(data):
+    """Returns (header dict, list of (ts_us, core, task, id, end))."""
+    magic, version, event_size, cpu_hz, count, dropped = HEADER.unpack_from(data, 0)
+    if magic != MAGIC:
+        raise ValueError("not a VMXT trace dump")
+    if version != 1 or event_size != EVENT.size:
+        raise ValueError(f"unsupported trace version {version}, event size {event_size}")
+    pos = HEADER.size
+    anchors = []
+    for _ in range(2):
+        anchors.append(ANCHOR.unpack_from(data, pos))
+        pos += ANCHOR.size
+    names = []
+    for _ in range(2):
+        n = data[pos]
+        pos += 1
+        names.append([_name(data[pos + i * NAME_SIZE:pos + (i + 1) * NAME_SIZE]) for i in range(n)])
+        pos += n * NAME_SIZE
+    ids, tasks = names
+    cycles_per_us = cpu_hz / 1e6
+    events = []
+    for i in range(count):
+        low, high, evt_id, info = EVENT.unpack_from(data, pos + i * EVENT.size)
+        core = 1 if info & CORE_FLAG else 0
+        anchor_cycles, anchor_us = anchors[core]
+        cycles = (high << 32) | low
+        ts = anchor_us - (anchor_cycles - cycles) / cycles_per_us
+        events.append((ts, core, info & TASK_MASK, evt_id, bool(info & END_FLAG)))
+    header = {"version": version, "cpu_hz": cpu_hz, "events": count, "dropped": dropped,
+              "ids": ids, "tasks": tasks}
+    return header, events
+
+
+def to_chrome(header, events):
+    ids, tasks = header["ids"], header["tasks"]
+    out = [{"name": "process_name", "ph": "M", "pid": 1, "args": {"name": "relay"}}]
+    for index, name in enumerate(tasks):
+        out.append({"name": "thread_name", "ph": "M", "pid": 1, "tid": index, "args": {"name": name}})
+    # The ring starts anywhere: drop ends whose begin was overwritten.
+    depth = {}
+    for ts, core, task, evt_id, end in sorted(events, key=lambda e: e[0]):
+        if end:
+            if not depth.get(task):
+                continue
+            depth[task] -= 1
+        else:
+            depth[task] = depth.get(task, 0) + 1
+        name = ids[evt_id] if evt_id < len(ids) else f"id{evt_id}"
+        out.append({"name": name, "ph": "E" if end else "B", "ts": round(ts, 3), "pid": 1, "tid": task,
+                    "args": {"core": core}})
+    return {"traceEvents": out, "displayTimeUnit": "ms",
+            "otherData": {"dropped": header["dropped"], "cpu_hz": header["cpu_hz"]}}
+
+
+def fetch(url, token):
+    req = urllib.request.Request(url)
+    if token:
+        req.add_header("Cookie", f"ClientID={token}")
+    with urllib.request.urlopen(req, timeout=10) as res:
+        return res.read()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("dump", nargs="?", help="binary dump of GET /api/v1/trace ('-' for stdin)")
+    parser.add_argument("--url", help="fetch the dump from this URL instead")
+    parser.add_argument("--token", help="ClientID cookie value for --url")
+    parser.add_argument("-o", "--output", default="-", help="Chrome trace JSON file (default stdout)")
+    args = parser.parse_args()
+
+    if args.url:
+        data = fetch(args.url, args.token)
+    elif args.dump == "-":
+        data = sys.stdin.buffer.read()
+    elif args.dump:
+        with open(args.dump, "rb") as f:
+            data = f.read()
+    else:
+        parser.error("give a dump file or --url")
+
+    header, events = parse(data)
+    trace = to_chrome(header, events)
+    print(f"{header['events']} events, {header['dropped']} dropped, tasks: {', '.join(header['tasks'])}",
+          file=sys.stderr)
+    if args.output == "-":
+        json.dump(trace, sys.stdout)
+    else:
+        with open(args.output, "w") as f:
+            json.dump(trace, f)
+
+
+if __name__ == "__main__":
+    main()